@@ -1,15 +1,25 @@
 #include "devices/disk.h"
 #include <ctype.h>
 #include <debug.h>
+#include <list.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "devices/timer.h"
+#include "threads/malloc.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].
+
+   Other kinds of disks, such as RAM disks, register themselves
+   with disk_register() and provide their own way of carrying out
+   requests; everything above the request level is shared. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -28,10 +38,28 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE port addresses. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0)  /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)   /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)     /* PRD table. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+
+/* Bus master Status Register bits. */
+#define BM_STA_ERR 0x02         /* Transfer failed (write 1 to clear). */
+#define BM_STA_INTR 0x04        /* Disk interrupted (write 1 to clear). */
+
+/* PCI Command Register bits. */
+#define PCI_CMD_IO 0x0001       /* Respond to I/O space accesses. */
+#define PCI_CMD_BUS_MASTER 0x0004   /* May act as bus master. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -47,28 +75,81 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Latency histograms have a bucket for each power of 2
+   microseconds, the last one taking everything longer. */
+#define HIST_BUCKETS 20
 
-/* An ATA device. */
+/* A disk: an ATA device, or one added with disk_register(). */
 struct disk {
 	char name[8];               /* Name, e.g. "hd0:1". */
+	const struct disk_ops *ops; /* Carries out requests. */
+	void *aux;                  /* Data of a registered disk. */
+	struct list_elem elem;      /* Element in registered_disks. */
 	struct channel *channel;    /* Channel disk is on. */
 	int dev_no;                 /* Device 0 or 1 for master or slave. */
 
 	bool is_ata;                /* 1=This device is an ATA disk. */
 	disk_sector_t capacity;     /* Capacity in sectors (if is_ata). */
+	size_t multiple;            /* Sectors per interrupt of READ/WRITE
+								   MULTIPLE, 1 if not supported. */
+	bool dma;                   /* Transfer by DMA? */
 
 	long long read_cnt;         /* Number of sectors read. */
 	long long write_cnt;        /* Number of sectors written. */
+	long long read_cmd_cnt;     /* Number of read commands. */
+	long long write_cmd_cnt;    /* Number of write commands. */
+	long long origin_read[DISK_ORIGIN_CNT];     /* Sectors read, by origin. */
+	long long origin_write[DISK_ORIGIN_CNT];    /* Sectors written, by origin. */
+
+	/* Statistics kept by the channel's I/O thread. */
+	disk_sector_t next_sector;  /* Sector after the last command's. */
+	long long seq_cnt;          /* Commands starting at NEXT_SECTOR. */
+	long long random_cnt;       /* Other commands. */
+	long long queue_hist[HIST_BUCKETS];     /* Requests by time queued. */
+	long long service_hist[HIST_BUCKETS];   /* Requests by time in service. */
 };
 
+/* Names of the values of enum disk_origin. */
+static const char *origin_names[DISK_ORIGIN_CNT] = {
+	"other", "swap", "inode data", "inode metadata", "free map/FAT",
+	"page cache", "journal",
+};
+
+/* Disks added with disk_register(). */
+static struct list registered_disks;
+
+/* TSC cycles per microsecond. */
+static uint64_t tsc_per_us;
+
 /* An ATA channel (aka controller).
    Each channel can control up to two disks. */
 struct channel {
 	char name[8];               /* Name, e.g. "hd0". */
 	uint16_t reg_base;          /* Base I/O port. */
 	uint8_t irq;                /* Interrupt in use. */
-
-	struct lock lock;           /* Must acquire to access the controller. */
+	uint16_t bm_base;           /* Bus master I/O port, 0 if no DMA. */
+	struct prd *prdt;           /* PRD table for DMA transfers. */
+
+	struct lock queue_lock;     /* Protects QUEUE. */
+	struct list queue;          /* Requests not yet started. */
+	struct condition queue_ready;   /* Signaled when QUEUE gets a request. */
+	uint64_t head_pos;          /* Position after the last transfer. */
+
+	/* The command in progress, used by the I/O thread only. */
+	struct list batch;          /* Requests it carries out, in order. */
+	struct disk *batch_disk;    /* Disk. */
+	disk_sector_t batch_sector; /* First sector. */
+	size_t batch_cnt;           /* Number of sectors. */
+	bool batch_write;           /* Write, or read? */
+	uint8_t *sectors[DISK_MULTI_MAX];   /* Address of each sector. */
+
+	const struct disk *selected;    /* Disk selected last, if known. */
 	bool expecting_interrupt;   /* True if an interrupt is expected, false if
 								   any interrupt would be spurious. */
 	struct semaphore completion_wait;   /* Up'd by interrupt handler. */
@@ -83,24 +164,44 @@ static struct channel channels[CHANNEL_CNT];
 static void reset_channel (struct channel *);
 static bool check_device_type (struct disk *);
 static void identify_ata_device (struct disk *);
+static void set_multiple_mode (struct disk *, size_t multiple);
 
-static void select_sector (struct disk *, disk_sector_t);
+static void select_sector (struct disk *, disk_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
-static void input_sector (struct channel *, void *);
-static void output_sector (struct channel *, const void *);
+static void input_sectors (struct channel *, void *, size_t cnt);
+static void output_sectors (struct channel *, const void *, size_t cnt);
+
+static void ata_submit (struct disk_request *);
+static void io_daemon (void *channel);
+static bool dma_transfer (struct channel *);
+static uint16_t find_bus_master (void);
 
+static bool poll_status (const struct disk *, uint8_t mask);
+static bool wait_for_data (const struct disk *);
 static void wait_until_idle (const struct disk *);
 static bool wait_while_busy (const struct disk *);
 static void select_device (const struct disk *);
 static void select_device_wait (const struct disk *);
 
 static void interrupt_handler (struct intr_frame *);
+static void calibrate_tsc (void);
+static void print_disk_details (const struct disk *);
+static void print_disk_origins (const struct disk *);
+
+/* ATA disks queue requests on their channel. */
+static const struct disk_ops ata_ops = {
+	.submit = ata_submit,
+};
 
 /* Initialize the disk subsystem and detect disks. */
 void
 disk_init (void) {
+	uint16_t bm_base = find_bus_master ();
 	size_t chan_no;
 
+	calibrate_tsc ();
+	list_init (&registered_disks);
+
 	for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++) {
 		struct channel *c = &channels[chan_no];
 		int dev_no;
@@ -119,7 +220,14 @@ disk_init (void) {
 			default:
 				NOT_REACHED ();
 		}
-		lock_init (&c->lock);
+		c->bm_base = bm_base != 0 ? bm_base + chan_no * 8 : 0;
+		c->prdt = bm_base != 0 ? palloc_get_page (PAL_ASSERT) : NULL;
+		lock_init (&c->queue_lock);
+		list_init (&c->queue);
+		cond_init (&c->queue_ready);
+		c->head_pos = 0;
+		list_init (&c->batch);
+		c->selected = NULL;
 		c->expecting_interrupt = false;
 		sema_init (&c->completion_wait, 0);
 
@@ -127,13 +235,18 @@ disk_init (void) {
 		for (dev_no = 0; dev_no < 2; dev_no++) {
 			struct disk *d = &c->devices[dev_no];
 			snprintf (d->name, sizeof d->name, "%s:%d", c->name, dev_no);
+			d->ops = &ata_ops;
+			d->aux = NULL;
 			d->channel = c;
 			d->dev_no = dev_no;
 
 			d->is_ata = false;
 			d->capacity = 0;
+			d->multiple = 1;
+			d->dma = false;
 
 			d->read_cnt = d->write_cnt = 0;
+			d->read_cmd_cnt = d->write_cmd_cnt = 0;
 		}
 
 		/* Register interrupt handler. */
@@ -150,6 +263,10 @@ disk_init (void) {
 		for (dev_no = 0; dev_no < 2; dev_no++)
 			if (c->devices[dev_no].is_ata)
 				identify_ata_device (&c->devices[dev_no]);
+
+		/* Serve requests from now on. */
+		if (c->devices[0].is_ata || c->devices[1].is_ata)
+			thread_create (c->name, PRI_MAX, io_daemon, c);
 	}
 
 	/* DO NOT MODIFY BELOW LINES. */
@@ -159,6 +276,7 @@ disk_init (void) {
 /* Prints disk statistics. */
 void
 disk_print_stats (void) {
+	struct list_elem *e;
 	int chan_no;
 
 	for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++) {
@@ -166,11 +284,112 @@ disk_print_stats (void) {
 
 		for (dev_no = 0; dev_no < 2; dev_no++) {
 			struct disk *d = disk_get (chan_no, dev_no);
-			if (d != NULL && d->is_ata)
-				printf ("%s: %lld reads, %lld writes\n",
-						d->name, d->read_cnt, d->write_cnt);
+			if (d != NULL && d->is_ata) {
+				printf ("%s: %lld reads, %lld writes"
+						" (%lld read commands, %lld write commands)\n",
+						d->name, d->read_cnt, d->write_cnt,
+						d->read_cmd_cnt, d->write_cmd_cnt);
+				if (d->read_cmd_cnt + d->write_cmd_cnt > 0)
+					print_disk_details (d);
+			}
 		}
 	}
+	for (e = list_begin (&registered_disks); e != list_end (&registered_disks);
+			e = list_next (e)) {
+		struct disk *d = list_entry (e, struct disk, elem);
+
+		printf ("%s: %lld reads, %lld writes\n",
+				d->name, d->read_cnt, d->write_cnt);
+		print_disk_origins (d);
+	}
+}
+
+/* Prints the detailed statistics of disk D: how its commands
+   follow each other, how long its requests took, and what they
+   were for. */
+static void
+print_disk_details (const struct disk *d) {
+	int i;
+
+	printf ("%s: %lld sequential, %lld random commands\n",
+			d->name, d->seq_cnt, d->random_cnt);
+	printf ("%s: requests by microseconds queued / in service:\n", d->name);
+	for (i = 0; i < HIST_BUCKETS; i++)
+		if (d->queue_hist[i] != 0 || d->service_hist[i] != 0)
+			printf ("  %s%7llu: %8lld / %lld\n",
+					i == HIST_BUCKETS - 1 ? ">=" : "  ",
+					i == 0 ? 0ULL : 1ULL << i,
+					d->queue_hist[i], d->service_hist[i]);
+	print_disk_origins (d);
+}
+
+/* Prints what disk D's sectors were read and written for. */
+static void
+print_disk_origins (const struct disk *d) {
+	int i;
+
+	for (i = 0; i < DISK_ORIGIN_CNT; i++)
+		if (d->origin_read[i] != 0 || d->origin_write[i] != 0)
+			printf ("%s: %s: %lld sectors read, %lld written\n",
+					d->name, origin_names[i],
+					d->origin_read[i], d->origin_write[i]);
+}
+
+/* Charges the disk I/O of the running thread to ORIGIN, until the
+   next call, and returns the origin charged before.  Callers
+   restore it when done, so that the innermost origin applies. */
+enum disk_origin
+disk_set_origin (enum disk_origin origin) {
+	struct thread *t = thread_current ();
+	enum disk_origin old = t->disk_origin;
+
+	ASSERT (origin < DISK_ORIGIN_CNT);
+	t->disk_origin = origin;
+	return old;
+}
+
+/* Reads the CPU's time stamp counter. */
+static inline uint64_t
+rdtsc (void) {
+	uint32_t lo, hi;
+
+	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+	return (uint64_t) hi << 32 | lo;
+}
+
+/* Measures the time stamp counter's rate over one timer tick. */
+static void
+calibrate_tsc (void) {
+	int64_t start = timer_ticks ();
+	uint64_t tsc;
+
+	while (timer_ticks () == start)
+		continue;
+	tsc = rdtsc ();
+	start = timer_ticks ();
+	while (timer_ticks () == start)
+		continue;
+	tsc_per_us = (rdtsc () - tsc) * TIMER_FREQ / 1000000;
+	if (tsc_per_us == 0)
+		tsc_per_us = 1;
+}
+
+/* Returns the current time in microseconds. */
+static uint64_t
+now_us (void) {
+	return rdtsc () / tsc_per_us;
+}
+
+/* Adds a sample of US microseconds to histogram HIST. */
+static void
+hist_add (long long hist[HIST_BUCKETS], uint64_t us) {
+	int bucket = 0;
+
+	while (us >= 2 && bucket < HIST_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	hist[bucket]++;
 }
 
 /* Returns the disk numbered DEV_NO--either 0 or 1 for master or
@@ -194,6 +413,64 @@ disk_get (int chan_no, int dev_no) {
 	return NULL;
 }
 
+/* Returns the disk named NAME, e.g. "hd1:1" or the name of a
+   registered disk, or a null pointer if there is none. */
+struct disk *
+disk_find (const char *name) {
+	struct list_elem *e;
+	int chan_no, dev_no;
+
+	for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
+		for (dev_no = 0; dev_no < 2; dev_no++) {
+			struct disk *d = disk_get (chan_no, dev_no);
+			if (d != NULL && !strcmp (d->name, name))
+				return d;
+		}
+	for (e = list_begin (&registered_disks); e != list_end (&registered_disks);
+			e = list_next (e)) {
+		struct disk *d = list_entry (e, struct disk, elem);
+		if (!strcmp (d->name, name))
+			return d;
+	}
+	return NULL;
+}
+
+/* Adds a disk named NAME of CAPACITY sectors, whose requests are
+   carried out by OPS, and returns it.  AUX is available to OPS
+   through disk_aux().  Must be called after disk_init(). */
+struct disk *
+disk_register (const char *name, disk_sector_t capacity,
+		const struct disk_ops *ops, void *aux) {
+	struct disk *d;
+
+	ASSERT (ops != NULL && ops->submit != NULL);
+	ASSERT (disk_find (name) == NULL);
+
+	d = calloc (1, sizeof *d);
+	if (d == NULL)
+		PANIC ("%s: out of memory", name);
+	strlcpy (d->name, name, sizeof d->name);
+	d->ops = ops;
+	d->aux = aux;
+	d->dev_no = -1;
+	d->capacity = capacity;
+	d->multiple = 1;
+	list_push_back (&registered_disks, &d->elem);
+	return d;
+}
+
+/* Returns the AUX given to disk_register() for disk D. */
+void *
+disk_aux (const struct disk *d) {
+	return d->aux;
+}
+
+/* Returns disk D's name. */
+const char *
+disk_name (const struct disk *d) {
+	return d->name;
+}
+
 /* Returns the size of disk D, measured in DISK_SECTOR_SIZE-byte
    sectors. */
 disk_sector_t
@@ -209,21 +486,7 @@ disk_size (struct disk *d) {
    per-disk locking is unneeded. */
 void
 disk_read (struct disk *d, disk_sector_t sec_no, void *buffer) {
-	struct channel *c;
-
-	ASSERT (d != NULL);
-	ASSERT (buffer != NULL);
-
-	c = d->channel;
-	lock_acquire (&c->lock);
-	select_sector (d, sec_no);
-	issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-	sema_down (&c->completion_wait);
-	if (!wait_while_busy (d))
-		PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-	input_sector (c, buffer);
-	d->read_cnt++;
-	lock_release (&c->lock);
+	disk_read_multi (d, sec_no, buffer, 1);
 }
 
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
@@ -233,23 +496,571 @@ disk_read (struct disk *d, disk_sector_t sec_no, void *buffer) {
    per-disk locking is unneeded. */
 void
 disk_write (struct disk *d, disk_sector_t sec_no, const void *buffer) {
-	struct channel *c;
+	disk_write_multi (d, sec_no, buffer, 1);
+}
 
+/* Reads the CNT consecutive sectors starting at SEC_NO from disk D
+   into BUFFER, which must have room for CNT * DISK_SECTOR_SIZE
+   bytes.  Waits for requests of up to DISK_MULTI_MAX sectors at a
+   time.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+void
+disk_read_multi (struct disk *d, disk_sector_t sec_no, void *buffer,
+		size_t cnt) {
+	struct disk_request req;
+	uint8_t *p = buffer;
+
+	while (cnt > 0) {
+		size_t n = cnt < DISK_MULTI_MAX ? cnt : DISK_MULTI_MAX;
+
+		disk_request_init (&req, d, sec_no, p, n, false, NULL, NULL);
+		disk_submit (&req);
+		disk_wait (&req);
+		sec_no += n;
+		p += n * DISK_SECTOR_SIZE;
+		cnt -= n;
+	}
+}
+
+/* Writes the CNT consecutive sectors starting at SEC_NO to disk D
+   from BUFFER, which must contain CNT * DISK_SECTOR_SIZE bytes.
+   Returns after the disk has acknowledged receiving all of the
+   data.  Waits for requests of up to DISK_MULTI_MAX sectors at a
+   time.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+void
+disk_write_multi (struct disk *d, disk_sector_t sec_no, const void *buffer,
+		size_t cnt) {
+	struct disk_request req;
+	const uint8_t *p = buffer;
+
+	while (cnt > 0) {
+		size_t n = cnt < DISK_MULTI_MAX ? cnt : DISK_MULTI_MAX;
+
+		disk_request_init (&req, d, sec_no, (void *) p, n, true, NULL, NULL);
+		disk_submit (&req);
+		disk_wait (&req);
+		sec_no += n;
+		p += n * DISK_SECTOR_SIZE;
+		cnt -= n;
+	}
+}
+
+/* Request queue.
+
+   Each channel has a queue of requests and a thread that carries
+   them out one command at a time, so submitting a request does not
+   wait for the disk.  The thread serves the queue in C-LOOK order,
+   sweeping towards higher sectors and then starting over from the
+   lowest, to keep seeks short; a request that has waited longer
+   than DISK_DEADLINE is served first, so that none starves.  The
+   requests adjacent to the one chosen, in the same direction and on
+   the same disk, are merged into the same command. */
+
+/* Ticks after which a queued request is served ahead of the
+   others. */
+#define DISK_DEADLINE (TIMER_FREQ / 2)
+
+/* Initializes REQ to transfer the CNT sectors, at most
+   DISK_MULTI_MAX, starting at SECTOR between disk D and BUFFER:
+   to the disk if WRITE is true, from it otherwise.  If DONE is
+   non-null, it is called with REQ and AUX once the transfer is
+   complete, from the thread that completes it (for an ATA disk,
+   the channel's I/O thread); otherwise the submitter waits for
+   REQ with disk_wait(). */
+void
+disk_request_init (struct disk_request *req, struct disk *d,
+		disk_sector_t sector, void *buffer, size_t cnt, bool write,
+		disk_request_func *done, void *aux) {
 	ASSERT (d != NULL);
 	ASSERT (buffer != NULL);
+	ASSERT (cnt > 0 && cnt <= DISK_MULTI_MAX);
+	ASSERT (sector < d->capacity && cnt <= d->capacity - sector);
+
+	req->disk = d;
+	req->sector = sector;
+	req->cnt = cnt;
+	req->buffer = buffer;
+	req->write = write;
+	req->done = done;
+	req->aux = aux;
+	sema_init (&req->complete, 0);
+}
 
-	c = d->channel;
-	lock_acquire (&c->lock);
-	select_sector (d, sec_no);
-	issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-	if (!wait_while_busy (d))
-		PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-	output_sector (c, buffer);
+/* Starts REQ.  An ATA disk queues it and returns at once; other
+   disks may carry it out before returning. */
+void
+disk_submit (struct disk_request *req) {
+	req->origin = thread_current ()->disk_origin;
+	req->submitted = timer_ticks ();
+	req->submit_us = now_us ();
+	req->disk->ops->submit (req);
+}
+
+/* Called by a disk's submit operation, or by whatever carries out
+   the request later, once REQ's transfer is done.  Accounts the
+   transfer and wakes up the submitter or calls its completion
+   function. */
+void
+disk_complete (struct disk_request *req) {
+	struct disk *d = req->disk;
+
+	if (req->write) {
+		d->write_cnt += req->cnt;
+		d->origin_write[req->origin] += req->cnt;
+	} else {
+		d->read_cnt += req->cnt;
+		d->origin_read[req->origin] += req->cnt;
+	}
+	if (req->done != NULL)
+		req->done (req, req->aux);
+	else
+		sema_up (&req->complete);
+}
+
+/* Queues REQ on its ATA disk's channel. */
+static void
+ata_submit (struct disk_request *req) {
+	struct channel *c = req->disk->channel;
+
+	lock_acquire (&c->queue_lock);
+	list_push_back (&c->queue, &req->elem);
+	cond_signal (&c->queue_ready, &c->queue_lock);
+	lock_release (&c->queue_lock);
+}
+
+/* Waits until REQ, submitted without a completion function, is
+   complete. */
+void
+disk_wait (struct disk_request *req) {
+	ASSERT (req->done == NULL);
+
+	sema_down (&req->complete);
+}
+
+/* Initializes batch B, with no requests. */
+void
+disk_batch_init (struct disk_batch *b) {
+	list_init (&b->done);
+	lock_init (&b->lock);
+	sema_init (&b->ready, 0);
+	b->pending = 0;
+}
+
+/* Completion function of a request of batch B_. */
+static void
+batch_complete (struct disk_request *req, void *b_) {
+	struct disk_batch *b = b_;
+
+	lock_acquire (&b->lock);
+	list_push_back (&b->done, &req->elem);
+	lock_release (&b->lock);
+	sema_up (&b->ready);
+}
+
+/* Submits REQ, initialized without a completion function, as part
+   of batch B.  Only the thread that owns B may submit to it and reap
+   it. */
+void
+disk_batch_submit (struct disk_batch *b, struct disk_request *req) {
+	ASSERT (req->done == NULL);
+
+	req->done = batch_complete;
+	req->aux = b;
+	b->pending++;
+	disk_submit (req);
+}
+
+/* Waits until a request of batch B is complete and returns it, or
+   returns a null pointer if every request submitted to B has been
+   returned already.  Requests come back in the order the disk
+   completes them, not the order they were submitted in. */
+struct disk_request *
+disk_batch_next (struct disk_batch *b) {
+	struct disk_request *req;
+
+	if (b->pending == 0)
+		return NULL;
+	sema_down (&b->ready);
+	lock_acquire (&b->lock);
+	req = list_entry (list_pop_front (&b->done), struct disk_request, elem);
+	lock_release (&b->lock);
+	b->pending--;
+	return req;
+}
+
+/* Waits until every request of batch B is complete. */
+void
+disk_batch_wait (struct disk_batch *b) {
+	while (disk_batch_next (b) != NULL)
+		continue;
+}
+
+/* Returns REQ's position for the elevator: the two devices of a
+   channel are swept one after the other. */
+static uint64_t
+request_pos (const struct disk_request *req) {
+	return (uint64_t) req->disk->dev_no << 32 | req->sector;
+}
+
+/* Chooses the next request of channel C's queue, which must not
+   be empty, and removes it.  QUEUE_LOCK must be held. */
+static struct disk_request *
+pick_request (struct channel *c) {
+	struct disk_request *oldest, *next = NULL, *lowest = NULL;
+	struct list_elem *e;
+
+	ASSERT (!list_empty (&c->queue));
+
+	oldest = list_entry (list_front (&c->queue), struct disk_request, elem);
+	if (timer_elapsed (oldest->submitted) >= DISK_DEADLINE)
+		next = oldest;
+	else
+		for (e = list_begin (&c->queue); e != list_end (&c->queue);
+				e = list_next (e)) {
+			struct disk_request *r = list_entry (e, struct disk_request, elem);
+			uint64_t pos = request_pos (r);
+
+			if (pos >= c->head_pos
+					&& (next == NULL || pos < request_pos (next)))
+				next = r;
+			if (lowest == NULL || pos < request_pos (lowest))
+				lowest = r;
+		}
+	if (next == NULL)
+		next = lowest;
+	list_remove (&next->elem);
+	return next;
+}
+
+/* Moves the requests of channel C's queue that continue the batch
+   of C, at either end, into the batch, as long as the batch stays
+   within DISK_MULTI_MAX sectors.  QUEUE_LOCK must be held. */
+static void
+merge_requests (struct channel *c) {
+	bool merged;
+
+	do {
+		struct list_elem *e;
+
+		merged = false;
+		for (e = list_begin (&c->queue); e != list_end (&c->queue);
+				e = list_next (e)) {
+			struct disk_request *r = list_entry (e, struct disk_request, elem);
+
+			if (r->disk != c->batch_disk || r->write != c->batch_write
+					|| c->batch_cnt + r->cnt > DISK_MULTI_MAX)
+				continue;
+			if (r->sector == c->batch_sector + c->batch_cnt) {
+				list_remove (e);
+				list_push_back (&c->batch, e);
+			} else if (r->sector + r->cnt == c->batch_sector) {
+				list_remove (e);
+				list_push_front (&c->batch, e);
+				c->batch_sector = r->sector;
+			} else
+				continue;
+			c->batch_cnt += r->cnt;
+			merged = true;
+			break;
+		}
+	} while (merged);
+}
+
+/* Fills in channel C's SECTORS with the address of each sector of
+   its batch, in disk order. */
+static void
+map_batch (struct channel *c) {
+	struct list_elem *e;
+	size_t i = 0;
+
+	for (e = list_begin (&c->batch); e != list_end (&c->batch);
+			e = list_next (e)) {
+		struct disk_request *r = list_entry (e, struct disk_request, elem);
+		size_t j;
+
+		for (j = 0; j < r->cnt; j++)
+			c->sectors[i++] = (uint8_t *) r->buffer + j * DISK_SECTOR_SIZE;
+	}
+	ASSERT (i == c->batch_cnt);
+}
+
+/* Returns the command that transfers CNT sectors from (if WRITE is
+   false) or to disk D by PIO. */
+static uint8_t
+transfer_command (const struct disk *d, size_t cnt, bool write) {
+	if (d->multiple > 1 && cnt > 1)
+		return write ? CMD_WRITE_MULTIPLE : CMD_READ_MULTIPLE;
+	return write ? CMD_WRITE_SECTOR_RETRY : CMD_READ_SECTOR_RETRY;
+}
+
+/* Transfers the batch of channel C with one PIO command. */
+static void
+pio_transfer (struct channel *c) {
+	struct disk *d = c->batch_disk;
+	size_t cnt = c->batch_cnt;
+	bool write = c->batch_write;
+	uint8_t cmd = transfer_command (d, cnt, write);
+	size_t per_block = (cmd == CMD_READ_MULTIPLE
+			|| cmd == CMD_WRITE_MULTIPLE) ? d->multiple : 1;
+	size_t done, i;
+
+	select_sector (d, c->batch_sector, cnt);
+	issue_pio_command (c, cmd);
+
+	/* For a read, the disk interrupts once per block of sectors
+	   ready for transfer: MULTIPLE sectors with READ MULTIPLE, one
+	   otherwise.  For a write, it asks for the first block right
+	   away and interrupts after each one it has received. */
+	for (done = 0; done < cnt; done += per_block) {
+		size_t block = per_block < cnt - done ? per_block : cnt - done;
+
+		if (!write)
+			sema_down (&c->completion_wait);
+		if (!wait_for_data (d))
+			PANIC ("%s: disk %s failed, sector=%"PRDSNu, d->name,
+					write ? "write" : "read",
+					(disk_sector_t) (c->batch_sector + done));
+		for (i = done; i < done + block; i++)
+			if (write)
+				output_sectors (c, c->sectors[i], 1);
+			else
+				input_sectors (c, c->sectors[i], 1);
+		if (write)
+			sema_down (&c->completion_wait);
+	}
+}
+
+/* Updates the statistics of the disk of channel C's batch, which
+   was in service from microsecond START to END. */
+static void
+account_batch (struct channel *c, uint64_t start, uint64_t end) {
+	struct disk *d = c->batch_disk;
+	struct list_elem *e;
+
+	if (c->batch_write)
+		d->write_cmd_cnt++;
+	else
+		d->read_cmd_cnt++;
+	if (c->batch_sector == d->next_sector)
+		d->seq_cnt++;
+	else
+		d->random_cnt++;
+	d->next_sector = c->batch_sector + c->batch_cnt;
+
+	for (e = list_begin (&c->batch); e != list_end (&c->batch);
+			e = list_next (e)) {
+		struct disk_request *r = list_entry (e, struct disk_request, elem);
+
+		hist_add (d->queue_hist, start - r->submit_us);
+		hist_add (d->service_hist, end - start);
+	}
+}
+
+/* Carries out the requests queued on channel C. */
+static void
+io_daemon (void *c_) {
+	struct channel *c = c_;
+
+	for (;;) {
+		struct disk_request *req;
+		uint64_t start;
+
+		lock_acquire (&c->queue_lock);
+		while (list_empty (&c->queue))
+			cond_wait (&c->queue_ready, &c->queue_lock);
+		req = pick_request (c);
+		list_push_back (&c->batch, &req->elem);
+		c->batch_disk = req->disk;
+		c->batch_sector = req->sector;
+		c->batch_cnt = req->cnt;
+		c->batch_write = req->write;
+		merge_requests (c);
+		lock_release (&c->queue_lock);
+
+		map_batch (c);
+		start = now_us ();
+		if (!dma_transfer (c))
+			pio_transfer (c);
+		account_batch (c, start, now_us ());
+		c->head_pos = (uint64_t) c->batch_disk->dev_no << 32
+			| (c->batch_sector + c->batch_cnt);
+
+		while (!list_empty (&c->batch)) {
+			req = list_entry (list_pop_front (&c->batch), struct disk_request,
+					elem);
+			disk_complete (req);
+		}
+	}
+}
+
+/* Bus master DMA.
+
+   A PCI IDE controller that implements bus mastering, such as
+   the PIIX emulated by QEMU, has a few registers per channel
+   besides the ATA ones.  A transfer is described by a table of
+   physical memory regions in the format below; the controller
+   moves the data while the CPU runs other threads and the disk
+   interrupts once at the end. */
+
+/* A physical region descriptor.  A region must not cross a
+   64 kB boundary. */
+struct prd {
+	uint32_t addr;              /* Physical address. */
+	uint16_t size;              /* Size in bytes, 0 for 64 kB. */
+	uint16_t flags;             /* PRD_EOT on the last entry. */
+};
+#define PRD_EOT 0x8000          /* End of table. */
+
+/* Returns true if the sector at BUFFER can be the target of a DMA
+   transfer: it must be in the kernel's mapping of physical memory,
+   below 4 GB, and word aligned. */
+static bool
+dma_buffer_ok (const uint8_t *buffer) {
+	return is_kernel_vaddr (buffer)
+		&& ((uintptr_t) buffer & 1) == 0
+		&& vtop (buffer + DISK_SECTOR_SIZE - 1) < (1ULL << 32);
+}
+
+/* Fills in channel C's PRD table to describe the sectors of its
+   batch.  Returns false if one of them is not suitable for DMA.
+   The kernel maps physical memory linearly, so consecutive
+   addresses are consecutive in physical memory as well; a region
+   never spans two pages, which keeps it within a 64 kB boundary.
+   Each sector adds at most two regions, so the table fits in a
+   page. */
+static bool
+build_prdt (struct channel *c) {
+	size_t i, n = 0;
+
+	for (i = 0; i < c->batch_cnt; i++) {
+		const uint8_t *p = c->sectors[i];
+		size_t size = DISK_SECTOR_SIZE;
+
+		if (!dma_buffer_ok (p))
+			return false;
+		while (size > 0) {
+			size_t chunk = PGSIZE - pg_ofs (p);
+			struct prd *last = n > 0 ? &c->prdt[n - 1] : NULL;
+
+			if (chunk > size)
+				chunk = size;
+			if (last != NULL && last->addr + last->size == vtop (p)
+					&& pg_ofs (p) != 0)
+				last->size += chunk;
+			else {
+				ASSERT (n < PGSIZE / sizeof *c->prdt);
+				c->prdt[n].addr = vtop (p);
+				c->prdt[n].size = chunk;
+				c->prdt[n].flags = 0;
+				n++;
+			}
+			p += chunk;
+			size -= chunk;
+		}
+	}
+	c->prdt[n - 1].flags = PRD_EOT;
+	return true;
+}
+
+/* Transfers the batch of channel C by DMA.  Returns false, without
+   transferring anything, if its disk or one of its buffers is not
+   suitable for DMA, and also if the transfer fails, after which
+   the disk uses PIO only. */
+static bool
+dma_transfer (struct channel *c) {
+	struct disk *d = c->batch_disk;
+	bool write = c->batch_write;
+	uint8_t direction = write ? 0 : BM_CMD_READ;
+	uint8_t status, bm_status;
+
+	if (!d->dma || !build_prdt (c))
+		return false;
+
+	outb (reg_bm_command (c), 0);
+	outl (reg_bm_prdt (c), vtop (c->prdt));
+	outb (reg_bm_status (c), BM_STA_ERR | BM_STA_INTR);
+
+	select_sector (d, c->batch_sector, c->batch_cnt);
+	outb (reg_bm_command (c), direction);
+	issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+	outb (reg_bm_command (c), direction | BM_CMD_START);
 	sema_down (&c->completion_wait);
-	d->write_cnt++;
-	lock_release (&c->lock);
+
+	outb (reg_bm_command (c), 0);
+	bm_status = inb (reg_bm_status (c));
+	outb (reg_bm_status (c), BM_STA_ERR | BM_STA_INTR);
+	status = inb (reg_alt_status (c));
+	if ((bm_status & BM_STA_ERR) || (status & (STA_BSY | STA_DRQ | STA_ERR))) {
+		printf ("%s: DMA %s failed, sector=%"PRDSNu"; using PIO\n",
+				d->name, write ? "write" : "read", c->batch_sector);
+		d->dma = false;
+		return false;
+	}
+	return true;
 }
-
+
+/* PCI configuration space access. */
+#define PCI_CONFIG_ADDR 0xcf8   /* Address of a configuration register. */
+#define PCI_CONFIG_DATA 0xcfc   /* Its contents. */
+
+/* Returns the 32-bit configuration register at offset REG of PCI
+   function FUNC of device DEV on bus 0. */
+static uint32_t
+pci_read_config (int dev, int func, int reg) {
+	outl (PCI_CONFIG_ADDR, 0x80000000 | dev << 11 | func << 8 | reg);
+	return inl (PCI_CONFIG_DATA);
+}
+
+/* Sets the 32-bit configuration register at offset REG of PCI
+   function FUNC of device DEV on bus 0 to VALUE. */
+static void
+pci_write_config (int dev, int func, int reg, uint32_t value) {
+	outl (PCI_CONFIG_ADDR, 0x80000000 | dev << 11 | func << 8 | reg);
+	outl (PCI_CONFIG_DATA, value);
+}
+
+/* Looks on PCI bus 0 for an IDE controller that drives both
+   legacy channels and supports bus mastering.  If there is one,
+   enables bus mastering on it and returns the I/O port of its bus
+   master registers; otherwise returns 0. */
+static uint16_t
+find_bus_master (void) {
+	int dev, func;
+
+	for (dev = 0; dev < 32; dev++)
+		for (func = 0; func < 8; func++) {
+			uint32_t id = pci_read_config (dev, func, 0x00);
+			uint32_t class, bar4, command;
+
+			if ((id & 0xffff) == 0xffff) {
+				if (func == 0)
+					break;
+				continue;
+			}
+
+			/* Class 1 (mass storage), subclass 1 (IDE); in the
+			   programming interface, bit 7 means bus mastering and
+			   bits 0 and 2 native instead of legacy mode. */
+			class = pci_read_config (dev, func, 0x08);
+			if ((class >> 16) != 0x0101 || (class & 0x8500) != 0x8000)
+				continue;
+			bar4 = pci_read_config (dev, func, 0x20);
+			if ((bar4 & 1) == 0)
+				continue;
+
+			/* The upper half of the command register is the status
+			   register, whose bits are cleared by writing 1s. */
+			command = pci_read_config (dev, func, 0x04) & 0xffff;
+			pci_write_config (dev, func, 0x04,
+					command | PCI_CMD_IO | PCI_CMD_BUS_MASTER);
+			return bar4 & 0xfffc;
+		}
+	return 0;
+}
+
 /* Disk detection and identification. */
 
 static void print_ata_string (char *string, size_t size);
@@ -288,6 +1099,7 @@ reset_channel (struct channel *c) {
 	outb (reg_ctl (c), CTL_SRST);
 	timer_usleep (10);
 	outb (reg_ctl (c), 0);
+	c->selected = NULL;
 
 	timer_msleep (150);
 
@@ -359,11 +1171,19 @@ identify_ata_device (struct disk *d) {
 		d->is_ata = false;
 		return;
 	}
-	input_sector (c, id);
+	input_sectors (c, id, 1);
 
 	/* Calculate capacity. */
 	d->capacity = id[60] | ((uint32_t) id[61] << 16);
 
+	/* Word 47 gives the largest number of sectors that READ/WRITE
+	   MULTIPLE may transfer per interrupt. */
+	if ((id[47] & 0xff) > 1)
+		set_multiple_mode (d, id[47] & 0xff);
+
+	/* Word 49 bit 8 says whether the disk supports DMA. */
+	d->dma = c->bm_base != 0 && (id[49] & 0x100) != 0;
+
 	/* Print identification message. */
 	printf ("%s: detected %'"PRDSNu" sector (", d->name, d->capacity);
 	if (d->capacity > 1024 / DISK_SECTOR_SIZE * 1024 * 1024)
@@ -382,6 +1202,23 @@ identify_ata_device (struct disk *d) {
 	printf ("\"\n");
 }
 
+/* Sends a SET MULTIPLE MODE command to disk D, asking for
+   MULTIPLE sectors per interrupt of READ/WRITE MULTIPLE.  On
+   success, records the setting in D; otherwise D keeps using
+   single-sector transfers. */
+static void
+set_multiple_mode (struct disk *d, size_t multiple) {
+	struct channel *c = d->channel;
+
+	select_device_wait (d);
+	outb (reg_nsect (c), multiple);
+	issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+	sema_down (&c->completion_wait);
+	wait_while_busy (d);
+	if ((inb (reg_alt_status (c)) & STA_ERR) == 0)
+		d->multiple = multiple;
+}
+
 /* Prints STRING, which consists of SIZE bytes in a funky format:
    each pair of bytes is in reverse order.  Does not print
    trailing whitespace and/or nulls. */
@@ -402,17 +1239,23 @@ print_ata_string (char *string, size_t size) {
 }
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the number CNT of sectors to transfer to the
+   disk's sector selection registers.  (We use LBA mode.)
+   If D is selected already, its previous command has completed,
+   so it is normally idle right away and is not selected again. */
 static void
-select_sector (struct disk *d, disk_sector_t sec_no) {
+select_sector (struct disk *d, disk_sector_t sec_no, size_t cnt) {
 	struct channel *c = d->channel;
 
-	ASSERT (sec_no < d->capacity);
-	ASSERT (sec_no < (1UL << 28));
+	ASSERT (cnt > 0 && cnt <= DISK_MULTI_MAX);
+	ASSERT (sec_no < d->capacity && cnt <= d->capacity - sec_no);
+	ASSERT (sec_no + cnt <= (1UL << 28));
 
-	select_device_wait (d);
-	outb (reg_nsect (c), 1);
+	if (c->selected != d)
+		select_device_wait (d);
+	else if (!poll_status (d, STA_BSY | STA_DRQ))
+		wait_until_idle (d);
+	outb (reg_nsect (c), cnt == DISK_MULTI_MAX ? 0 : cnt);   /* 0 means 256. */
 	outb (reg_lbal (c), sec_no);
 	outb (reg_lbam (c), sec_no >> 8);
 	outb (reg_lbah (c), (sec_no >> 16));
@@ -432,22 +1275,53 @@ issue_pio_command (struct channel *c, uint8_t command) {
 	outb (reg_command (c), command);
 }
 
-/* Reads a sector from channel C's data register in PIO mode into
-   SECTOR, which must have room for DISK_SECTOR_SIZE bytes. */
+/* Reads CNT sectors from channel C's data register in PIO mode
+   into SECTORS, which must have room for CNT * DISK_SECTOR_SIZE
+   bytes. */
 static void
-input_sector (struct channel *c, void *sector) {
-	insw (reg_data (c), sector, DISK_SECTOR_SIZE / 2);
+input_sectors (struct channel *c, void *sectors, size_t cnt) {
+	insw (reg_data (c), sectors, cnt * DISK_SECTOR_SIZE / 2);
 }
 
-/* Writes SECTOR to channel C's data register in PIO mode.
-   SECTOR must contain DISK_SECTOR_SIZE bytes. */
+/* Writes CNT sectors from SECTORS to channel C's data register in
+   PIO mode.  SECTORS must contain CNT * DISK_SECTOR_SIZE bytes. */
 static void
-output_sector (struct channel *c, const void *sector) {
-	outsw (reg_data (c), sector, DISK_SECTOR_SIZE / 2);
+output_sectors (struct channel *c, const void *sectors, size_t cnt) {
+	outsw (reg_data (c), sectors, cnt * DISK_SECTOR_SIZE / 2);
 }
 
 /* Low-level ATA primitives. */
 
+/* Number of status register reads for which the common path waits
+   on the disk before it falls back to timed polling.  Each read
+   takes about 100 ns on an ISA-compatible port. */
+#define POLL_CNT 10000
+
+/* Reads disk D's alternate status register until the bits in MASK
+   are clear, at most POLL_CNT times.  Returns true if they
+   cleared.  Reading the alternate status does not acknowledge an
+   interrupt. */
+static bool
+poll_status (const struct disk *d, uint8_t mask) {
+	int i;
+
+	for (i = 0; i < POLL_CNT; i++)
+		if ((inb (reg_alt_status (d->channel)) & mask) == 0)
+			return true;
+	return false;
+}
+
+/* Waits for disk D to clear BSY, and then returns the status of
+   the DRQ bit, as wait_while_busy(), but without sleeping in the
+   common case: after a completion interrupt, or right after a
+   write command, BSY clears within microseconds. */
+static bool
+wait_for_data (const struct disk *d) {
+	if (!poll_status (d, STA_BSY))
+		return wait_while_busy (d);
+	return (inb (reg_alt_status (d->channel)) & STA_DRQ) != 0;
+}
+
 /* Wait up to 10 seconds for the controller to become idle, that
    is, for the BSY and DRQ bits to clear in the status register.
 
@@ -495,11 +1369,17 @@ static void
 select_device (const struct disk *d) {
 	struct channel *c = d->channel;
 	uint8_t dev = DEV_MBS;
+	int i;
+
 	if (d->dev_no == 1)
 		dev |= DEV_DEV;
 	outb (reg_device (c), dev);
-	inb (reg_alt_status (c));
-	timer_nsleep (400);
+
+	/* The status is valid 400 ns after selection; five reads of the
+	   alternate status register take at least that long. */
+	for (i = 0; i < 5; i++)
+		inb (reg_alt_status (c));
+	c->selected = d;
 }
 
 /* Select disk D in its channel, as select_device(), but wait for
@@ -0,0 +1,99 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/disk.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* RAM disks.
+
+   A RAM disk keeps its sectors in kernel pages and carries out a
+   request by copying, before disk_submit() returns.  It serves as
+   a swap or file system disk without the latency of the IDE
+   disks, for benchmarking and for scratch data that need not
+   survive a reboot.  RAM disks are named "rd0", "rd1", ... in the
+   order given on the command line, and start out zeroed. */
+
+/* Sectors per page. */
+#define PAGE_SECTORS (PGSIZE / DISK_SECTOR_SIZE)
+
+/* A RAM disk's storage. */
+struct ramdisk {
+	uint8_t **pages;            /* PAGE_SECTORS sectors per page. */
+	size_t page_cnt;            /* Number of pages. */
+};
+
+/* Sizes of the RAM disks to create, in kB. */
+static size_t sizes[RAMDISK_MAX];
+static size_t ramdisk_cnt;
+
+static void ramdisk_submit (struct disk_request *);
+
+static const struct disk_ops ramdisk_ops = {
+	.submit = ramdisk_submit,
+};
+
+/* Asks for a RAM disk of KB kilobytes, rounded up to whole
+   pages, to be created by ramdisk_init().  May be called before
+   memory allocation is set up, i.e. while parsing the command
+   line. */
+void
+ramdisk_configure (size_t kb) {
+	if (ramdisk_cnt >= RAMDISK_MAX)
+		PANIC ("more than %d RAM disks", RAMDISK_MAX);
+	if (kb == 0)
+		PANIC ("RAM disk size must be positive");
+	sizes[ramdisk_cnt++] = kb;
+}
+
+/* Creates the RAM disks asked for and registers them as disks.
+   Must be called after disk_init(). */
+void
+ramdisk_init (void) {
+	size_t i, j;
+
+	for (i = 0; i < ramdisk_cnt; i++) {
+		struct ramdisk *rd = malloc (sizeof *rd);
+		char name[8];
+
+		if (rd == NULL)
+			PANIC ("RAM disk: out of memory");
+		rd->page_cnt = DIV_ROUND_UP (sizes[i] * 1024, PGSIZE);
+		rd->pages = malloc (rd->page_cnt * sizeof *rd->pages);
+		if (rd->pages == NULL)
+			PANIC ("RAM disk: out of memory");
+		for (j = 0; j < rd->page_cnt; j++) {
+			rd->pages[j] = palloc_get_page (PAL_ZERO);
+			if (rd->pages[j] == NULL)
+				PANIC ("RAM disk: no memory for %zu kB", sizes[i]);
+		}
+
+		snprintf (name, sizeof name, "rd%zu", i);
+		disk_register (name, rd->page_cnt * PAGE_SECTORS, &ramdisk_ops, rd);
+		printf ("%s: %zu kB RAM disk\n", name, rd->page_cnt * PGSIZE / 1024);
+	}
+}
+
+/* Carries out REQ by copying between its buffer and the RAM
+   disk's pages. */
+static void
+ramdisk_submit (struct disk_request *req) {
+	struct ramdisk *rd = disk_aux (req->disk);
+	uint8_t *buffer = req->buffer;
+	size_t i;
+
+	for (i = 0; i < req->cnt; i++) {
+		disk_sector_t sector = req->sector + i;
+		uint8_t *data = rd->pages[sector / PAGE_SECTORS]
+			+ sector % PAGE_SECTORS * DISK_SECTOR_SIZE;
+
+		if (req->write)
+			memcpy (data, buffer + i * DISK_SECTOR_SIZE, DISK_SECTOR_SIZE);
+		else
+			memcpy (buffer + i * DISK_SECTOR_SIZE, data, DISK_SECTOR_SIZE);
+	}
+	disk_complete (req);
+}
@@ -0,0 +1,574 @@
+/* buffer_cache.c: Write-back cache of file system disk sectors.
+ *
+ * Every access to the file system disk made by the inode layer goes
+ * through this cache, so it is the only place that holds the current
+ * contents of a sector.  Entries are replaced with the clock
+ * algorithm, dirty entries are written back on eviction, by a
+ * periodic flusher thread and at shutdown, and a read-ahead thread
+ * fetches sectors that are likely to be read next.  A sector pinned
+ * by the journal is not written back until its transaction is
+ * committed.
+ *
+ * With VM, once the frame table is up, the fixed array is retired and
+ * sectors are kept in the page cache instead (see page_cache.c), whose
+ * size follows the amount of free memory. */
+
+#include "filesys/buffer_cache.h"
+#include <debug.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#if defined (VM) && defined (EFILESYS)
+#include "filesys/page_cache.h"
+#endif
+
+/* Ticks between two runs of the flusher thread. */
+#define FLUSH_INTERVAL (TIMER_FREQ * 10)
+
+/* Maximum number of pending read-ahead requests. */
+#define READ_AHEAD_MAX 16
+
+/* Most sectors the read-ahead thread loads with one disk command. */
+#define READ_AHEAD_BATCH 16
+
+/* A run of consecutive sectors to read ahead. */
+struct read_ahead_req {
+	disk_sector_t sector;               /* First sector. */
+	size_t cnt;                         /* Number of sectors. */
+};
+
+/* A cached disk sector. */
+struct buffer_cache_entry {
+	disk_sector_t sector;               /* Cached sector, if valid. */
+	bool valid;                         /* Holds a sector? */
+	bool dirty;                         /* Modified since read from disk? */
+	bool accessed;                      /* Used since the clock hand passed? */
+	struct lock lock;                   /* Protects DATA and DIRTY. */
+	uint8_t *data;                      /* DISK_SECTOR_SIZE bytes. */
+	struct disk_request io;             /* I/O on a run starting here. */
+};
+
+/* The DATA of consecutive entries is consecutive in memory, so a run
+ * of entries can be filled with one multi-sector read. */
+
+static struct buffer_cache_entry cache[BUFFER_CACHE_SIZE];
+
+/* Protects the SECTOR, VALID and ACCESSED members of every entry and
+ * the clock hand.  May be acquired before an entry lock, never
+ * after. */
+static struct lock cache_lock;
+static size_t clock_hand;
+
+/* Runs of sectors waiting for the read-ahead thread. */
+static struct read_ahead_req read_ahead_queue[READ_AHEAD_MAX];
+static size_t read_ahead_head, read_ahead_cnt;
+static struct lock read_ahead_lock;
+static struct semaphore read_ahead_sema;
+
+#if defined (VM) && defined (EFILESYS)
+/* True once buffer_cache_enable_page_cache() has been called. */
+static bool use_page_cache;
+#endif
+
+static void read_ahead_daemon (void *aux);
+static void flush_daemon (void *aux);
+
+/* Initializes the buffer cache and starts its helper threads. */
+void
+buffer_cache_init (void) {
+	size_t data_pages = BUFFER_CACHE_SIZE * DISK_SECTOR_SIZE / PGSIZE;
+	uint8_t *data = palloc_get_multiple (PAL_ASSERT | PAL_ZERO, data_pages);
+	size_t i;
+
+	lock_init (&cache_lock);
+	for (i = 0; i < BUFFER_CACHE_SIZE; i++) {
+		struct buffer_cache_entry *e = &cache[i];
+		e->valid = e->dirty = e->accessed = false;
+		lock_init (&e->lock);
+		e->data = data + i * DISK_SECTOR_SIZE;
+	}
+	clock_hand = 0;
+
+	read_ahead_head = read_ahead_cnt = 0;
+	lock_init (&read_ahead_lock);
+	sema_init (&read_ahead_sema, 0);
+
+	thread_create ("bc_read_ahead", PRI_DEFAULT, read_ahead_daemon, NULL);
+	thread_create ("bc_flush", PRI_DEFAULT, flush_daemon, NULL);
+}
+
+/* Writes every dirty entry back to disk.  Called at shutdown. */
+void
+buffer_cache_done (void) {
+	buffer_cache_flush ();
+}
+
+/* Returns the valid entry caching SECTOR, or a null pointer.
+ * CACHE_LOCK must be held. */
+static struct buffer_cache_entry *
+lookup (disk_sector_t sector) {
+	size_t i;
+
+	ASSERT (lock_held_by_current_thread (&cache_lock));
+
+	for (i = 0; i < BUFFER_CACHE_SIZE; i++)
+		if (cache[i].valid && cache[i].sector == sector)
+			return &cache[i];
+	return NULL;
+}
+
+/* Returns true if E holds a change that must not reach the disk
+ * before its transaction is committed. */
+static bool
+is_pinned (struct buffer_cache_entry *e) {
+	return e->valid && e->dirty && journal_pinned (e->sector);
+}
+
+/* Chooses an entry to replace with the clock algorithm and returns
+ * it with its lock held.  Entries whose lock is held by some other
+ * thread are skipped while possible; dirty entries pinned by the
+ * journal are never chosen.  Returns a null pointer if every entry
+ * is pinned.  CACHE_LOCK must be held. */
+static struct buffer_cache_entry *
+select_victim (void) {
+	size_t i;
+
+	ASSERT (lock_held_by_current_thread (&cache_lock));
+
+	/* Two sweeps clear every accessed bit, so an idle entry is found
+	 * unless all of them are locked. */
+	for (i = 0; i < 2 * BUFFER_CACHE_SIZE; i++) {
+		struct buffer_cache_entry *e = &cache[clock_hand];
+		clock_hand = (clock_hand + 1) % BUFFER_CACHE_SIZE;
+
+		if (!e->valid) {
+			if (lock_try_acquire (&e->lock))
+				return e;
+		} else if (e->accessed)
+			e->accessed = false;
+		else if (is_pinned (e))
+			continue;
+		else if (lock_try_acquire (&e->lock))
+			return e;
+	}
+
+	/* Every entry is busy: wait for the first one from the hand that
+	 * is not pinned.  Entry holders never wait for CACHE_LOCK, so this
+	 * cannot deadlock.  journal_begin() keeps at most half of the
+	 * entries pinned unless an operation overruns its credits. */
+	for (i = 0; i < BUFFER_CACHE_SIZE; i++) {
+		struct buffer_cache_entry *e = &cache[clock_hand];
+		clock_hand = (clock_hand + 1) % BUFFER_CACHE_SIZE;
+
+		if (is_pinned (e))
+			continue;
+		lock_acquire (&e->lock);
+		if (!is_pinned (e))
+			return e;
+		lock_release (&e->lock);
+	}
+	return NULL;
+}
+
+/* Hands the contents of the entry at the clock hand, which is pinned
+ * like every other, to the journal and returns the entry, clean, with
+ * its lock held.  For a thread inside an operation, which cannot
+ * commit to unpin entries.  CACHE_LOCK must be held. */
+static struct buffer_cache_entry *
+stash_victim (void) {
+	struct buffer_cache_entry *e = &cache[clock_hand];
+
+	ASSERT (lock_held_by_current_thread (&cache_lock));
+
+	clock_hand = (clock_hand + 1) % BUFFER_CACHE_SIZE;
+	lock_acquire (&e->lock);
+	if (is_pinned (e)) {
+		journal_stash (e->sector, e->data);
+		e->dirty = false;
+	}
+	return e;
+}
+
+/* Returns the entry caching SECTOR with its lock held, loading the
+ * sector into the cache if necessary.  If READ is false, the caller
+ * is about to overwrite the whole sector, so a miss does not read it
+ * from disk. */
+static struct buffer_cache_entry *
+acquire_entry (disk_sector_t sector, bool read) {
+	struct buffer_cache_entry *e;
+
+	for (;;) {
+		lock_acquire (&cache_lock);
+		e = lookup (sector);
+		if (e != NULL) {
+			e->accessed = true;
+			lock_release (&cache_lock);
+
+			/* The entry may be replaced before we lock it. */
+			lock_acquire (&e->lock);
+			if (e->valid && e->sector == sector)
+				return e;
+			lock_release (&e->lock);
+			continue;
+		}
+
+		/* Miss.  The old contents are written back before the entry
+		 * is published under its new sector, so that nobody reads a
+		 * stale copy of the old sector from disk meanwhile.  If the
+		 * journal pins every entry, its transaction is committed to
+		 * free some up; a pinned sector is never written home.  Inside
+		 * an operation the transaction cannot be committed, so the
+		 * journal keeps the evicted sector instead. */
+		e = select_victim ();
+		if (e == NULL && !journal_in_operation ()) {
+			lock_release (&cache_lock);
+			journal_commit ();
+			continue;
+		}
+		if (e == NULL)
+			e = stash_victim ();
+		if (e->valid && e->dirty) {
+			enum disk_origin origin = disk_set_origin (DISK_IO_CACHE);
+			disk_write (filesys_disk, e->sector, e->data);
+			disk_set_origin (origin);
+		}
+		e->sector = sector;
+		e->valid = true;
+		e->dirty = false;
+		e->accessed = true;
+		lock_release (&cache_lock);
+
+		/* Threads that look SECTOR up now wait on the entry lock
+		 * until the data is in place.  A stashed copy is newer than
+		 * the disk, and must not outlive this one either way. */
+		if (journal_unstash (sector, e->data))
+			e->dirty = true;
+		else if (read)
+			disk_read (filesys_disk, sector, e->data);
+		return e;
+	}
+}
+
+/* Reads SIZE bytes at offset SECTOR_OFS within SECTOR into BUFFER. */
+void
+buffer_cache_read (disk_sector_t sector, void *buffer, off_t sector_ofs,
+		int size) {
+	struct buffer_cache_entry *e;
+
+	ASSERT (sector_ofs >= 0 && size >= 0);
+	ASSERT (sector_ofs + size <= DISK_SECTOR_SIZE);
+
+#if defined (VM) && defined (EFILESYS)
+	if (use_page_cache) {
+		page_cache_read (sector, buffer, sector_ofs, size);
+		return;
+	}
+#endif
+	e = acquire_entry (sector, true);
+	memcpy (buffer, e->data + sector_ofs, size);
+	lock_release (&e->lock);
+}
+
+/* Writes SIZE bytes from BUFFER at offset SECTOR_OFS within SECTOR.
+ * The data reaches the disk when the entry is evicted or flushed. */
+void
+buffer_cache_write (disk_sector_t sector, const void *buffer,
+		off_t sector_ofs, int size) {
+	struct buffer_cache_entry *e;
+
+	ASSERT (sector_ofs >= 0 && size >= 0);
+	ASSERT (sector_ofs + size <= DISK_SECTOR_SIZE);
+
+	/* Pinned before it changes, so that the change cannot reach the
+	 * disk ahead of its transaction. */
+	journal_dirty (sector);
+#if defined (VM) && defined (EFILESYS)
+	if (use_page_cache) {
+		page_cache_write (sector, buffer, sector_ofs, size);
+		return;
+	}
+#endif
+	e = acquire_entry (sector, size < DISK_SECTOR_SIZE);
+	memcpy (e->data + sector_ofs, buffer, size);
+	e->dirty = true;
+	lock_release (&e->lock);
+}
+
+/* Asks the read-ahead thread to bring the CNT sectors starting at
+ * SECTOR into the cache.  Returns immediately; leading sectors that
+ * are already cached are skipped, and the request is dropped if too
+ * many requests are pending. */
+void
+buffer_cache_read_ahead (disk_sector_t sector, size_t cnt) {
+#if defined (VM) && defined (EFILESYS)
+	if (!use_page_cache) {
+#endif
+	lock_acquire (&cache_lock);
+	while (cnt > 0 && lookup (sector) != NULL) {
+		sector++;
+		cnt--;
+	}
+	lock_release (&cache_lock);
+#if defined (VM) && defined (EFILESYS)
+	}
+#endif
+	if (cnt == 0)
+		return;
+
+	lock_acquire (&read_ahead_lock);
+	if (read_ahead_cnt > 0) {
+		/* A run that continues the newest request extends it. */
+		struct read_ahead_req *last = &read_ahead_queue[(read_ahead_head
+				+ read_ahead_cnt - 1) % READ_AHEAD_MAX];
+		if (last->sector + last->cnt == sector) {
+			last->cnt += cnt;
+			cnt = 0;
+		}
+	}
+	if (cnt > 0 && read_ahead_cnt < READ_AHEAD_MAX) {
+		struct read_ahead_req *req = &read_ahead_queue[(read_ahead_head
+				+ read_ahead_cnt++) % READ_AHEAD_MAX];
+		req->sector = sector;
+		req->cnt = cnt;
+		sema_up (&read_ahead_sema);
+	}
+	lock_release (&read_ahead_lock);
+}
+
+/* Returns the entry whose DATA is at DATA. */
+static struct buffer_cache_entry *
+entry_of_data (const void *data) {
+	return &cache[((const uint8_t *) data - cache[0].data) / DISK_SECTOR_SIZE];
+}
+
+/* Writes every dirty entry that is not pinned back to disk.  The
+ * writes are submitted together, so the disk orders them and merges
+ * those to consecutive sectors; each entry stays locked until its
+ * own write is complete. */
+void
+buffer_cache_flush (void) {
+	struct disk_batch batch;
+	struct disk_request *req;
+	size_t i;
+
+#if defined (VM) && defined (EFILESYS)
+	if (use_page_cache) {
+		page_cache_flush ();
+		return;
+	}
+#endif
+	/* Entry locks are acquired in index order, so two flushes cannot
+	 * wait for each other. */
+	disk_batch_init (&batch);
+	for (i = 0; i < BUFFER_CACHE_SIZE; i++) {
+		struct buffer_cache_entry *e = &cache[i];
+
+		lock_acquire (&e->lock);
+		if (e->valid && e->dirty && !journal_pinned (e->sector)) {
+			disk_request_init (&e->io, filesys_disk, e->sector, e->data, 1,
+					true, NULL, NULL);
+			disk_batch_submit (&batch, &e->io);
+		} else
+			lock_release (&e->lock);
+	}
+	while ((req = disk_batch_next (&batch)) != NULL) {
+		struct buffer_cache_entry *e = entry_of_data (req->buffer);
+
+		e->dirty = false;
+		lock_release (&e->lock);
+	}
+}
+
+/* Writes SECTOR back to disk if it is cached, dirty and not
+ * pinned. */
+void
+buffer_cache_flush_sector (disk_sector_t sector) {
+	struct buffer_cache_entry *e;
+
+#if defined (VM) && defined (EFILESYS)
+	if (use_page_cache) {
+		page_cache_flush_sector (sector);
+		return;
+	}
+#endif
+	lock_acquire (&cache_lock);
+	e = lookup (sector);
+	lock_release (&cache_lock);
+	if (e == NULL)
+		return;
+
+	lock_acquire (&e->lock);
+	if (e->valid && e->sector == sector && e->dirty
+			&& !journal_pinned (sector)) {
+		disk_write (filesys_disk, e->sector, e->data);
+		e->dirty = false;
+	}
+	lock_release (&e->lock);
+}
+
+/* Returns true if E can be replaced by read-ahead: it is free, or
+ * clean and not used since the clock hand passed.  Read-ahead does
+ * not write anything back to make room.  CACHE_LOCK must be held. */
+static bool
+is_idle (struct buffer_cache_entry *e) {
+	return !e->valid || (!e->dirty && !e->accessed);
+}
+
+/* Finds the longest run of consecutive idle entries, up to CNT, locks
+ * them and returns the first, storing the number locked in *RUN.
+ * Returns a null pointer if no entry is idle.  CACHE_LOCK must be
+ * held. */
+static struct buffer_cache_entry *
+claim_idle_run (size_t cnt, size_t *run) {
+	size_t best = 0, best_cnt = 0, i, n;
+
+	ASSERT (lock_held_by_current_thread (&cache_lock));
+
+	for (i = 0; i < BUFFER_CACHE_SIZE && best_cnt < cnt; i += n + 1) {
+		for (n = 0; n < cnt && i + n < BUFFER_CACHE_SIZE
+				&& is_idle (&cache[i + n]); n++)
+			continue;
+		if (n > best_cnt) {
+			best = i;
+			best_cnt = n;
+		}
+	}
+
+	/* DIRTY may change until the entry is locked. */
+	for (n = 0; n < best_cnt; n++) {
+		struct buffer_cache_entry *e = &cache[best + n];
+
+		if (!lock_try_acquire (&e->lock))
+			break;
+		if (!is_idle (e)) {
+			lock_release (&e->lock);
+			break;
+		}
+	}
+	*run = n;
+	return n > 0 ? &cache[best] : NULL;
+}
+
+/* Returns true if SECTOR may be read ahead from disk: it is not
+ * cached, and not pinned, in which case the journal may hold a copy
+ * newer than the disk's.  CACHE_LOCK must be held. */
+static bool
+can_read_ahead (disk_sector_t sector) {
+	return lookup (sector) == NULL && !journal_pinned (sector);
+}
+
+/* Loads the sectors among the CNT starting at SECTOR that are not
+ * cached yet, each run of them into a run of idle entries.  The reads
+ * of all the runs are submitted together, so the disk serves them in
+ * its own order, and each run is unlocked as soon as its read is
+ * complete.  Leaves the rest out once no entry is idle. */
+static void
+read_ahead (disk_sector_t sector, size_t cnt) {
+	struct disk_batch batch;
+	struct disk_request *req;
+	struct buffer_cache_entry *runs[BUFFER_CACHE_SIZE];
+	size_t run_cnt = 0, i;
+
+	lock_acquire (&cache_lock);
+	while (cnt > 0) {
+		struct buffer_cache_entry *e;
+		size_t n;
+
+		while (cnt > 0 && !can_read_ahead (sector)) {
+			sector++;
+			cnt--;
+		}
+		for (n = 0; n < cnt && n < READ_AHEAD_BATCH
+				&& can_read_ahead (sector + n); n++)
+			continue;
+		e = n > 0 ? claim_idle_run (n, &n) : NULL;
+		if (e == NULL)
+			break;
+
+		/* As for a miss, readers of these sectors wait on the entry
+		 * locks until the data is in place.  The entries are no longer
+		 * idle, so they are not claimed twice. */
+		for (i = 0; i < n; i++) {
+			e[i].sector = sector + i;
+			e[i].valid = true;
+			e[i].dirty = false;
+			e[i].accessed = true;
+		}
+		disk_request_init (&e->io, filesys_disk, sector, e->data, n, false,
+				NULL, NULL);
+		runs[run_cnt++] = e;
+		sector += n;
+		cnt -= n;
+	}
+	lock_release (&cache_lock);
+
+	disk_batch_init (&batch);
+	for (i = 0; i < run_cnt; i++)
+		disk_batch_submit (&batch, &runs[i]->io);
+	while ((req = disk_batch_next (&batch)) != NULL) {
+		struct buffer_cache_entry *e = entry_of_data (req->buffer);
+
+		for (i = 0; i < req->cnt; i++)
+			lock_release (&e[i].lock);
+	}
+}
+
+/* Loads the sectors queued by buffer_cache_read_ahead(). */
+static void
+read_ahead_daemon (void *aux UNUSED) {
+	disk_set_origin (DISK_IO_CACHE);
+	for (;;) {
+		struct read_ahead_req req;
+
+		sema_down (&read_ahead_sema);
+		lock_acquire (&read_ahead_lock);
+		req = read_ahead_queue[read_ahead_head];
+		read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_MAX;
+		read_ahead_cnt--;
+		lock_release (&read_ahead_lock);
+
+#if defined (VM) && defined (EFILESYS)
+		if (use_page_cache) {
+			page_cache_prefetch (req.sector, req.cnt);
+			continue;
+		}
+#endif
+		read_ahead (req.sector, req.cnt);
+	}
+}
+
+#if defined (VM) && defined (EFILESYS)
+/* Moves the cache into the page cache.  Must be called once the frame
+ * table is initialized, before any other thread uses the file system
+ * concurrently.  Dirty entries are written back first, so the page
+ * cache starts from what is on disk. */
+void
+buffer_cache_enable_page_cache (void) {
+	size_t i;
+
+	/* Nothing may stay pinned in the entries dropped below. */
+	journal_commit ();
+	buffer_cache_flush ();
+	lock_acquire (&cache_lock);
+	for (i = 0; i < BUFFER_CACHE_SIZE; i++)
+		cache[i].valid = false;
+	use_page_cache = true;
+	lock_release (&cache_lock);
+}
+#endif
+
+/* Periodically writes dirty entries back, bounding the amount of
+ * data lost on a crash. */
+static void
+flush_daemon (void *aux UNUSED) {
+	disk_set_origin (DISK_IO_CACHE);
+	for (;;) {
+		timer_sleep (FLUSH_INTERVAL);
+		buffer_cache_flush ();
+	}
+}
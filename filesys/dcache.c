@@ -0,0 +1,152 @@
+/* dcache.c: Cache of directory lookups.
+ *
+ * Remembers, for a (directory, name) pair, the sector of the inode
+ * the name refers to, or that the directory has no such name
+ * ("negative" entry), so that repeated lookups of the same name do
+ * not search the directory again.  The least recently used entry is
+ * replaced when the cache is full.  The directory code keeps the
+ * cache in sync by calling dcache_insert() and dcache_invalidate()
+ * whenever it adds or removes a name. */
+
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* A cached lookup. */
+struct dcache_entry {
+	disk_sector_t dir_sector;           /* Inode sector of the directory. */
+	char name[NAME_MAX + 1];            /* Name looked up. */
+	bool found;                         /* Does the directory have NAME? */
+	disk_sector_t inode_sector;         /* NAME's inode, if FOUND. */
+	struct hash_elem hash_elem;         /* Element in ENTRIES. */
+	struct list_elem lru_elem;          /* Element in LRU. */
+};
+
+static struct hash entries;             /* Entries by (directory, name). */
+static struct list lru;                 /* Entries, most recently used first. */
+static struct lock dcache_lock;         /* Protects ENTRIES and LRU. */
+
+static uint64_t
+dcache_hash (const struct hash_elem *e_, void *aux UNUSED) {
+	const struct dcache_entry *e = hash_entry (e_, struct dcache_entry,
+			hash_elem);
+	return hash_string (e->name) ^ hash_int (e->dir_sector);
+}
+
+static bool
+dcache_less (const struct hash_elem *a_, const struct hash_elem *b_,
+		void *aux UNUSED) {
+	const struct dcache_entry *a = hash_entry (a_, struct dcache_entry,
+			hash_elem);
+	const struct dcache_entry *b = hash_entry (b_, struct dcache_entry,
+			hash_elem);
+	if (a->dir_sector != b->dir_sector)
+		return a->dir_sector < b->dir_sector;
+	return strcmp (a->name, b->name) < 0;
+}
+
+/* Initializes the directory entry cache. */
+void
+dcache_init (void) {
+	hash_init (&entries, dcache_hash, dcache_less, NULL);
+	list_init (&lru);
+	lock_init (&dcache_lock);
+}
+
+/* Returns the entry for NAME in the directory at DIR_SECTOR, or a
+ * null pointer.  DCACHE_LOCK must be held. */
+static struct dcache_entry *
+find (disk_sector_t dir_sector, const char *name) {
+	struct dcache_entry key;
+	struct hash_elem *e;
+
+	ASSERT (lock_held_by_current_thread (&dcache_lock));
+
+	key.dir_sector = dir_sector;
+	strlcpy (key.name, name, sizeof key.name);
+	e = hash_find (&entries, &key.hash_elem);
+	return e != NULL ? hash_entry (e, struct dcache_entry, hash_elem) : NULL;
+}
+
+/* Looks NAME up in the directory at DIR_SECTOR.  Returns false if
+ * the cache knows nothing about it.  Otherwise sets *FOUND to whether
+ * the directory has NAME and, if so, *INODE_SECTOR to its inode, and
+ * returns true. */
+bool
+dcache_lookup (disk_sector_t dir_sector, const char *name,
+		bool *found, disk_sector_t *inode_sector) {
+	struct dcache_entry *e;
+
+	if (strlen (name) > NAME_MAX)
+		return false;
+
+	lock_acquire (&dcache_lock);
+	e = find (dir_sector, name);
+	if (e != NULL) {
+		*found = e->found;
+		*inode_sector = e->inode_sector;
+		list_remove (&e->lru_elem);
+		list_push_front (&lru, &e->lru_elem);
+	}
+	lock_release (&dcache_lock);
+	return e != NULL;
+}
+
+/* Records that the directory at DIR_SECTOR has NAME, with its inode
+ * at INODE_SECTOR, if FOUND is true, or has no NAME otherwise. */
+void
+dcache_insert (disk_sector_t dir_sector, const char *name,
+		bool found, disk_sector_t inode_sector) {
+	struct dcache_entry *e;
+
+	if (strlen (name) > NAME_MAX)
+		return;
+
+	lock_acquire (&dcache_lock);
+	e = find (dir_sector, name);
+	if (e != NULL)
+		list_remove (&e->lru_elem);
+	else {
+		if (hash_size (&entries) >= DCACHE_SIZE) {
+			/* Reuse the least recently used entry. */
+			e = list_entry (list_pop_back (&lru), struct dcache_entry, lru_elem);
+			hash_delete (&entries, &e->hash_elem);
+		} else
+			e = malloc (sizeof *e);
+		if (e != NULL) {
+			e->dir_sector = dir_sector;
+			strlcpy (e->name, name, sizeof e->name);
+			hash_insert (&entries, &e->hash_elem);
+		}
+	}
+
+	if (e != NULL) {
+		e->found = found;
+		e->inode_sector = inode_sector;
+		list_push_front (&lru, &e->lru_elem);
+	}
+	lock_release (&dcache_lock);
+}
+
+/* Forgets what is known about NAME in the directory at DIR_SECTOR. */
+void
+dcache_invalidate (disk_sector_t dir_sector, const char *name) {
+	struct dcache_entry *e;
+
+	if (strlen (name) > NAME_MAX)
+		return;
+
+	lock_acquire (&dcache_lock);
+	e = find (dir_sector, name);
+	if (e != NULL) {
+		hash_delete (&entries, &e->hash_elem);
+		list_remove (&e->lru_elem);
+		free (e);
+	}
+	lock_release (&dcache_lock);
+}
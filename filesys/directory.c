@@ -1,15 +1,19 @@
 #include "filesys/directory.h"
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 
 /* A directory. */
 struct dir {
 	struct inode *inode;                /* Backing store. */
 	off_t pos;                          /* Current position. */
+	bool hashed;                        /* Hashed or linear layout? */
 };
 
 /* A single directory entry. */
@@ -19,11 +23,97 @@ struct dir_entry {
 	bool in_use;                        /* In use or free? */
 };
 
+/* Directories are hash tables: slot 0 holds a struct dir_header and
+ * the entries live in the slots after it, at the slot NAME hashes to
+ * or in the first free one after that (linear probing).  A removed
+ * entry keeps its name so that probes pass over it; a slot that was
+ * never used has an empty name and ends a probe.  The table doubles
+ * when it gets three quarters full.
+ *
+ * A larger table is too big to write in one journal operation, so it
+ * is built past the end of the current one, a few sectors per
+ * operation, and takes over when the header is switched to it.  The
+ * slots of older tables are left unused.
+ *
+ * Directories written before this layout have no header and are
+ * searched linearly, as before. */
+
+/* Identifies a hashed directory. */
+#define DIR_MAGIC 0x48524944
+
+/* Smallest number of slots in a hashed directory. */
+#define DIR_MIN_SLOTS 16
+
+/* Bytes of a new table written per journal operation, which keeps
+ * each within its credits. */
+#define GROW_CHUNK (2 * DISK_SECTOR_SIZE)
+
+/* Times dir_make_room() builds a new table before giving up, when
+ * the directory keeps changing under it. */
+#define GROW_TRIES 3
+
+/* Slot 0 of a hashed directory.
+ * Must be the same size as struct dir_entry. */
+struct dir_header {
+	uint32_t magic;                     /* DIR_MAGIC. */
+	uint32_t slot_cnt;                  /* Number of entry slots. */
+	uint32_t entry_cnt;                 /* Slots in use. */
+	uint32_t removed_cnt;               /* Slots of removed entries. */
+	uint32_t base;                      /* Slots before the table. */
+};
+
+/* Returns the byte offset of entry slot SLOT of the table of a
+ * hashed directory whose header is H. */
+static off_t
+slot_ofs (const struct dir_header *h, size_t slot) {
+	return (h->base + slot + 1) * sizeof (struct dir_entry);
+}
+
+/* Returns true if E is a slot that was never used. */
+static bool
+slot_unused (const struct dir_entry *e) {
+	return !e->in_use && e->name[0] == '\0';
+}
+
+/* Reads the header of hashed directory DIR into *H. */
+static void
+read_header (const struct dir *dir, struct dir_header *h) {
+	if (inode_read_at (dir->inode, h, sizeof *h, 0) != sizeof *h)
+		PANIC ("directory header missing");
+}
+
+/* Writes *H as the header of hashed directory DIR. */
+static bool
+write_header (struct dir *dir, const struct dir_header *h) {
+	return inode_write_at (dir->inode, h, sizeof *h, 0) == sizeof *h;
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
  * given SECTOR.  Returns true if successful, false on failure. */
 bool
 dir_create (disk_sector_t sector, size_t entry_cnt) {
-	return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+	struct dir_header h;
+	struct inode *inode;
+	bool success;
+
+	ASSERT (sizeof h == sizeof (struct dir_entry));
+
+	memset (&h, 0, sizeof h);
+	h.magic = DIR_MAGIC;
+	h.slot_cnt = DIR_MIN_SLOTS;
+	while (h.slot_cnt * 3 < entry_cnt * 4)
+		h.slot_cnt *= 2;
+
+	/* The slots are a hole in the new inode, so they read as
+	 * unused. */
+	if (!inode_create (sector, slot_ofs (&h, h.slot_cnt)))
+		return false;
+	inode = inode_open (sector);
+	if (inode == NULL)
+		return false;
+	success = inode_write_at (inode, &h, sizeof h, 0) == sizeof h;
+	inode_close (inode);
+	return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -32,8 +122,12 @@ struct dir *
 dir_open (struct inode *inode) {
 	struct dir *dir = calloc (1, sizeof *dir);
 	if (inode != NULL && dir != NULL) {
+		struct dir_header h;
+
 		dir->inode = inode;
 		dir->pos = 0;
+		dir->hashed = inode_read_at (inode, &h, sizeof h, 0) == sizeof h
+			&& h.magic == DIR_MAGIC;
 		return dir;
 	} else {
 		inode_close (inode);
@@ -71,6 +165,183 @@ dir_get_inode (struct dir *dir) {
 	return dir->inode;
 }
 
+/* Returns the slot NAME hashes to in a table of SLOT_CNT slots. */
+static size_t
+home_slot (const char *name, size_t slot_cnt) {
+	return hash_string (name) % slot_cnt;
+}
+
+/* lookup() for a hashed directory. */
+static bool
+hashed_lookup (const struct dir *dir, const char *name,
+		struct dir_entry *ep, off_t *ofsp) {
+	struct dir_header h;
+	struct dir_entry e;
+	size_t i, slot;
+
+	read_header (dir, &h);
+	slot = home_slot (name, h.slot_cnt);
+	for (i = 0; i < h.slot_cnt; i++, slot = (slot + 1) % h.slot_cnt) {
+		off_t ofs = slot_ofs (&h, slot);
+
+		if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e
+				|| slot_unused (&e))
+			break;
+		if (e.in_use && !strcmp (name, e.name)) {
+			if (ep != NULL)
+				*ep = e;
+			if (ofsp != NULL)
+				*ofsp = ofs;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Returns true if one more entry would leave the table of a hashed
+ * directory whose header is H more than three quarters full. */
+static bool
+needs_room (const struct dir_header *h) {
+	return (h->entry_cnt + h->removed_cnt + 1) * 4 > h->slot_cnt * 3;
+}
+
+/* Builds a new table for hashed directory DIR if it needs room,
+ * twice as large if more than half of the slots are in use, dropping
+ * removed entries.  Returns true if DIR has room now, false if the
+ * directory changed while the table was built, or on failure. */
+static bool
+grow_table (struct dir *dir) {
+	struct dir_header h, new_h, cur;
+	struct dir_entry *old = NULL, *new = NULL, *check = NULL;
+	size_t old_size, new_size, ofs, i;
+	bool success = false;
+
+	/* Snapshot the table and build the new one in memory. */
+	inode_lock_dir (dir->inode, false);
+	read_header (dir, &h);
+	if (!needs_room (&h)) {
+		inode_unlock_dir (dir->inode);
+		return true;
+	}
+	new_h = h;
+	if ((h.entry_cnt + 1) * 2 > h.slot_cnt)
+		new_h.slot_cnt *= 2;
+	new_h.removed_cnt = 0;
+	new_h.base = h.base >= new_h.slot_cnt ? 0 : h.base + h.slot_cnt;
+	old_size = h.slot_cnt * sizeof *old;
+	new_size = new_h.slot_cnt * sizeof *new;
+	old = malloc (old_size);
+	new = calloc (1, new_size);
+	check = malloc (old_size);
+	success = old != NULL && new != NULL && check != NULL
+		&& inode_read_at (dir->inode, old, old_size, slot_ofs (&h, 0))
+		== (off_t) old_size;
+	inode_unlock_dir (dir->inode);
+	if (!success)
+		goto done;
+
+	for (i = 0; i < h.slot_cnt; i++)
+		if (old[i].in_use) {
+			size_t slot = home_slot (old[i].name, new_h.slot_cnt);
+			while (new[slot].in_use)
+				slot = (slot + 1) % new_h.slot_cnt;
+			new[slot] = old[i];
+		}
+
+	/* Until the header points to it, the new table is not part of the
+	 * directory, so a crash in between leaves the old one in use.  A
+	 * concurrent grow_table() that finished first puts its table
+	 * where this one goes, so that is checked in every operation. */
+	for (ofs = 0; success && ofs < new_size; ofs += GROW_CHUNK) {
+		size_t n = new_size - ofs < GROW_CHUNK ? new_size - ofs : GROW_CHUNK;
+
+		journal_begin ();
+		inode_lock_dir (dir->inode, true);
+		read_header (dir, &cur);
+		success = cur.base == h.base && cur.slot_cnt == h.slot_cnt
+			&& inode_write_at (dir->inode, (uint8_t *) new + ofs, n,
+					slot_ofs (&new_h, 0) + ofs) == (off_t) n;
+		inode_unlock_dir (dir->inode);
+		journal_end ();
+	}
+	if (!success)
+		goto done;
+
+	/* Switch to the new table, unless an entry was added or removed
+	 * meanwhile. */
+	journal_begin ();
+	inode_lock_dir (dir->inode, true);
+	read_header (dir, &cur);
+	success = !memcmp (&cur, &h, sizeof h)
+		&& inode_read_at (dir->inode, check, old_size, slot_ofs (&h, 0))
+		== (off_t) old_size
+		&& !memcmp (check, old, old_size)
+		&& write_header (dir, &new_h);
+	inode_unlock_dir (dir->inode);
+	journal_end ();
+
+done:
+	free (old);
+	free (new);
+	free (check);
+	return success;
+}
+
+/* Makes sure that adding an entry to DIR leaves its table at most
+ * three quarters full, building a larger table if necessary.  Must
+ * be called outside a journal operation, before the one that adds
+ * the entry: the new table takes several operations of its own.  If
+ * that fails, dir_add() still succeeds while the table has a slot to
+ * spare. */
+void
+dir_make_room (struct dir *dir) {
+	size_t i;
+
+	ASSERT (dir != NULL);
+	ASSERT (!journal_in_operation ());
+
+	if (dir->hashed)
+		for (i = 0; i < GROW_TRIES && !grow_table (dir); i++)
+			continue;
+}
+
+/* dir_add() for a hashed directory, after NAME was checked. */
+static bool
+hashed_add (struct dir *dir, const char *name, disk_sector_t inode_sector) {
+	struct dir_header h;
+	struct dir_entry e;
+	size_t slot;
+	off_t ofs;
+
+	read_header (dir, &h);
+
+	/* dir_make_room() grew the table beforehand, unless it lost a race
+	 * or failed.  At least one slot must stay unused, so that probes
+	 * always end. */
+	if (h.entry_cnt + h.removed_cnt + 2 > h.slot_cnt)
+		return false;
+
+	slot = home_slot (name, h.slot_cnt);
+	for (;;) {
+		ofs = slot_ofs (&h, slot);
+		if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+			return false;
+		if (!e.in_use)
+			break;
+		slot = (slot + 1) % h.slot_cnt;
+	}
+	if (!slot_unused (&e))
+		h.removed_cnt--;
+
+	e.in_use = true;
+	strlcpy (e.name, name, sizeof e.name);
+	e.inode_sector = inode_sector;
+	if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+		return false;
+	h.entry_cnt++;
+	return write_header (dir, &h);
+}
+
 /* Searches DIR for a file with the given NAME.
  * If successful, returns true, sets *EP to the directory entry
  * if EP is non-null, and sets *OFSP to the byte offset of the
@@ -85,6 +356,9 @@ lookup (const struct dir *dir, const char *name,
 	ASSERT (dir != NULL);
 	ASSERT (name != NULL);
 
+	if (dir->hashed)
+		return hashed_lookup (dir, name, ep, ofsp);
+
 	for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 			ofs += sizeof e)
 		if (e.in_use && !strcmp (name, e.name)) {
@@ -105,14 +379,24 @@ bool
 dir_lookup (const struct dir *dir, const char *name,
 		struct inode **inode) {
 	struct dir_entry e;
+	disk_sector_t dir_sector, inode_sector;
+	bool found;
 
 	ASSERT (dir != NULL);
 	ASSERT (name != NULL);
 
-	if (lookup (dir, name, &e, NULL))
-		*inode = inode_open (e.inode_sector);
-	else
-		*inode = NULL;
+	/* The directory stays locked until the inode is open, so that a
+	 * concurrent dir_remove() cannot free it in between, nor a
+	 * concurrent dir_add() be hidden by a negative cache entry. */
+	dir_sector = inode_get_inumber (dir->inode);
+	inode_lock_dir (dir->inode, false);
+	if (!dcache_lookup (dir_sector, name, &found, &inode_sector)) {
+		found = lookup (dir, name, &e, NULL);
+		inode_sector = found ? e.inode_sector : 0;
+		dcache_insert (dir_sector, name, found, inode_sector);
+	}
+	*inode = found ? inode_open (inode_sector) : NULL;
+	inode_unlock_dir (dir->inode);
 
 	return *inode != NULL;
 }
@@ -137,9 +421,15 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector) {
 		return false;
 
 	/* Check that NAME is not in use. */
+	inode_lock_dir (dir->inode, true);
 	if (lookup (dir, name, NULL, NULL))
 		goto done;
 
+	if (dir->hashed) {
+		success = hashed_add (dir, name, inode_sector);
+		goto done;
+	}
+
 	/* Set OFS to offset of free slot.
 	 * If there are no free slots, then it will be set to the
 	 * current end-of-file.
@@ -159,6 +449,9 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector) {
 	success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
 done:
+	/* A negative entry for NAME may be cached. */
+	dcache_invalidate (inode_get_inumber (dir->inode), name);
+	inode_unlock_dir (dir->inode);
 	return success;
 }
 
@@ -176,24 +469,36 @@ dir_remove (struct dir *dir, const char *name) {
 	ASSERT (name != NULL);
 
 	/* Find directory entry. */
+	inode_lock_dir (dir->inode, true);
 	if (!lookup (dir, name, &e, &ofs))
 		goto done;
+	dcache_invalidate (inode_get_inumber (dir->inode), name);
 
 	/* Open inode. */
 	inode = inode_open (e.inode_sector);
 	if (inode == NULL)
 		goto done;
 
-	/* Erase directory entry. */
+	/* Erase directory entry.  In a hashed directory the name stays,
+	 * marking the slot as removed rather than unused. */
 	e.in_use = false;
 	if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
 		goto done;
+	if (dir->hashed) {
+		struct dir_header h;
+
+		read_header (dir, &h);
+		h.entry_cnt--;
+		h.removed_cnt++;
+		write_header (dir, &h);
+	}
 
 	/* Remove inode. */
 	inode_remove (inode);
 	success = true;
 
 done:
+	inode_unlock_dir (dir->inode);
 	inode_close (inode);
 	return success;
 }
@@ -204,13 +509,31 @@ done:
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1]) {
 	struct dir_entry e;
+	off_t end = -1;
+	bool success = false;
+
+	/* A new table moves every entry, so it must not take over between
+	 * two reads. */
+	inode_lock_dir (dir->inode, false);
 
-	while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) {
+	/* Only the current table of a hashed directory holds entries. */
+	if (dir->hashed) {
+		struct dir_header h;
+
+		read_header (dir, &h);
+		if (dir->pos < slot_ofs (&h, 0))
+			dir->pos = slot_ofs (&h, 0);
+		end = slot_ofs (&h, h.slot_cnt);
+	}
+	while ((end < 0 || dir->pos < end)
+			&& inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) {
 		dir->pos += sizeof e;
 		if (e.in_use) {
 			strlcpy (name, e.name, NAME_MAX + 1);
-			return true;
+			success = true;
+			break;
 		}
 	}
-	return false;
+	inode_unlock_dir (dir->inode);
+	return success;
 }
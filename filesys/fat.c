@@ -1,11 +1,19 @@
 #include "filesys/fat.h"
+#include <bitmap.h>
 #include "devices/disk.h"
 #include "filesys/filesys.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 #include "threads/synch.h"
 #include <stdio.h>
 #include <string.h>
 
+/* Number of FAT entries in one sector. */
+#define ENTRIES_PER_SECTOR (DISK_SECTOR_SIZE / sizeof (cluster_t))
+
+/* Most FAT sectors read or written with one disk command. */
+#define FAT_IO_SECTORS 16
+
 /* Should be less than DISK_SECTOR_SIZE */
 struct fat_boot {
 	unsigned int magic;
@@ -16,7 +24,13 @@ struct fat_boot {
 	unsigned int root_dir_cluster;
 };
 
-/* FAT FS */
+/* FAT FS
+ *
+ * FAT sectors are read from disk the first time one of their entries
+ * is needed, and only the sectors modified since they were last
+ * written are written back, by the journal as part of a transaction
+ * (see fat_take_dirty()).  WRITE_LOCK protects the FAT and every
+ * table below. */
 struct fat_fs {
 	struct fat_boot bs;
 	unsigned int *fat;
@@ -24,12 +38,18 @@ struct fat_fs {
 	disk_sector_t data_start;
 	cluster_t last_clst;
 	struct lock write_lock;
+	struct bitmap *free_clusters;   /* One bit per FAT entry, set if used
+	                                   or in a sector not loaded yet. */
+	uint16_t *free_cnt;             /* Free entries of each loaded sector. */
+	struct bitmap *loaded;          /* FAT sectors read from disk. */
+	struct bitmap *dirty;           /* FAT sectors to write back. */
 };
 
 static struct fat_fs *fat_fs;
 
 void fat_boot_create (void);
 void fat_fs_init (void);
+static void alloc_tables (bool fresh);
 
 void
 fat_init (void) {
@@ -53,31 +73,9 @@ fat_init (void) {
 
 void
 fat_open (void) {
-	fat_fs->fat = calloc (fat_fs->fat_length, sizeof (cluster_t));
+	/* Formatting leaves a complete table in memory. */
 	if (fat_fs->fat == NULL)
-		PANIC ("FAT load failed");
-
-	// Load FAT directly from the disk
-	uint8_t *buffer = (uint8_t *) fat_fs->fat;
-	off_t bytes_read = 0;
-	off_t bytes_left = sizeof (fat_fs->fat);
-	const off_t fat_size_in_bytes = fat_fs->fat_length * sizeof (cluster_t);
-	for (unsigned i = 0; i < fat_fs->bs.fat_sectors; i++) {
-		bytes_left = fat_size_in_bytes - bytes_read;
-		if (bytes_left >= DISK_SECTOR_SIZE) {
-			disk_read (filesys_disk, fat_fs->bs.fat_start + i,
-			           buffer + bytes_read);
-			bytes_read += DISK_SECTOR_SIZE;
-		} else {
-			uint8_t *bounce = malloc (DISK_SECTOR_SIZE);
-			if (bounce == NULL)
-				PANIC ("FAT load failed");
-			disk_read (filesys_disk, fat_fs->bs.fat_start + i, bounce);
-			memcpy (buffer + bytes_read, bounce, bytes_left);
-			bytes_read += bytes_left;
-			free (bounce);
-		}
-	}
+		alloc_tables (false);
 }
 
 void
@@ -90,27 +88,8 @@ fat_close (void) {
 	disk_write (filesys_disk, FAT_BOOT_SECTOR, bounce);
 	free (bounce);
 
-	// Write FAT directly to the disk
-	uint8_t *buffer = (uint8_t *) fat_fs->fat;
-	off_t bytes_wrote = 0;
-	off_t bytes_left = sizeof (fat_fs->fat);
-	const off_t fat_size_in_bytes = fat_fs->fat_length * sizeof (cluster_t);
-	for (unsigned i = 0; i < fat_fs->bs.fat_sectors; i++) {
-		bytes_left = fat_size_in_bytes - bytes_wrote;
-		if (bytes_left >= DISK_SECTOR_SIZE) {
-			disk_write (filesys_disk, fat_fs->bs.fat_start + i,
-			            buffer + bytes_wrote);
-			bytes_wrote += DISK_SECTOR_SIZE;
-		} else {
-			bounce = calloc (1, DISK_SECTOR_SIZE);
-			if (bounce == NULL)
-				PANIC ("FAT close failed");
-			memcpy (bounce, buffer + bytes_wrote, bytes_left);
-			disk_write (filesys_disk, fat_fs->bs.fat_start + i, bounce);
-			bytes_wrote += bytes_left;
-			free (bounce);
-		}
-	}
+	// Write the modified part of the FAT to the disk
+	fat_flush ();
 }
 
 void
@@ -120,9 +99,7 @@ fat_create (void) {
 	fat_fs_init ();
 
 	// Create FAT table
-	fat_fs->fat = calloc (fat_fs->fat_length, sizeof (cluster_t));
-	if (fat_fs->fat == NULL)
-		PANIC ("FAT creation failed");
+	alloc_tables (true);
 
 	// Set up ROOT_DIR_CLST
 	fat_put (ROOT_DIR_CLUSTER, EOChain);
@@ -137,13 +114,15 @@ fat_create (void) {
 
 void
 fat_boot_create (void) {
+	/* The journal takes up the end of the disk. */
+	unsigned int total_sectors = journal_start ();
 	unsigned int fat_sectors =
-	    (disk_size (filesys_disk) - 1)
+	    (total_sectors - 1)
 	    / (DISK_SECTOR_SIZE / sizeof (cluster_t) * SECTORS_PER_CLUSTER + 1) + 1;
 	fat_fs->bs = (struct fat_boot){
 	    .magic = FAT_MAGIC,
 	    .sectors_per_cluster = SECTORS_PER_CLUSTER,
-	    .total_sectors = disk_size (filesys_disk),
+	    .total_sectors = total_sectors,
 	    .fat_start = 1,
 	    .fat_sectors = fat_sectors,
 	    .root_dir_cluster = ROOT_DIR_CLUSTER,
@@ -152,7 +131,239 @@ fat_boot_create (void) {
 
 void
 fat_fs_init (void) {
-	/* TODO: Your code goes here. */
+	/* Cluster 0 is not a valid cluster: entry 0 of the FAT is never
+	 * used, and a 0 entry marks a free cluster. */
+	unsigned int data_clusters;
+
+	fat_fs->data_start = fat_fs->bs.fat_start + fat_fs->bs.fat_sectors;
+	data_clusters = (fat_fs->bs.total_sectors - fat_fs->data_start)
+		/ SECTORS_PER_CLUSTER;
+	fat_fs->fat_length = data_clusters + 1;
+	if (fat_fs->fat_length
+			> fat_fs->bs.fat_sectors * (DISK_SECTOR_SIZE / sizeof (cluster_t)))
+		fat_fs->fat_length =
+			fat_fs->bs.fat_sectors * (DISK_SECTOR_SIZE / sizeof (cluster_t));
+	fat_fs->last_clst = ROOT_DIR_CLUSTER;
+	lock_init (&fat_fs->write_lock);
+}
+
+/* Returns the first and one past the last valid FAT entry of FAT
+ * sector SEC in *FIRST and *END. */
+static void
+sector_entries (size_t sec, cluster_t *first, cluster_t *end) {
+	*first = sec * ENTRIES_PER_SECTOR;
+	if (*first == 0)
+		*first = 1;
+	*end = (sec + 1) * ENTRIES_PER_SECTOR;
+	if (*end > fat_fs->fat_length)
+		*end = fat_fs->fat_length;
+}
+
+/* Allocates the in-memory FAT and its tables.  If FRESH, the FAT is
+ * a new, empty one that must all be written out; otherwise it is
+ * read from disk on demand. */
+static void
+alloc_tables (bool fresh) {
+	size_t sec;
+
+	fat_fs->fat = calloc (fat_fs->bs.fat_sectors * ENTRIES_PER_SECTOR,
+			sizeof (cluster_t));
+	fat_fs->free_cnt = calloc (fat_fs->bs.fat_sectors, sizeof (uint16_t));
+	fat_fs->free_clusters = bitmap_create (fat_fs->fat_length);
+	fat_fs->loaded = bitmap_create (fat_fs->bs.fat_sectors);
+	fat_fs->dirty = bitmap_create (fat_fs->bs.fat_sectors);
+	if (fat_fs->fat == NULL || fat_fs->free_cnt == NULL
+			|| fat_fs->free_clusters == NULL || fat_fs->loaded == NULL
+			|| fat_fs->dirty == NULL)
+		PANIC ("FAT allocation failed");
+
+	/* Entry 0 is never allocated, and unloaded sectors look full. */
+	bitmap_set_all (fat_fs->free_clusters, !fresh);
+	bitmap_mark (fat_fs->free_clusters, 0);
+	bitmap_set_all (fat_fs->loaded, fresh);
+	bitmap_set_all (fat_fs->dirty, fresh);
+	if (fresh)
+		for (sec = 0; sec < fat_fs->bs.fat_sectors; sec++) {
+			cluster_t first, end;
+
+			sector_entries (sec, &first, &end);
+			fat_fs->free_cnt[sec] = first < end ? end - first : 0;
+		}
+}
+
+/* Reads FAT sector SEC from disk unless it is already in memory.
+ * The sectors not in memory that follow it are read along with it,
+ * up to FAT_IO_SECTORS in all, since a search for a free cluster
+ * moves on to them next.  WRITE_LOCK must be held. */
+static void
+load_sector (size_t sec) {
+	enum disk_origin origin;
+	size_t cnt, i;
+
+	ASSERT (lock_held_by_current_thread (&fat_fs->write_lock));
+
+	if (bitmap_test (fat_fs->loaded, sec))
+		return;
+	for (cnt = 1; cnt < FAT_IO_SECTORS && sec + cnt < fat_fs->bs.fat_sectors
+			&& !bitmap_test (fat_fs->loaded, sec + cnt); cnt++)
+		continue;
+	origin = disk_set_origin (DISK_IO_FREE_MAP);
+	disk_read_multi (filesys_disk, fat_fs->bs.fat_start + sec,
+			fat_fs->fat + sec * ENTRIES_PER_SECTOR, cnt);
+	disk_set_origin (origin);
+
+	for (i = sec; i < sec + cnt; i++) {
+		cluster_t first, end, clst;
+
+		sector_entries (i, &first, &end);
+		fat_fs->free_cnt[i] = 0;
+		for (clst = first; clst < end; clst++) {
+			bool used = fat_fs->fat[clst] != 0;
+			bitmap_set (fat_fs->free_clusters, clst, used);
+			fat_fs->free_cnt[i] += !used;
+		}
+	}
+	bitmap_set_multiple (fat_fs->loaded, sec, cnt, true);
+}
+
+/* Makes sure the FAT entry for CLST is in memory. */
+static void
+load_entry (cluster_t clst) {
+	size_t sec = clst / ENTRIES_PER_SECTOR;
+
+	if (!bitmap_test (fat_fs->loaded, sec)) {
+		lock_acquire (&fat_fs->write_lock);
+		load_sector (sec);
+		lock_release (&fat_fs->write_lock);
+	}
+}
+
+/* Sets the FAT entry for CLST to VAL, keeping the free cluster index
+ * up to date and marking the sector dirty.  WRITE_LOCK must be
+ * held. */
+static void
+set_entry (cluster_t clst, cluster_t val) {
+	size_t sec = clst / ENTRIES_PER_SECTOR;
+	bool was_used, used = val != 0;
+
+	ASSERT (clst != 0 && clst < fat_fs->fat_length);
+
+	load_sector (sec);
+	was_used = fat_fs->fat[clst] != 0;
+	if (used != was_used) {
+		bitmap_set (fat_fs->free_clusters, clst, used);
+		if (used)
+			fat_fs->free_cnt[sec]--;
+		else
+			fat_fs->free_cnt[sec]++;
+	}
+	fat_fs->fat[clst] = val;
+	bitmap_mark (fat_fs->dirty, sec);
+}
+
+/* Returns a free cluster, preferring HINT and the clusters after it,
+ * or 0 if the disk is full.  FAT sectors are loaded as the search
+ * reaches them; sectors known to be full are skipped without a scan.
+ * WRITE_LOCK must be held. */
+static cluster_t
+find_free (cluster_t hint) {
+	size_t first_sec, i;
+
+	if (hint == 0 || hint >= fat_fs->fat_length)
+		hint = 1;
+	first_sec = hint / ENTRIES_PER_SECTOR;
+
+	load_sector (first_sec);
+	if (fat_fs->free_cnt[first_sec] > 0) {
+		size_t clst = bitmap_scan (fat_fs->free_clusters, hint, 1, false);
+		if (clst != BITMAP_ERROR && clst / ENTRIES_PER_SECTOR == first_sec)
+			return clst;
+	}
+
+	/* The other sectors in order, then the start of the first one. */
+	for (i = 1; i <= fat_fs->bs.fat_sectors; i++) {
+		size_t sec = (first_sec + i) % fat_fs->bs.fat_sectors;
+
+		load_sector (sec);
+		if (fat_fs->free_cnt[sec] > 0)
+			return bitmap_scan (fat_fs->free_clusters,
+					sec * ENTRIES_PER_SECTOR, 1, false);
+	}
+	return 0;
+}
+
+/* Writes the FAT sectors modified since they were last written to
+ * disk, outside of any journal transaction. */
+void
+fat_flush (void) {
+	uint8_t *bounce = malloc (FAT_IO_SECTORS * DISK_SECTOR_SIZE);
+	size_t sec = 0, cnt = 0;
+	enum disk_origin origin;
+
+	if (bounce == NULL)
+		PANIC ("FAT flush failed");
+	origin = disk_set_origin (DISK_IO_FREE_MAP);
+
+	/* Each run of up to FAT_IO_SECTORS dirty sectors is copied under
+	 * the lock and written with one disk command without it, so the
+	 * FAT stays usable during the disk write.  A change made
+	 * meanwhile marks the sector dirty again. */
+	for (;;) {
+		lock_acquire (&fat_fs->write_lock);
+		sec = bitmap_scan (fat_fs->dirty, sec, 1, true);
+		if (sec != BITMAP_ERROR) {
+			for (cnt = 1; cnt < FAT_IO_SECTORS
+					&& sec + cnt < fat_fs->bs.fat_sectors
+					&& bitmap_test (fat_fs->dirty, sec + cnt); cnt++)
+				continue;
+			bitmap_set_multiple (fat_fs->dirty, sec, cnt, false);
+			memcpy (bounce, fat_fs->fat + sec * ENTRIES_PER_SECTOR,
+					cnt * DISK_SECTOR_SIZE);
+		}
+		lock_release (&fat_fs->write_lock);
+		if (sec == BITMAP_ERROR)
+			break;
+		disk_write_multi (filesys_disk, fat_fs->bs.fat_start + sec, bounce,
+				cnt);
+		sec += cnt;
+	}
+	disk_set_origin (origin);
+	free (bounce);
+}
+
+/* Copies up to MAX of the FAT sectors modified since they were last
+ * written into DATA, and their disk sectors into SECTORS, and marks
+ * them clean.  Returns the number of sectors copied; the caller
+ * writes them to disk. */
+size_t
+fat_take_dirty (disk_sector_t *sectors, uint8_t *data, size_t max) {
+	size_t cnt = 0, sec = 0;
+
+	lock_acquire (&fat_fs->write_lock);
+	while (cnt < max) {
+		sec = bitmap_scan_and_flip (fat_fs->dirty, sec, 1, true);
+		if (sec == BITMAP_ERROR)
+			break;
+		sectors[cnt] = fat_fs->bs.fat_start + sec;
+		memcpy (data + cnt * DISK_SECTOR_SIZE,
+				fat_fs->fat + sec * ENTRIES_PER_SECTOR, DISK_SECTOR_SIZE);
+		cnt++;
+		sec++;
+	}
+	lock_release (&fat_fs->write_lock);
+	return cnt;
+}
+
+/* Returns the number of FAT sectors modified since they were last
+ * written. */
+size_t
+fat_dirty_cnt (void) {
+	size_t cnt;
+
+	lock_acquire (&fat_fs->write_lock);
+	cnt = bitmap_count (fat_fs->dirty, 0, bitmap_size (fat_fs->dirty), true);
+	lock_release (&fat_fs->write_lock);
+	return cnt;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -164,30 +375,76 @@ fat_fs_init (void) {
  * Returns 0 if fails to allocate a new cluster. */
 cluster_t
 fat_create_chain (cluster_t clst) {
-	/* TODO: Your code goes here. */
+	cluster_t new;
+
+	ASSERT (clst < fat_fs->fat_length);
+
+	lock_acquire (&fat_fs->write_lock);
+	/* A cluster right after the chain's tail keeps the chain
+	 * contiguous on disk.  A new chain starts after the cluster
+	 * allocated last. */
+	new = find_free ((clst != 0 ? clst : fat_fs->last_clst) + 1);
+	if (new != 0) {
+		set_entry (new, EOChain);
+		if (clst != 0)
+			set_entry (clst, new);
+		fat_fs->last_clst = new;
+	}
+	lock_release (&fat_fs->write_lock);
+	return new;
 }
 
 /* Remove the chain of clusters starting from CLST.
  * If PCLST is 0, assume CLST as the start of the chain. */
 void
 fat_remove_chain (cluster_t clst, cluster_t pclst) {
-	/* TODO: Your code goes here. */
+	lock_acquire (&fat_fs->write_lock);
+	if (pclst != 0)
+		set_entry (pclst, EOChain);
+	while (clst != 0 && clst != EOChain) {
+		cluster_t next;
+
+		ASSERT (clst < fat_fs->fat_length);
+		load_sector (clst / ENTRIES_PER_SECTOR);
+		next = fat_fs->fat[clst];
+		set_entry (clst, 0);
+		clst = next;
+	}
+	lock_release (&fat_fs->write_lock);
 }
 
 /* Update a value in the FAT table. */
 void
 fat_put (cluster_t clst, cluster_t val) {
-	/* TODO: Your code goes here. */
+	ASSERT (clst != 0 && clst < fat_fs->fat_length);
+
+	lock_acquire (&fat_fs->write_lock);
+	set_entry (clst, val);
+	lock_release (&fat_fs->write_lock);
 }
 
 /* Fetch a value in the FAT table. */
 cluster_t
 fat_get (cluster_t clst) {
-	/* TODO: Your code goes here. */
+	ASSERT (clst != 0 && clst < fat_fs->fat_length);
+
+	load_entry (clst);
+	return fat_fs->fat[clst];
 }
 
 /* Covert a cluster # to a sector number. */
 disk_sector_t
 cluster_to_sector (cluster_t clst) {
-	/* TODO: Your code goes here. */
+	ASSERT (clst != 0 && clst < fat_fs->fat_length);
+
+	return fat_fs->data_start + (clst - 1) * SECTORS_PER_CLUSTER;
+}
+
+/* Converts sector SECTOR of the data area to the number of the
+ * cluster that contains it. */
+cluster_t
+sector_to_cluster (disk_sector_t sector) {
+	ASSERT (sector >= fat_fs->data_start);
+
+	return (sector - fat_fs->data_start) / SECTORS_PER_CLUSTER + 1;
 }
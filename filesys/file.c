@@ -1,8 +1,14 @@
 #include "filesys/file.h"
 #include <debug.h>
 #include "filesys/inode.h"
+#include "devices/disk.h"
 #include "threads/malloc.h"
 
+/* Bounds of the read-ahead window, in sectors.  The window starts
+ * small and doubles with every read that continues the previous one. */
+#define READ_AHEAD_MIN 2
+#define READ_AHEAD_MAX 16
+
 
 /* Opens a file for the given INODE, of which it takes ownership,
  * and returns the new file.  Returns a null pointer if an
@@ -14,6 +20,9 @@ file_open (struct inode *inode) {
 		file->inode = inode;
 		file->pos = 0;
 		file->deny_write = false;
+		file->ra_next = 0;
+		file->ra_end = 0;
+		file->ra_window = 0;
 		return file;
 	} else {
 		inode_close (inode);
@@ -58,6 +67,40 @@ file_get_inode (struct file *file) {
 	return file->inode;
 }
 
+/* Updates FILE's access pattern after BYTES_READ bytes were read at
+ * offset OFS.  While reads are sequential, the data that follows is
+ * read into the buffer cache in the background, so that it is there
+ * when the caller asks for it; a read elsewhere shrinks the window
+ * back and issues nothing. */
+static void
+read_ahead (struct file *file, off_t ofs, off_t bytes_read) {
+	off_t end = ofs + bytes_read;
+	off_t ra_start, ra_end;
+
+	if (bytes_read == 0)
+		return;
+	if (ofs != file->ra_next) {
+		file->ra_next = end;
+		file->ra_end = end;
+		file->ra_window = 0;
+		return;
+	}
+	file->ra_next = end;
+
+	if (file->ra_window == 0)
+		file->ra_window = READ_AHEAD_MIN;
+	else if (file->ra_window < READ_AHEAD_MAX)
+		file->ra_window *= 2;
+
+	/* Only the part of the window not requested before is new. */
+	ra_start = file->ra_end > end ? file->ra_end : end;
+	ra_end = end + file->ra_window * DISK_SECTOR_SIZE;
+	if (ra_start < ra_end) {
+		inode_read_ahead (file->inode, ra_start, ra_end - ra_start);
+		file->ra_end = ra_end;
+	}
+}
+
 /* Reads SIZE bytes from FILE into BUFFER,
  * starting at the file's current position.
  * Returns the number of bytes actually read,
@@ -66,6 +109,7 @@ file_get_inode (struct file *file) {
 off_t
 file_read (struct file *file, void *buffer, off_t size) {
 	off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+	read_ahead (file, file->pos, bytes_read);
 	file->pos += bytes_read;
 	return bytes_read;
 }
@@ -77,15 +121,16 @@ file_read (struct file *file, void *buffer, off_t size) {
  * The file's current position is unaffected. */
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) {
-	return inode_read_at (file->inode, buffer, size, file_ofs);
+	off_t bytes_read = inode_read_at (file->inode, buffer, size, file_ofs);
+	read_ahead (file, file_ofs, bytes_read);
+	return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into FILE,
  * starting at the file's current position.
  * Returns the number of bytes actually written,
- * which may be less than SIZE if end of file is reached.
- * (Normally we'd grow the file in that case, but file growth is
- * not yet implemented.)
+ * which may be less than SIZE if the disk is full.
+ * Writing past end of file extends the file.
  * Advances FILE's position by the number of bytes read. */
 off_t
 file_write (struct file *file, const void *buffer, off_t size) {
@@ -97,9 +142,8 @@ file_write (struct file *file, const void *buffer, off_t size) {
 /* Writes SIZE bytes from BUFFER into FILE,
  * starting at offset FILE_OFS in the file.
  * Returns the number of bytes actually written,
- * which may be less than SIZE if end of file is reached.
- * (Normally we'd grow the file in that case, but file growth is
- * not yet implemented.)
+ * which may be less than SIZE if the disk is full.
+ * Writing past end of file extends the file.
  * The file's current position is unaffected. */
 off_t
 file_write_at (struct file *file, const void *buffer, off_t size,
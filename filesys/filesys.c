@@ -2,26 +2,47 @@
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/buffer_cache.h"
+#include "filesys/dcache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/journal.h"
 #include "devices/disk.h"
 
 /* The disk that contains the file system. */
 struct disk *filesys_disk;
 
+/* -fsdisk: Name of the file system disk, if not hd0:1. */
+const char *filesys_disk_name;
+
 static void do_format (void);
 
 /* Initializes the file system module.
  * If FORMAT is true, reformats the file system. */
 void
 filesys_init (bool format) {
-	filesys_disk = disk_get (0, 1);
-	if (filesys_disk == NULL)
-		PANIC ("hd0:1 (hdb) not present, file system initialization failed");
-
+	if (filesys_disk_name != NULL) {
+		filesys_disk = disk_find (filesys_disk_name);
+		if (filesys_disk == NULL)
+			PANIC ("%s not present, file system initialization failed",
+					filesys_disk_name);
+	} else {
+		filesys_disk = disk_get (0, 1);
+		if (filesys_disk == NULL)
+			PANIC ("hd0:1 (hdb) not present, file system initialization failed");
+	}
+
+	buffer_cache_init ();
 	inode_init ();
+	dcache_init ();
+	journal_init ();
+
+	/* An interrupted transaction is completed before anything else is
+	 * read from the disk. */
+	if (!format)
+		journal_recover ();
 
 #ifdef EFILESYS
 	fat_init ();
@@ -39,18 +60,23 @@ filesys_init (bool format) {
 
 	free_map_open ();
 #endif
+
+	journal_open ();
 }
 
 /* Shuts down the file system module, writing any unwritten data
  * to disk. */
 void
 filesys_done (void) {
+	journal_done ();
+
 	/* Original FS */
 #ifdef EFILESYS
 	fat_close ();
 #else
 	free_map_close ();
 #endif
+	buffer_cache_done ();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
@@ -61,12 +87,31 @@ bool
 filesys_create (const char *name, off_t initial_size) {
 	disk_sector_t inode_sector = 0;
 	struct dir *dir = dir_open_root ();
+
+	/* The inode's allocation, the inode and the directory entry reach
+	 * the disk together.  Growing the directory takes operations of its
+	 * own, so it comes first. */
+	if (dir != NULL)
+		dir_make_room (dir);
+	journal_begin ();
+#ifdef EFILESYS
+	cluster_t inode_clst = 0;
+	bool success = (dir != NULL
+			&& (inode_clst = fat_create_chain (0)) != 0
+			&& inode_create (inode_sector = cluster_to_sector (inode_clst),
+				initial_size)
+			&& dir_add (dir, name, inode_sector));
+	if (!success && inode_clst != 0)
+		fat_remove_chain (inode_clst, 0);
+#else
 	bool success = (dir != NULL
 			&& free_map_allocate (1, &inode_sector)
 			&& inode_create (inode_sector, initial_size)
 			&& dir_add (dir, name, inode_sector));
 	if (!success && inode_sector != 0)
 		free_map_release (inode_sector, 1);
+#endif
+	journal_end ();
 	dir_close (dir);
 
 	return success;
@@ -96,7 +141,18 @@ filesys_open (const char *name) {
 bool
 filesys_remove (const char *name) {
 	struct dir *dir = dir_open_root ();
-	bool success = dir != NULL && dir_remove (dir, name);
+	struct inode *inode = NULL;
+	bool success;
+
+	/* The file is kept open until the removal is journaled, so that
+	 * freeing its sectors, which takes journal operations of its own,
+	 * does not happen inside this one. */
+	if (dir != NULL)
+		dir_lookup (dir, name, &inode);
+	journal_begin ();
+	success = dir != NULL && dir_remove (dir, name);
+	journal_end ();
+	inode_close (inode);
 	dir_close (dir);
 
 	return success;
@@ -107,9 +163,12 @@ static void
 do_format (void) {
 	printf ("Formatting file system...");
 
+	journal_format ();
 #ifdef EFILESYS
 	/* Create FAT and save it to the disk. */
 	fat_create ();
+	if (!dir_create (ROOT_DIR_SECTOR, 16))
+		PANIC ("root directory creation failed");
 	fat_close ();
 #else
 	free_map_create ();
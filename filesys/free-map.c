@@ -1,12 +1,282 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <hash.h>
+#include <list.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per disk sector. */
+static struct lock free_map_lock;    /* Protects the free map and extents. */
+
+/* The free map is kept on disk as a bitmap, and in memory also as the
+ * set of maximal runs of free sectors ("extents").  Extents are
+ * indexed by their first sector and by the sector after their last,
+ * so that a released run merges with its neighbours in constant time,
+ * and are sorted into buckets by size, so that the best fitting one
+ * is found without scanning the bitmap. */
+
+/* A maximal run of free sectors. */
+struct extent {
+	disk_sector_t start;                /* First free sector. */
+	size_t cnt;                         /* Number of free sectors. */
+	struct hash_elem start_elem;        /* Element in extents_by_start. */
+	struct hash_elem end_elem;          /* Element in extents_by_end. */
+	struct list_elem bucket_elem;       /* Element in a size bucket. */
+};
+
+/* Extents of CNT sectors are in bucket floor(log2(CNT)). */
+#define BUCKET_CNT 32
+
+static struct hash extents_by_start;
+static struct hash extents_by_end;
+static struct list buckets[BUCKET_CNT];
+static bool extents_built;              /* Are the tables initialized? */
+
+/* Returns the size bucket for extents of CNT sectors. */
+static size_t
+bucket_of (size_t cnt) {
+	size_t bucket = 0;
+
+	ASSERT (cnt > 0);
+	while (cnt >>= 1)
+		bucket++;
+	return bucket < BUCKET_CNT ? bucket : BUCKET_CNT - 1;
+}
+
+/* Hashes extents by first sector. */
+static uint64_t
+extent_start_hash (const struct hash_elem *e, void *aux UNUSED) {
+	return hash_int (hash_entry (e, struct extent, start_elem)->start);
+}
+
+static bool
+extent_start_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct extent, start_elem)->start
+		< hash_entry (b, struct extent, start_elem)->start;
+}
+
+/* Hashes extents by the sector just past their end. */
+static uint64_t
+extent_end_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct extent *x = hash_entry (e, struct extent, end_elem);
+	return hash_int (x->start + x->cnt);
+}
+
+static bool
+extent_end_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	const struct extent *x = hash_entry (a, struct extent, end_elem);
+	const struct extent *y = hash_entry (b, struct extent, end_elem);
+	return x->start + x->cnt < y->start + y->cnt;
+}
+
+/* Adds EXTENT to the indexes. */
+static void
+extent_link (struct extent *extent) {
+	hash_insert (&extents_by_start, &extent->start_elem);
+	hash_insert (&extents_by_end, &extent->end_elem);
+	list_push_back (&buckets[bucket_of (extent->cnt)], &extent->bucket_elem);
+}
+
+/* Removes EXTENT from the indexes. */
+static void
+extent_unlink (struct extent *extent) {
+	hash_delete (&extents_by_start, &extent->start_elem);
+	hash_delete (&extents_by_end, &extent->end_elem);
+	list_remove (&extent->bucket_elem);
+}
+
+/* Returns the extent that starts at SECTOR, or a null pointer. */
+static struct extent *
+extent_starting_at (disk_sector_t sector) {
+	struct extent key;
+	struct hash_elem *e;
+
+	key.start = sector;
+	e = hash_find (&extents_by_start, &key.start_elem);
+	return e != NULL ? hash_entry (e, struct extent, start_elem) : NULL;
+}
+
+/* Returns the extent that ends just before SECTOR, or a null
+ * pointer. */
+static struct extent *
+extent_ending_at (disk_sector_t sector) {
+	struct extent key;
+	struct hash_elem *e;
+
+	key.start = sector;
+	key.cnt = 0;
+	e = hash_find (&extents_by_end, &key.end_elem);
+	return e != NULL ? hash_entry (e, struct extent, end_elem) : NULL;
+}
+
+/* Records the CNT sectors starting at SECTOR as free, merging them
+ * with the extents around them. */
+static void
+extent_free (disk_sector_t sector, size_t cnt) {
+	struct extent *prev = extent_ending_at (sector);
+	struct extent *next = extent_starting_at (sector + cnt);
+
+	if (prev != NULL) {
+		extent_unlink (prev);
+		prev->cnt += cnt;
+		if (next != NULL) {
+			extent_unlink (next);
+			prev->cnt += next->cnt;
+			free (next);
+		}
+		extent_link (prev);
+	} else if (next != NULL) {
+		extent_unlink (next);
+		next->start = sector;
+		next->cnt += cnt;
+		extent_link (next);
+	} else {
+		struct extent *extent = malloc (sizeof *extent);
+		if (extent == NULL)
+			PANIC ("free map: out of memory");
+		extent->start = sector;
+		extent->cnt = cnt;
+		extent_link (extent);
+	}
+}
+
+/* Takes the first CNT sectors of EXTENT and returns the first. */
+static disk_sector_t
+extent_take (struct extent *extent, size_t cnt) {
+	disk_sector_t sector = extent->start;
+
+	ASSERT (extent->cnt >= cnt);
+
+	extent_unlink (extent);
+	if (extent->cnt == cnt)
+		free (extent);
+	else {
+		extent->start += cnt;
+		extent->cnt -= cnt;
+		extent_link (extent);
+	}
+	return sector;
+}
+
+/* Takes the CNT sectors starting at SECTOR out of EXTENT, which must
+ * contain them, leaving the free sectors before and after them as
+ * extents of their own. */
+static void
+extent_take_at (struct extent *extent, disk_sector_t sector, size_t cnt) {
+	disk_sector_t start = extent->start;
+	disk_sector_t end = extent->start + extent->cnt;
+
+	ASSERT (sector >= start && sector + cnt <= end);
+
+	if (sector == start) {
+		extent_take (extent, cnt);
+		return;
+	}
+	extent_unlink (extent);
+	free (extent);
+	extent_free (start, sector - start);
+	if (sector + cnt < end)
+		extent_free (sector + cnt, end - (sector + cnt));
+}
+
+/* Returns the first sector of the first run of CNT free sectors at or
+ * after HINT, storing the extent that contains it into *EXTENTP, or
+ * BITMAP_ERROR if there is none.  Walks the free runs from HINT on
+ * one at a time; the first may be the tail of an extent that starts
+ * before HINT. */
+static size_t
+first_fit_after (size_t cnt, disk_sector_t hint, struct extent **extentp) {
+	size_t sector_cnt = bitmap_size (free_map);
+	size_t sector = hint;
+
+	while (sector < sector_cnt) {
+		size_t end;
+
+		sector = bitmap_scan (free_map, sector, 1, false);
+		if (sector == BITMAP_ERROR)
+			break;
+		end = bitmap_scan (free_map, sector, 1, true);
+		if (end == BITMAP_ERROR)
+			end = sector_cnt;
+		if (end - sector >= cnt) {
+			*extentp = extent_ending_at (end);
+			ASSERT (*extentp != NULL && (*extentp)->start <= sector);
+			return sector;
+		}
+		sector = end;
+	}
+	return BITMAP_ERROR;
+}
+
+/* Returns the smallest extent of at least CNT sectors, or a null
+ * pointer.  Every extent in a bucket is larger than every extent in
+ * the buckets below, so only the first bucket with a fit is
+ * searched. */
+static struct extent *
+best_fit (size_t cnt) {
+	size_t bucket;
+
+	for (bucket = bucket_of (cnt); bucket < BUCKET_CNT; bucket++) {
+		struct extent *best = NULL;
+		struct list_elem *e;
+
+		for (e = list_begin (&buckets[bucket]); e != list_end (&buckets[bucket]);
+				e = list_next (e)) {
+			struct extent *extent = list_entry (e, struct extent, bucket_elem);
+			if (extent->cnt >= cnt && (best == NULL || extent->cnt < best->cnt)) {
+				best = extent;
+				if (best->cnt == cnt)
+					break;
+			}
+		}
+		if (best != NULL)
+			return best;
+	}
+	return NULL;
+}
+
+/* Frees the extent with start_elem E. */
+static void
+extent_destroy (struct hash_elem *e, void *aux UNUSED) {
+	free (hash_entry (e, struct extent, start_elem));
+}
+
+/* Rebuilds the extents from the free map bitmap. */
+static void
+build_extents (void) {
+	size_t i, sector_cnt = bitmap_size (free_map);
+
+	if (extents_built) {
+		hash_destroy (&extents_by_end, NULL);
+		hash_destroy (&extents_by_start, extent_destroy);
+	}
+	hash_init (&extents_by_start, extent_start_hash, extent_start_less, NULL);
+	hash_init (&extents_by_end, extent_end_hash, extent_end_less, NULL);
+	for (i = 0; i < BUCKET_CNT; i++)
+		list_init (&buckets[i]);
+	extents_built = true;
+
+	for (i = 0; i < sector_cnt; ) {
+		size_t start = bitmap_scan (free_map, i, 1, false);
+		size_t end;
+
+		if (start == BITMAP_ERROR)
+			break;
+		end = bitmap_scan (free_map, start, 1, true);
+		if (end == BITMAP_ERROR)
+			end = sector_cnt;
+		extent_free (start, end - start);
+		i = end;
+	}
+}
 
 /* Initializes the free map. */
 void
@@ -14,34 +284,75 @@ free_map_init (void) {
 	free_map = bitmap_create (disk_size (filesys_disk));
 	if (free_map == NULL)
 		PANIC ("bitmap creation failed--disk is too large");
+	lock_init (&free_map_lock);
 	bitmap_mark (free_map, FREE_MAP_SECTOR);
 	bitmap_mark (free_map, ROOT_DIR_SECTOR);
+	bitmap_set_multiple (free_map, journal_start (), JOURNAL_SECTORS, true);
+	build_extents ();
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
- * the first into *SECTORP.
+ * the first into *SECTORP.  The sectors are taken from the smallest
+ * run of free sectors that is large enough.
  * Returns true if successful, false if all sectors were
  * available. */
 bool
 free_map_allocate (size_t cnt, disk_sector_t *sectorp) {
-	disk_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-	if (sector != BITMAP_ERROR
-			&& free_map_file != NULL
-			&& !bitmap_write (free_map, free_map_file)) {
+	return free_map_allocate_near (cnt, 0, sectorp);
+}
+
+/* Like free_map_allocate(), but takes the first CNT free sectors at
+ * or after HINT, if there are any, which keeps a file that grows one
+ * sector at a time contiguous, or at least close together and in
+ * order: HINT is then the sector after its last one.  A HINT of 0
+ * means none; sector 0 is never free. */
+bool
+free_map_allocate_near (size_t cnt, disk_sector_t hint,
+		disk_sector_t *sectorp) {
+	struct extent *extent = NULL;
+	disk_sector_t sector;
+	size_t near = BITMAP_ERROR;
+
+	if (cnt == 0) {
+		*sectorp = 0;
+		return true;
+	}
+	lock_acquire (&free_map_lock);
+	if (hint != 0 && hint < bitmap_size (free_map))
+		near = first_fit_after (cnt, hint, &extent);
+	if (near != BITMAP_ERROR) {
+		sector = near;
+		extent_take_at (extent, sector, cnt);
+	} else {
+		extent = best_fit (cnt);
+		if (extent == NULL) {
+			lock_release (&free_map_lock);
+			return false;
+		}
+		sector = extent_take (extent, cnt);
+	}
+	bitmap_set_multiple (free_map, sector, cnt, true);
+	if (free_map_file != NULL
+			&& !bitmap_write_range (free_map, free_map_file, sector, cnt)) {
 		bitmap_set_multiple (free_map, sector, cnt, false);
-		sector = BITMAP_ERROR;
+		extent_free (sector, cnt);
+		lock_release (&free_map_lock);
+		return false;
 	}
-	if (sector != BITMAP_ERROR)
-		*sectorp = sector;
-	return sector != BITMAP_ERROR;
+	lock_release (&free_map_lock);
+	*sectorp = sector;
+	return true;
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (disk_sector_t sector, size_t cnt) {
+	lock_acquire (&free_map_lock);
 	ASSERT (bitmap_all (free_map, sector, cnt));
 	bitmap_set_multiple (free_map, sector, cnt, false);
-	bitmap_write (free_map, free_map_file);
+	extent_free (sector, cnt);
+	bitmap_write_range (free_map, free_map_file, sector, cnt);
+	lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -52,6 +363,7 @@ free_map_open (void) {
 		PANIC ("can't open free map");
 	if (!bitmap_read (free_map, free_map_file))
 		PANIC ("can't read free map");
+	build_extents ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
@@ -68,10 +380,17 @@ free_map_create (void) {
 	if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map)))
 		PANIC ("free map creation failed");
 
-	/* Write bitmap to file. */
-	free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-	if (free_map_file == NULL)
+	/* Write bitmap to file.  The first write allocates the sectors
+	 * of the free map file itself, which changes the bitmap, so it is
+	 * written once more.  FREE_MAP_FILE is set in between: the
+	 * allocations of the first write must not write the bitmap to a
+	 * file that is still being filled in. */
+	struct file *file = file_open (inode_open (FREE_MAP_SECTOR));
+	if (file == NULL)
 		PANIC ("can't open free map");
+	if (!bitmap_write (free_map, file))
+		PANIC ("can't write free map");
+	free_map_file = file;
 	if (!bitmap_write (free_map, free_map_file))
 		PANIC ("can't write free map");
 }
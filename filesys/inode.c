@@ -1,69 +1,457 @@
 #include "filesys/inode.h"
-#include <list.h>
+#include <hash.h>
 #include <debug.h>
 #include <round.h>
+#include <stdint.h>
 #include <string.h>
+#include "filesys/buffer_cache.h"
+#include "filesys/fat.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Most data sectors an open inode remembers writing.  Closing an
+ * inode that wrote more flushes the whole cache instead. */
+#define WRITTEN_MAX 32
+
+#ifdef EFILESYS
+/* Distance, in clusters, between two shortcuts into a cluster
+ * chain.  A lookup follows at most CHAIN_SKIP - 1 FAT entries. */
+#define CHAIN_SKIP 16
+
+/* Most clusters freed by one journal operation.  Their FAT entries
+ * lie in at most as many FAT sectors. */
+#define RELEASE_CHUNK 8
+
+/* Largest file size an inode can describe. */
+#define MAX_FILE_SIZE INT32_MAX
+
 /* On-disk inode.
- * Must be exactly DISK_SECTOR_SIZE bytes long. */
+ * Must be exactly DISK_SECTOR_SIZE bytes long.
+ *
+ * Data lives in the FAT cluster chain that starts at START.  The
+ * chain covers the file up to the last byte ever written; the rest of
+ * the file reads as zeros and has no clusters yet. */
 struct inode_disk {
-	disk_sector_t start;                /* First data sector. */
+	cluster_t start;                    /* First data cluster, 0 if none. */
 	off_t length;                       /* File size in bytes. */
 	unsigned magic;                     /* Magic number. */
 	uint32_t unused[125];               /* Not used. */
 };
+#else
+/* Number of data sectors an inode points to directly. */
+#define DIRECT_CNT 123
 
-/* Returns the number of sectors to allocate for an inode SIZE
- * bytes long. */
-static inline size_t
-bytes_to_sectors (off_t size) {
-	return DIV_ROUND_UP (size, DISK_SECTOR_SIZE);
-}
+/* Number of sector numbers in an index sector. */
+#define PTRS_PER_SECTOR (DISK_SECTOR_SIZE / sizeof (disk_sector_t))
+
+/* Largest file size an inode can describe. */
+#define MAX_FILE_SIZE ((off_t) (DIRECT_CNT + PTRS_PER_SECTOR \
+			+ PTRS_PER_SECTOR * PTRS_PER_SECTOR) * DISK_SECTOR_SIZE)
+
+/* On-disk inode.
+ * Must be exactly DISK_SECTOR_SIZE bytes long.
+ *
+ * Data sectors are found through DIRECT, then through the index
+ * sector INDIRECT, then through the index sectors listed in
+ * DOUBLY_INDIRECT.  Sector 0 holds the free map inode and is never
+ * used for data, so 0 marks a block that was never written: it reads
+ * as zeros and costs no disk space. */
+struct inode_disk {
+	disk_sector_t direct[DIRECT_CNT];   /* Direct data sectors. */
+	disk_sector_t indirect;             /* Index of data sectors. */
+	disk_sector_t doubly_indirect;      /* Index of index sectors. */
+	off_t length;                       /* File size in bytes. */
+	unsigned magic;                     /* Magic number. */
+	uint32_t unused[1];                 /* Not used. */
+};
+#endif
 
 /* In-memory inode. */
 struct inode {
-	struct list_elem elem;              /* Element in inode list. */
+	struct hash_elem elem;              /* Element in open_inodes. */
 	disk_sector_t sector;               /* Sector number of disk location. */
+	struct rwlock data_lock;            /* Data and index: read or change. */
+	struct rwlock dir_lock;             /* See inode_lock_dir(). */
+	struct lock lock;                   /* Protects the members below. */
+	bool loading;                       /* DATA not read from disk yet? */
+	struct condition loaded;            /* LOADING became false. */
 	int open_cnt;                       /* Number of openers. */
 	bool removed;                       /* True if deleted, false otherwise. */
 	int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
 	struct inode_disk data;             /* Inode content. */
+
+	/* Data sectors written while open, to be flushed on the last
+	 * close.  Updated under the data lock. */
+	disk_sector_t written[WRITTEN_MAX];
+	size_t written_cnt;                 /* WRITTEN_MAX + 1 if more. */
+#ifdef EFILESYS
+	/* Shortcuts into the cluster chain, so that finding a cluster does
+	 * not walk the chain from its start.  SKIP[K] is cluster number
+	 * K * CHAIN_SKIP of the chain; LAST_CLST is cluster number
+	 * LAST_IDX, the one visited last.  Readers of the chain share the
+	 * data lock, so the shortcuts have a lock of their own. */
+	struct lock chain_lock;             /* Protects the members below. */
+	cluster_t *skip;                    /* Every CHAIN_SKIP'th cluster. */
+	size_t skip_cnt;                    /* Number of entries in SKIP. */
+	size_t last_idx;                    /* Index of LAST_CLST. */
+	cluster_t last_clst;                /* Cluster visited last, or 0. */
+#else
+	disk_sector_t last_alloc;           /* Sector allocated last, or 0. */
+#endif
 };
 
+#ifdef EFILESYS
+/* Records CLST as cluster number IDX of INODE's chain if it is the
+ * next shortcut INODE lacks.  Running out of memory only leaves the
+ * shortcut out. */
+static void
+remember_cluster (struct inode *inode, size_t idx, cluster_t clst) {
+	if (idx % CHAIN_SKIP == 0 && idx / CHAIN_SKIP == inode->skip_cnt) {
+		cluster_t *skip = realloc (inode->skip,
+				(inode->skip_cnt + 1) * sizeof *skip);
+		if (skip != NULL) {
+			skip[inode->skip_cnt++] = clst;
+			inode->skip = skip;
+		}
+	}
+	inode->last_idx = idx;
+	inode->last_clst = clst;
+}
+
+/* Zeros the sectors of cluster CLST. */
+static void
+zero_cluster (cluster_t clst) {
+	static const uint8_t zeros[DISK_SECTOR_SIZE];
+	size_t i;
+
+	for (i = 0; i < SECTORS_PER_CLUSTER; i++)
+		buffer_cache_write (cluster_to_sector (clst) + i, zeros, 0,
+				DISK_SECTOR_SIZE);
+}
+
+/* Returns cluster number IDX of INODE's chain, or 0 if the chain is
+ * shorter.  If ALLOCATE is true, the chain is extended up to IDX, one
+ * journal operation per cluster, however far that is; clusters before
+ * IDX are zeroed, while the contents of cluster IDX are undefined and
+ * the caller must write all of it.  Returns 0 if the disk is full.
+ *
+ * The walk starts from the closest cluster before IDX that INODE
+ * remembers, so sequential access and appends take one step and
+ * random access at most CHAIN_SKIP - 1 once the shortcuts exist. */
+static cluster_t
+chain_seek (struct inode *inode, size_t idx, bool allocate) {
+	cluster_t clst;
+	size_t i, k;
+
+	if (inode->data.start == 0) {
+		if (!allocate)
+			return 0;
+		journal_begin ();
+		clst = fat_create_chain (0);
+		if (clst != 0) {
+			if (idx > 0)
+				zero_cluster (clst);
+			inode->data.start = clst;
+			buffer_cache_write (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
+		}
+		journal_end ();
+		if (clst == 0)
+			return 0;
+	}
+	if (inode->skip_cnt == 0)
+		remember_cluster (inode, 0, inode->data.start);
+	if (inode->skip_cnt == 0)
+		PANIC ("inode: out of memory");
+
+	k = idx / CHAIN_SKIP < inode->skip_cnt
+		? idx / CHAIN_SKIP : inode->skip_cnt - 1;
+	i = k * CHAIN_SKIP;
+	clst = inode->skip[k];
+	if (inode->last_clst != 0 && i < inode->last_idx && inode->last_idx <= idx) {
+		i = inode->last_idx;
+		clst = inode->last_clst;
+	}
+
+	while (i < idx) {
+		cluster_t next = fat_get (clst);
+
+		if (next == EOChain) {
+			if (!allocate) {
+				remember_cluster (inode, i, clst);
+				return 0;
+			}
+			journal_begin ();
+			next = fat_create_chain (clst);
+			if (next != 0 && i + 1 < idx)
+				zero_cluster (next);
+			journal_end ();
+			if (next == 0) {
+				remember_cluster (inode, i, clst);
+				return 0;
+			}
+		}
+		clst = next;
+		remember_cluster (inode, ++i, clst);
+	}
+	inode->last_idx = i;
+	inode->last_clst = clst;
+	return clst;
+}
+
 /* Returns the disk sector that contains byte offset POS within
- * INODE.
- * Returns -1 if INODE does not contain data for a byte at offset
- * POS. */
+ * INODE, or 0 if INODE's cluster chain does not reach that far.
+ * If ALLOCATE is true, the chain is extended up to POS as described
+ * for chain_seek().  Returns 0 if the disk is full. */
 static disk_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) {
+byte_to_sector (struct inode *inode, off_t pos, bool allocate) {
+	cluster_t clst;
+
 	ASSERT (inode != NULL);
-	if (pos < inode->data.length)
-		return inode->data.start + pos / DISK_SECTOR_SIZE;
-	else
-		return -1;
+	ASSERT (pos >= 0);
+
+	lock_acquire (&inode->chain_lock);
+	clst = chain_seek (inode, pos / (DISK_SECTOR_SIZE * SECTORS_PER_CLUSTER),
+			allocate);
+	lock_release (&inode->chain_lock);
+	return clst != 0
+		? cluster_to_sector (clst) + pos / DISK_SECTOR_SIZE % SECTORS_PER_CLUSTER
+		: 0;
+}
+
+/* Frees the data clusters and the inode cluster of INODE.  The chain
+ * is freed from its start, RELEASE_CHUNK clusters per journal
+ * operation, each moving the start recorded in the inode past them.
+ * A crash in between leaves the rest of the chain to an inode that
+ * no directory refers to. */
+static void
+release_inode (struct inode *inode) {
+	while (inode->data.start != 0) {
+		cluster_t last = inode->data.start, next;
+		size_t i;
+
+		journal_begin ();
+		for (i = 1; i < RELEASE_CHUNK && (next = fat_get (last)) != EOChain;
+				i++)
+			last = next;
+		next = fat_get (last);
+		if (next != EOChain)
+			fat_put (last, EOChain);
+		fat_remove_chain (inode->data.start, 0);
+		inode->data.start = next != EOChain ? next : 0;
+		buffer_cache_write (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
+		journal_end ();
+	}
+	journal_begin ();
+	fat_remove_chain (sector_to_cluster (inode->sector), 0);
+	journal_end ();
+}
+#else
+
+/* Allocates a sector for INODE, zeroing it if ZERO is true.
+ * The sector after the one allocated last for INODE, or after the
+ * inode itself, is preferred, so that a file written sequentially
+ * lies in one run.
+ * Returns the sector, or 0 if the disk is full. */
+static disk_sector_t
+allocate_sector (struct inode *inode, bool zero) {
+	static const uint8_t zeros[DISK_SECTOR_SIZE];
+	disk_sector_t sector;
+	disk_sector_t hint = (inode->last_alloc != 0
+			? inode->last_alloc : inode->sector) + 1;
+
+	if (!free_map_allocate_near (1, hint, &sector))
+		return 0;
+	inode->last_alloc = sector;
+	if (zero)
+		buffer_cache_write (sector, zeros, 0, DISK_SECTOR_SIZE);
+	return sector;
+}
+
+/* Returns the sector number in *SLOT, a member of INODE's on-disk
+ * inode.  If the slot is empty and ALLOCATE is true, a sector is
+ * allocated into it first, zeroed if ZERO is true. */
+static disk_sector_t
+inode_slot (struct inode *inode, disk_sector_t *slot, bool allocate,
+		bool zero) {
+	if (*slot == 0 && allocate) {
+		*slot = allocate_sector (inode, zero);
+		if (*slot != 0)
+			buffer_cache_write (inode->sector, &inode->data, 0,
+					DISK_SECTOR_SIZE);
+	}
+	return *slot;
+}
+
+/* Like inode_slot(), for entry IDX of index sector BLOCK. */
+static disk_sector_t
+index_slot (struct inode *inode, disk_sector_t block, size_t idx,
+		bool allocate, bool zero) {
+	disk_sector_t sector;
+	enum disk_origin origin = disk_set_origin (DISK_IO_META);
+
+	buffer_cache_read (block, &sector, idx * sizeof sector, sizeof sector);
+	disk_set_origin (origin);
+	if (sector == 0 && allocate) {
+		sector = allocate_sector (inode, zero);
+		if (sector != 0)
+			buffer_cache_write (block, &sector, idx * sizeof sector,
+					sizeof sector);
+	}
+	return sector;
+}
+
+/* Does the work of byte_to_sector(). */
+static disk_sector_t
+find_sector (struct inode *inode, off_t pos, bool allocate) {
+	struct inode_disk *d = &inode->data;
+	size_t idx = pos / DISK_SECTOR_SIZE;
+	disk_sector_t block;
+
+	ASSERT (inode != NULL);
+	ASSERT (pos >= 0);
+
+	if (idx < DIRECT_CNT)
+		return inode_slot (inode, &d->direct[idx], allocate, false);
+	idx -= DIRECT_CNT;
+
+	if (idx < PTRS_PER_SECTOR) {
+		block = inode_slot (inode, &d->indirect, allocate, true);
+		return block != 0 ? index_slot (inode, block, idx, allocate, false) : 0;
+	}
+	idx -= PTRS_PER_SECTOR;
+
+	if (idx < PTRS_PER_SECTOR * PTRS_PER_SECTOR) {
+		block = inode_slot (inode, &d->doubly_indirect, allocate, true);
+		if (block != 0)
+			block = index_slot (inode, block, idx / PTRS_PER_SECTOR, allocate,
+					true);
+		return block != 0
+			? index_slot (inode, block, idx % PTRS_PER_SECTOR, allocate, false)
+			: 0;
+	}
+	return 0;
+}
+
+/* Returns the disk sector that contains byte offset POS within
+ * INODE, or 0 if that part of INODE was never written.
+ * If ALLOCATE is true, a missing sector is allocated, along with any
+ * index sector needed to reach it, in one journal operation; its
+ * contents are undefined and the caller must write all of it.
+ * Returns 0 if POS is beyond the largest possible file or the disk
+ * is full. */
+static disk_sector_t
+byte_to_sector (struct inode *inode, off_t pos, bool allocate) {
+	disk_sector_t sector;
+
+	if (!allocate)
+		return find_sector (inode, pos, false);
+	journal_begin ();
+	sector = find_sector (inode, pos, true);
+	journal_end ();
+	return sector;
+}
+
+/* Calls FUNC on every sector listed in index sector BLOCK, descending
+ * LEVEL more levels of index sectors, then on BLOCK itself. */
+static void
+walk_index (disk_sector_t block, int level, void (*func) (disk_sector_t)) {
+	disk_sector_t *ptrs = malloc (DISK_SECTOR_SIZE);
+	enum disk_origin origin;
+	size_t i;
+
+	if (ptrs == NULL)
+		PANIC ("inode: out of memory");
+	origin = disk_set_origin (DISK_IO_META);
+	buffer_cache_read (block, ptrs, 0, DISK_SECTOR_SIZE);
+	disk_set_origin (origin);
+	for (i = 0; i < PTRS_PER_SECTOR; i++)
+		if (ptrs[i] != 0) {
+			if (level > 0)
+				walk_index (ptrs[i], level - 1, func);
+			else
+				func (ptrs[i]);
+		}
+	free (ptrs);
+	func (block);
+}
+
+/* Calls FUNC on every data and index sector of INODE. */
+static void
+walk_sectors (struct inode *inode, void (*func) (disk_sector_t)) {
+	struct inode_disk *d = &inode->data;
+	size_t i;
+
+	for (i = 0; i < DIRECT_CNT; i++)
+		if (d->direct[i] != 0)
+			func (d->direct[i]);
+	if (d->indirect != 0)
+		walk_index (d->indirect, 0, func);
+	if (d->doubly_indirect != 0)
+		walk_index (d->doubly_indirect, 1, func);
+}
+
+/* Returns SECTOR to the free map, in a journal operation of its
+ * own: the sectors of a large file are spread over more free map
+ * sectors than one operation may change. */
+static void
+release_sector (disk_sector_t sector) {
+	journal_begin ();
+	free_map_release (sector, 1);
+	journal_end ();
 }
 
-/* List of open inodes, so that opening a single inode twice
- * returns the same `struct inode'. */
-static struct list open_inodes;
+/* Frees the data, index and inode sectors of INODE.  A crash in
+ * between leaves the rest of them to an inode that no directory
+ * refers to. */
+static void
+release_inode (struct inode *inode) {
+	walk_sectors (inode, release_sector);
+	release_sector (inode->sector);
+}
+#endif /* EFILESYS */
+
+/* Open inodes, keyed by sector, so that opening a single inode
+ * twice returns the same `struct inode'.  OPEN_INODES_LOCK protects
+ * the table and makes an inode's open count dropping to zero atomic
+ * with its removal from it, so a concurrent inode_open() either
+ * finds the inode still open or does not find it at all. */
+static struct hash open_inodes;
+static struct lock open_inodes_lock;
+
+/* Returns a hash value for open inode E. */
+static uint64_t
+inode_hash (const struct hash_elem *e, void *aux UNUSED) {
+	return hash_int (hash_entry (e, struct inode, elem)->sector);
+}
+
+/* Returns true if open inode A precedes open inode B. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct inode, elem)->sector
+		< hash_entry (b, struct inode, elem)->sector;
+}
 
 /* Initializes the inode module. */
 void
 inode_init (void) {
-	list_init (&open_inodes);
+	hash_init (&open_inodes, inode_hash, inode_less, NULL);
+	lock_init (&open_inodes_lock);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
  * writes the new inode to sector SECTOR on the file system
- * disk.
+ * disk.  No data sector is allocated: the file reads as zeros
+ * until written.
  * Returns true if successful.
- * Returns false if memory or disk allocation fails. */
+ * Returns false if memory allocation fails or LENGTH is too
+ * large. */
 bool
 inode_create (disk_sector_t sector, off_t length) {
 	struct inode_disk *disk_inode = NULL;
@@ -75,22 +463,15 @@ inode_create (disk_sector_t sector, off_t length) {
 	 * one sector in size, and you should fix that. */
 	ASSERT (sizeof *disk_inode == DISK_SECTOR_SIZE);
 
+	if (length > MAX_FILE_SIZE)
+		return false;
+
 	disk_inode = calloc (1, sizeof *disk_inode);
 	if (disk_inode != NULL) {
-		size_t sectors = bytes_to_sectors (length);
 		disk_inode->length = length;
 		disk_inode->magic = INODE_MAGIC;
-		if (free_map_allocate (sectors, &disk_inode->start)) {
-			disk_write (filesys_disk, sector, disk_inode);
-			if (sectors > 0) {
-				static char zeros[DISK_SECTOR_SIZE];
-				size_t i;
-
-				for (i = 0; i < sectors; i++) 
-					disk_write (filesys_disk, disk_inode->start + i, zeros); 
-			}
-			success = true; 
-		} 
+		buffer_cache_write (sector, disk_inode, 0, DISK_SECTOR_SIZE);
+		success = true; 
 		free (disk_inode);
 	}
 	return success;
@@ -101,39 +482,78 @@ inode_create (disk_sector_t sector, off_t length) {
  * Returns a null pointer if memory allocation fails. */
 struct inode *
 inode_open (disk_sector_t sector) {
-	struct list_elem *e;
+	struct inode key;
+	struct hash_elem *e;
 	struct inode *inode;
-
-	/* Check whether this inode is already open. */
-	for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-			e = list_next (e)) {
-		inode = list_entry (e, struct inode, elem);
-		if (inode->sector == sector) {
-			inode_reopen (inode);
-			return inode; 
-		}
+	enum disk_origin origin;
+
+	/* Check whether this inode is already open.  If its opener is
+	 * still reading it, wait for that. */
+	key.sector = sector;
+	lock_acquire (&open_inodes_lock);
+	e = hash_find (&open_inodes, &key.elem);
+	if (e != NULL) {
+		inode = hash_entry (e, struct inode, elem);
+		lock_acquire (&inode->lock);
+		inode->open_cnt++;
+		lock_release (&open_inodes_lock);
+		while (inode->loading)
+			cond_wait (&inode->loaded, &inode->lock);
+		lock_release (&inode->lock);
+		return inode;
 	}
 
 	/* Allocate memory. */
 	inode = malloc (sizeof *inode);
-	if (inode == NULL)
+	if (inode == NULL) {
+		lock_release (&open_inodes_lock);
 		return NULL;
+	}
 
-	/* Initialize. */
-	list_push_front (&open_inodes, &inode->elem);
+	/* Initialize.  The inode is published marked as loading, so that
+	 * the disk read below does not hold up opens of other inodes, and
+	 * openers of this one wait for it instead of reading it again. */
 	inode->sector = sector;
+	rwlock_init (&inode->data_lock, true);
+	rwlock_init (&inode->dir_lock, true);
+	lock_init (&inode->lock);
+	inode->loading = true;
+	cond_init (&inode->loaded);
 	inode->open_cnt = 1;
 	inode->deny_write_cnt = 0;
 	inode->removed = false;
-	disk_read (filesys_disk, inode->sector, &inode->data);
+	inode->written_cnt = 0;
+#ifdef EFILESYS
+	lock_init (&inode->chain_lock);
+	inode->skip = NULL;
+	inode->skip_cnt = 0;
+	inode->last_idx = 0;
+	inode->last_clst = 0;
+#else
+	inode->last_alloc = 0;
+#endif
+	hash_insert (&open_inodes, &inode->elem);
+	lock_release (&open_inodes_lock);
+
+	origin = disk_set_origin (DISK_IO_META);
+	buffer_cache_read (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
+	disk_set_origin (origin);
+
+	lock_acquire (&inode->lock);
+	inode->loading = false;
+	cond_broadcast (&inode->loaded, &inode->lock);
+	lock_release (&inode->lock);
 	return inode;
 }
 
 /* Reopens and returns INODE. */
 struct inode *
 inode_reopen (struct inode *inode) {
-	if (inode != NULL)
+	if (inode != NULL) {
+		lock_acquire (&inode->lock);
 		inode->open_cnt++;
+		lock_release (&inode->lock);
+	}
 	return inode;
 }
 
@@ -143,27 +563,73 @@ inode_get_inumber (const struct inode *inode) {
 	return inode->sector;
 }
 
+/* Records that INODE wrote data SECTOR.  The data lock must be held
+ * for writing. */
+static void
+note_written (struct inode *inode, disk_sector_t sector) {
+	size_t i;
+
+	if (inode->written_cnt > WRITTEN_MAX)
+		return;
+	for (i = inode->written_cnt; i-- > 0; )
+		if (inode->written[i] == sector)
+			return;
+	if (inode->written_cnt < WRITTEN_MAX)
+		inode->written[inode->written_cnt] = sector;
+	inode->written_cnt++;
+}
+
+/* Writes the data sectors INODE wrote while open, and its inode
+ * sector, back to disk.  Index sectors are metadata and reach the
+ * disk through the journal.  An inode that was only read costs
+ * nothing, so closing a directory after a lookup does not depend on
+ * its size. */
+static void
+flush_inode (struct inode *inode) {
+	size_t i;
+
+	if (inode->written_cnt == 0)
+		return;
+	if (inode->written_cnt > WRITTEN_MAX) {
+		buffer_cache_flush ();
+		return;
+	}
+	for (i = 0; i < inode->written_cnt; i++)
+		buffer_cache_flush_sector (inode->written[i]);
+	buffer_cache_flush_sector (inode->sector);
+}
+
 /* Closes INODE and writes it to disk.
  * If this was the last reference to INODE, frees its memory.
  * If INODE was also a removed inode, frees its blocks. */
 void
 inode_close (struct inode *inode) {
+	bool last;
+
 	/* Ignore null pointer. */
 	if (inode == NULL)
 		return;
 
 	/* Release resources if this was the last opener. */
-	if (--inode->open_cnt == 0) {
-		/* Remove from inode list and release lock. */
-		list_remove (&inode->elem);
-
-		/* Deallocate blocks if removed. */
-		if (inode->removed) {
-			free_map_release (inode->sector, 1);
-			free_map_release (inode->data.start,
-					bytes_to_sectors (inode->data.length)); 
-		}
-
+	lock_acquire (&open_inodes_lock);
+	lock_acquire (&inode->lock);
+	last = --inode->open_cnt == 0;
+	if (last)
+		hash_delete (&open_inodes, &inode->elem);
+	lock_release (&inode->lock);
+	lock_release (&open_inodes_lock);
+
+	if (last) {
+		/* Deallocate blocks if removed, otherwise push the data
+		 * written through the cache out to disk. */
+		if (inode->removed)
+			release_inode (inode);
+		else
+			flush_inode (inode);
+
+#ifdef EFILESYS
+		free (inode->skip);
+#endif
 		free (inode); 
 	}
 }
@@ -173,7 +639,16 @@ inode_close (struct inode *inode) {
 void
 inode_remove (struct inode *inode) {
 	ASSERT (inode != NULL);
+	lock_acquire (&inode->lock);
 	inode->removed = true;
+	lock_release (&inode->lock);
+}
+
+/* Returns the origin charged for disk I/O on the contents of
+ * INODE.  Index sectors are charged to DISK_IO_META instead. */
+static enum disk_origin
+data_origin (const struct inode *inode) {
+	return inode->sector == FREE_MAP_SECTOR ? DISK_IO_FREE_MAP : DISK_IO_DATA;
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -183,13 +658,21 @@ off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
 	uint8_t *buffer = buffer_;
 	off_t bytes_read = 0;
-	uint8_t *bounce = NULL;
+	enum disk_origin origin = disk_set_origin (data_origin (inode));
 
 	while (size > 0) {
-		/* Disk sector to read, starting byte offset within sector. */
-		disk_sector_t sector_idx = byte_to_sector (inode, offset);
+		/* Disk sector to read, starting byte offset within sector.
+		 * Only the lookup is done under the data lock, shared with
+		 * other readers: a sector shows up in the index once its
+		 * writer has filled it, so the read itself may wait on the
+		 * disk while writers use the inode. */
+		disk_sector_t sector_idx;
 		int sector_ofs = offset % DISK_SECTOR_SIZE;
 
+		rwlock_acquire_read (&inode->data_lock);
+		sector_idx = byte_to_sector (inode, offset, false);
+		rwlock_release_read (&inode->data_lock);
+
 		/* Bytes left in inode, bytes left in sector, lesser of the two. */
 		off_t inode_left = inode_length (inode) - offset;
 		int sector_left = DISK_SECTOR_SIZE - sector_ofs;
@@ -200,82 +683,106 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
 		if (chunk_size <= 0)
 			break;
 
-		if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) {
-			/* Read full sector directly into caller's buffer. */
-			disk_read (filesys_disk, sector_idx, buffer + bytes_read); 
-		} else {
-			/* Read sector into bounce buffer, then partially copy
-			 * into caller's buffer. */
-			if (bounce == NULL) {
-				bounce = malloc (DISK_SECTOR_SIZE);
-				if (bounce == NULL)
-					break;
-			}
-			disk_read (filesys_disk, sector_idx, bounce);
-			memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-		}
+		if (sector_idx == 0)
+			memset (buffer + bytes_read, 0, chunk_size);
+		else
+			buffer_cache_read (sector_idx, buffer + bytes_read, sector_ofs,
+					chunk_size);
 
 		/* Advance. */
 		size -= chunk_size;
 		offset += chunk_size;
 		bytes_read += chunk_size;
 	}
-	free (bounce);
+	disk_set_origin (origin);
 
 	return bytes_read;
 }
 
+/* Asks for the sectors holding the SIZE bytes of INODE starting at
+ * OFFSET to be read into the buffer cache in the background.  Bytes
+ * past the end of INODE and holes are ignored. */
+void
+inode_read_ahead (struct inode *inode, off_t offset, off_t size) {
+	off_t end = offset + size;
+	disk_sector_t run_start = 0;
+	size_t run_cnt = 0;
+
+	if (end > inode_length (inode))
+		end = inode_length (inode);
+
+	/* Consecutive sectors are queued as a single run. */
+	rwlock_acquire_read (&inode->data_lock);
+	for (offset = ROUND_DOWN (offset, DISK_SECTOR_SIZE); offset < end;
+			offset += DISK_SECTOR_SIZE) {
+		disk_sector_t sector = byte_to_sector (inode, offset, false);
+
+		if (run_cnt > 0 && sector == run_start + run_cnt)
+			run_cnt++;
+		else {
+			if (run_cnt > 0)
+				buffer_cache_read_ahead (run_start, run_cnt);
+			run_start = sector;
+			run_cnt = sector != 0;
+		}
+	}
+	rwlock_release_read (&inode->data_lock);
+	if (run_cnt > 0)
+		buffer_cache_read_ahead (run_start, run_cnt);
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
  * Returns the number of bytes actually written, which may be
- * less than SIZE if end of file is reached or an error occurs.
- * (Normally a write at end of file would extend the inode, but
- * growth is not yet implemented.) */
+ * less than SIZE if the disk is full or an error occurs.
+ * Writing past the end of INODE extends it; blocks skipped over
+ * stay holes. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 		off_t offset) {
 	const uint8_t *buffer = buffer_;
 	off_t bytes_written = 0;
 	uint8_t *bounce = NULL;
+	enum disk_origin origin;
 
 	if (inode->deny_write_cnt)
 		return 0;
-
-	while (size > 0) {
+	origin = disk_set_origin (data_origin (inode));
+
+	/* A write holds the data lock exclusively throughout, which keeps
+	 * writes to one inode atomic with respect to each other and a
+	 * freshly allocated sector out of readers' sight until it is
+	 * written. */
+	rwlock_acquire_write (&inode->data_lock);
+	while (size > 0 && offset < MAX_FILE_SIZE) {
 		/* Sector to write, starting byte offset within sector. */
-		disk_sector_t sector_idx = byte_to_sector (inode, offset);
+		disk_sector_t sector_idx = byte_to_sector (inode, offset, false);
 		int sector_ofs = offset % DISK_SECTOR_SIZE;
 
-		/* Bytes left in inode, bytes left in sector, lesser of the two. */
-		off_t inode_left = inode_length (inode) - offset;
+		/* Number of bytes to actually write into this sector. */
 		int sector_left = DISK_SECTOR_SIZE - sector_ofs;
-		int min_left = inode_left < sector_left ? inode_left : sector_left;
+		int chunk_size = size < sector_left ? size : sector_left;
 
-		/* Number of bytes to actually write into this sector. */
-		int chunk_size = size < min_left ? size : min_left;
-		if (chunk_size <= 0)
-			break;
+		if (sector_idx == 0) {
+			/* A hole: allocate a sector and write all of it, zeros
+			 * around the data, instead of making the cache read
+			 * garbage from disk first. */
+			const uint8_t *data = buffer + bytes_written;
 
-		if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) {
-			/* Write full sector directly to disk. */
-			disk_write (filesys_disk, sector_idx, buffer + bytes_written); 
-		} else {
-			/* We need a bounce buffer. */
-			if (bounce == NULL) {
-				bounce = malloc (DISK_SECTOR_SIZE);
-				if (bounce == NULL)
+			if (chunk_size < DISK_SECTOR_SIZE) {
+				if (bounce == NULL && (bounce = malloc (DISK_SECTOR_SIZE)) == NULL)
 					break;
-			}
-
-			/* If the sector contains data before or after the chunk
-			   we're writing, then we need to read in the sector
-			   first.  Otherwise we start with a sector of all zeros. */
-			if (sector_ofs > 0 || chunk_size < sector_left) 
-				disk_read (filesys_disk, sector_idx, bounce);
-			else
 				memset (bounce, 0, DISK_SECTOR_SIZE);
-			memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-			disk_write (filesys_disk, sector_idx, bounce); 
-		}
+				memcpy (bounce + sector_ofs, data, chunk_size);
+				data = bounce;
+			}
+			sector_idx = byte_to_sector (inode, offset, true);
+			if (sector_idx == 0)
+				break;
+			buffer_cache_write (sector_idx, data, 0, DISK_SECTOR_SIZE);
+		} else
+			buffer_cache_write (sector_idx, buffer + bytes_written, sector_ofs,
+					chunk_size);
+		note_written (inode, sector_idx);
 
 		/* Advance. */
 		size -= chunk_size;
@@ -284,6 +791,19 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 	}
 	free (bounce);
 
+	if (bytes_written > 0) {
+		journal_begin ();
+		lock_acquire (&inode->lock);
+		if (offset > inode->data.length) {
+			inode->data.length = offset;
+			buffer_cache_write (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
+		}
+		lock_release (&inode->lock);
+		journal_end ();
+	}
+	rwlock_release_write (&inode->data_lock);
+	disk_set_origin (origin);
+
 	return bytes_written;
 }
 
@@ -292,8 +812,10 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 	void
 inode_deny_write (struct inode *inode) 
 {
+	lock_acquire (&inode->lock);
 	inode->deny_write_cnt++;
 	ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+	lock_release (&inode->lock);
 }
 
 /* Re-enables writes to INODE.
@@ -301,9 +823,11 @@ inode_deny_write (struct inode *inode)
  * inode_deny_write() on the inode, before closing the inode. */
 void
 inode_allow_write (struct inode *inode) {
+	lock_acquire (&inode->lock);
 	ASSERT (inode->deny_write_cnt > 0);
 	ASSERT (inode->deny_write_cnt <= inode->open_cnt);
 	inode->deny_write_cnt--;
+	lock_release (&inode->lock);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -311,3 +835,26 @@ off_t
 inode_length (const struct inode *inode) {
 	return inode->data.length;
 }
+
+/* Locks INODE, a directory, for a directory operation: shared with
+ * other lookups, or exclusively if WRITE is true.  Lookups and
+ * updates of a directory read and write its inode several times, so
+ * they hold this lock throughout to see and leave the directory
+ * consistent.  It is distinct from the data lock, which those reads
+ * and writes take themselves. */
+void
+inode_lock_dir (struct inode *inode, bool write) {
+	if (write)
+		rwlock_acquire_write (&inode->dir_lock);
+	else
+		rwlock_acquire_read (&inode->dir_lock);
+}
+
+/* Unlocks INODE, locked by inode_lock_dir(). */
+void
+inode_unlock_dir (struct inode *inode) {
+	if (rwlock_held_for_write (&inode->dir_lock))
+		rwlock_release_write (&inode->dir_lock);
+	else
+		rwlock_release_read (&inode->dir_lock);
+}
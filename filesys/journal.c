@@ -0,0 +1,647 @@
+/* journal.c: Write-ahead journal of file system metadata.
+ *
+ * An operation that updates several metadata sectors, such as
+ * creating or removing a file or allocating sectors to one, runs
+ * between journal_begin() and journal_end().  Every sector written
+ * through the buffer cache in between joins the running transaction
+ * and is pinned: the cache keeps it in memory until the transaction
+ * is committed.  With EFILESYS, the FAT sectors modified since the
+ * last commit join it as well.
+ *
+ * A commit writes every sector of the transaction into the journal in
+ * one sequential run: a descriptor listing the sectors' home
+ * locations, their contents, and a commit block carrying a checksum.
+ * A transaction too large for one such record takes several, all but
+ * the last marked as continued.  Only then are the sectors unpinned,
+ * and the cache writes them home whenever it would have anyway.  Once
+ * the journal is half full, the whole cache is flushed (a checkpoint)
+ * and the journal starts over.
+ *
+ * At startup, journal_recover() copies the sectors of every complete
+ * transaction in the journal home, so that after a crash each
+ * transaction is either fully applied or not at all.  Data written to
+ * regular files is not journaled. */
+
+#include "filesys/journal.h"
+#include <debug.h>
+#include <hash.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/buffer_cache.h"
+#include "filesys/filesys.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#ifdef EFILESYS
+#include "filesys/fat.h"
+#endif
+
+/* Maximum number of sectors in one record.  After a checkpoint, two
+ * records of this size fit into the journal. */
+#define RECORD_MAX ((JOURNAL_SECTORS - 1) / 2 - 2)
+
+/* Journal sectors taken by a transaction of CNT sectors. */
+#define TXN_SPACE(CNT) ((CNT) + 2 * DIV_ROUND_UP (CNT, RECORD_MAX))
+
+/* Maximum number of sectors journaled by one commit: the records of
+ * a larger transaction do not fit into an empty journal. */
+#define TXN_MAX (JOURNAL_SECTORS - 1 \
+		- 2 * DIV_ROUND_UP (JOURNAL_SECTORS - 1, RECORD_MAX))
+
+/* Most sectors one operation adds to the running transaction,
+ * counting sectors written through the cache and FAT sectors alike.
+ * An operation that may change more, such as freeing the sectors of
+ * a large file, is broken into several. */
+#define OP_CREDITS 10
+
+/* Most sectors of a transaction that journal_begin() admits.  It
+ * should fit into one record, and its pinned sectors should take at
+ * most half of the buffer cache, so that the cache always has entries
+ * to replace. */
+#define TXN_LIMIT (RECORD_MAX < BUFFER_CACHE_SIZE / 2 \
+		? RECORD_MAX : BUFFER_CACHE_SIZE / 2)
+
+/* Ticks between two commits by the journal thread. */
+#define COMMIT_INTERVAL (TIMER_FREQ * 5)
+
+/* A sector of the running transaction. */
+struct pin {
+	disk_sector_t sector;               /* Sector number. */
+	uint8_t *data;                      /* Contents dropped by the cache. */
+	struct hash_elem elem;              /* Element in PINS. */
+};
+
+static disk_sector_t super_sector;      /* Where the journal starts. */
+static bool enabled;                    /* Are transactions recorded? */
+
+/* Used by the committing thread only. */
+static uint32_t next_seq;               /* Sequence number of next record. */
+static size_t head;                     /* Offset of next record. */
+static struct descriptor *desc;         /* Descriptor buffer. */
+static struct commit_block *commit;     /* Commit block buffer. */
+static disk_sector_t *txn_sectors;      /* Home sectors, TXN_MAX. */
+static uint8_t *txn_data;               /* Sector contents, TXN_MAX. */
+
+/* Operations in progress and commits. */
+static struct lock journal_lock;        /* Protects the members below. */
+static int handle_cnt;                  /* Operations in progress. */
+static bool committing;                 /* Is a commit in progress? */
+static struct condition handles_done;   /* HANDLE_CNT dropped to 0. */
+static struct condition commit_done;    /* COMMITTING became false. */
+
+/* Sectors of the running transaction.  PIN_LOCK is acquired by the
+ * buffer cache with its own locks held, so no other lock is acquired
+ * while holding it. */
+static struct hash pins;
+static struct lock pin_lock;
+
+static void journal_daemon (void *aux);
+
+static uint64_t
+pin_hash (const struct hash_elem *e, void *aux UNUSED) {
+	return hash_int (hash_entry (e, struct pin, elem)->sector);
+}
+
+static bool
+pin_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct pin, elem)->sector
+		< hash_entry (b, struct pin, elem)->sector;
+}
+
+static void
+pin_destroy (struct hash_elem *e, void *aux UNUSED) {
+	struct pin *pin = hash_entry (e, struct pin, elem);
+
+	free (pin->data);
+	free (pin);
+}
+
+/* Returns the first sector of the journal: it takes up the last
+ * JOURNAL_SECTORS sectors of the file system disk. */
+disk_sector_t
+journal_start (void) {
+	return disk_size (filesys_disk) - JOURNAL_SECTORS;
+}
+
+/* Initializes the journal module. */
+void
+journal_init (void) {
+	ASSERT (sizeof (struct super_block) == DISK_SECTOR_SIZE);
+	ASSERT (sizeof (struct descriptor) == DISK_SECTOR_SIZE);
+	ASSERT (sizeof (struct commit_block) == DISK_SECTOR_SIZE);
+	ASSERT (RECORD_MAX <= sizeof desc->sectors / sizeof *desc->sectors);
+	ASSERT (TXN_SPACE (TXN_MAX) <= JOURNAL_SECTORS - 1);
+	ASSERT (OP_CREDITS <= TXN_LIMIT);
+
+	super_sector = journal_start ();
+	desc = malloc (DISK_SECTOR_SIZE);
+	commit = malloc (DISK_SECTOR_SIZE);
+	txn_sectors = malloc (TXN_MAX * sizeof *txn_sectors);
+	txn_data = malloc (TXN_MAX * DISK_SECTOR_SIZE);
+	if (desc == NULL || commit == NULL || txn_sectors == NULL
+			|| txn_data == NULL)
+		PANIC ("journal: out of memory");
+
+	lock_init (&journal_lock);
+	cond_init (&handles_done);
+	cond_init (&commit_done);
+	hash_init (&pins, pin_hash, pin_less, NULL);
+	lock_init (&pin_lock);
+}
+
+/* Writes the super block, marking the journal empty, and starts
+ * recording at its beginning. */
+static void
+write_super (void) {
+	struct super_block *sb = calloc (1, sizeof *sb);
+
+	if (sb == NULL)
+		PANIC ("journal: out of memory");
+	sb->magic = SUPER_MAGIC;
+	sb->seq = next_seq;
+	sb->start = 1;
+	disk_write (filesys_disk, super_sector, sb);
+	free (sb);
+	head = 1;
+}
+
+/* Creates an empty journal. */
+void
+journal_format (void) {
+	struct super_block *sb = malloc (sizeof *sb);
+	enum disk_origin origin;
+
+	if (sb == NULL)
+		PANIC ("journal: out of memory");
+
+	/* Records left over on the disk must not match the new sequence
+	 * numbers: those written since the last checkpoint have numbers
+	 * below the old one plus JOURNAL_SECTORS. */
+	origin = disk_set_origin (DISK_IO_JOURNAL);
+	disk_read (filesys_disk, super_sector, sb);
+	next_seq = sb->magic == SUPER_MAGIC ? sb->seq + JOURNAL_SECTORS : 0;
+	free (sb);
+	write_super ();
+	disk_set_origin (origin);
+}
+
+/* Folds DESC and the CNT sectors in DATA into a checksum. */
+static uint64_t
+checksum (const struct descriptor *d, const uint8_t *data, size_t cnt) {
+	uint64_t sum = hash_bytes (d, DISK_SECTOR_SIZE);
+	size_t i;
+
+	for (i = 0; i < cnt; i++)
+		sum = sum * 31 + hash_bytes (data + i * DISK_SECTOR_SIZE,
+				DISK_SECTOR_SIZE);
+	return sum;
+}
+
+/* Reads the record at offset POS of the journal into DESC, COMMIT
+ * and TXN_DATA.  Returns true if it is a complete record with
+ * sequence number SEQ, false otherwise. */
+static bool
+read_record (size_t pos, uint32_t seq) {
+	size_t i;
+
+	disk_read (filesys_disk, super_sector + pos, desc);
+	if (desc->magic != DESC_MAGIC || desc->seq != seq
+			|| desc->cnt == 0 || desc->cnt > RECORD_MAX
+			|| pos + desc->cnt + 2 > JOURNAL_SECTORS)
+		return false;
+	for (i = 0; i < desc->cnt; i++)
+		if (desc->sectors[i] >= super_sector)
+			return false;
+
+	disk_read (filesys_disk, super_sector + pos + desc->cnt + 1, commit);
+	if (commit->magic != COMMIT_MAGIC || commit->seq != seq
+			|| commit->cnt != desc->cnt)
+		return false;
+	disk_read_multi (filesys_disk, super_sector + pos + 1, txn_data,
+			desc->cnt);
+	return commit->checksum == checksum (desc, txn_data, desc->cnt);
+}
+
+/* Writes the CNT sectors in DATA to their home locations SECTORS,
+ * each run of consecutive sectors with one disk command. */
+static void
+write_home (const disk_sector_t *sectors, const uint8_t *data, size_t cnt) {
+	size_t i, run;
+
+	for (i = 0; i < cnt; i += run) {
+		for (run = 1; i + run < cnt && run < DISK_MULTI_MAX
+				&& sectors[i + run] == sectors[i] + run; run++)
+			continue;
+		disk_write_multi (filesys_disk, sectors[i],
+				data + i * DISK_SECTOR_SIZE, run);
+	}
+}
+
+/* Copies the sectors of every complete transaction in the journal to
+ * their home locations, then empties the journal.  Must be called
+ * before anything is read from the file system disk, which must have
+ * been formatted with a journal. */
+void
+journal_recover (void) {
+	struct super_block *sb = malloc (sizeof *sb);
+	size_t start, pos, end, replayed = 0;
+	uint32_t first_seq, seq, end_seq;
+	enum disk_origin origin;
+
+	if (sb == NULL)
+		PANIC ("journal: out of memory");
+	origin = disk_set_origin (DISK_IO_JOURNAL);
+	disk_read (filesys_disk, super_sector, sb);
+	/* Formatting here would overwrite whatever the last sectors of the
+	 * disk hold, so a disk without a journal is refused instead. */
+	if (sb->magic != SUPER_MAGIC)
+		PANIC ("journal: no journal at sector %"PRDSNu"; "
+				"format the file system with -f", super_sector);
+	first_seq = seq = sb->seq;
+	start = sb->start;
+	free (sb);
+
+	/* A transaction counts only if its last record is complete, so
+	 * first find the end of the last complete one. */
+	end = start;
+	end_seq = seq;
+	for (pos = start; read_record (pos, seq); pos += desc->cnt + 2) {
+		seq++;
+		if (!commit->more) {
+			end = pos + desc->cnt + 2;
+			end_seq = seq;
+		}
+	}
+
+	seq = first_seq;
+	for (pos = start; pos < end; pos += desc->cnt + 2) {
+		if (!read_record (pos, seq++))
+			PANIC ("journal: record at %zu changed during recovery", pos);
+		write_home (desc->sectors, txn_data, desc->cnt);
+		if (!commit->more)
+			replayed++;
+	}
+	if (replayed > 0)
+		printf ("journal: replayed %zu transactions.\n", replayed);
+
+	/* Records past END, such as the rest of a torn transaction, must
+	 * not match the sequence numbers used from now on. */
+	next_seq = end_seq + JOURNAL_SECTORS;
+	write_super ();
+	disk_set_origin (origin);
+}
+
+/* Starts recording transactions. */
+void
+journal_open (void) {
+	enabled = true;
+	thread_create ("journald", PRI_DEFAULT, journal_daemon, NULL);
+}
+
+/* Commits the running transaction and empties the journal.  Called
+ * at shutdown. */
+void
+journal_done (void) {
+	journal_commit ();
+	enabled = false;
+	buffer_cache_flush ();
+	write_super ();
+}
+
+/* Returns the number of sectors in the running transaction. */
+static size_t
+txn_size (void) {
+	size_t cnt;
+
+	lock_acquire (&pin_lock);
+	cnt = hash_size (&pins);
+	lock_release (&pin_lock);
+#ifdef EFILESYS
+	cnt += fat_dirty_cnt ();
+#endif
+	return cnt;
+}
+
+/* Starts an operation whose metadata updates must reach the disk
+ * together.  Calls nest; only the outermost pair counts.
+ *
+ * Each operation in progress is assumed to add OP_CREDITS sectors to
+ * the running transaction.  If that could take the transaction past
+ * TXN_LIMIT, it is committed first, so that a transaction is never
+ * split across records and never pins a sector the cache has to
+ * evict. */
+void
+journal_begin (void) {
+	struct thread *t = thread_current ();
+
+	if (t->journal_depth > 0 || !enabled) {
+		t->journal_depth++;
+		return;
+	}
+
+	lock_acquire (&journal_lock);
+	for (;;) {
+		while (committing)
+			cond_wait (&commit_done, &journal_lock);
+		if (txn_size () + (handle_cnt + 1) * OP_CREDITS <= TXN_LIMIT)
+			break;
+		lock_release (&journal_lock);
+		journal_commit ();
+		lock_acquire (&journal_lock);
+	}
+	handle_cnt++;
+	lock_release (&journal_lock);
+	t->journal_depth = 1;
+}
+
+/* Ends an operation started by journal_begin(). */
+void
+journal_end (void) {
+	struct thread *t = thread_current ();
+
+	ASSERT (t->journal_depth > 0);
+	if (--t->journal_depth > 0 || !enabled)
+		return;
+
+	lock_acquire (&journal_lock);
+	if (--handle_cnt == 0)
+		cond_broadcast (&handles_done, &journal_lock);
+	lock_release (&journal_lock);
+}
+
+/* Adds SECTOR, about to be written through the buffer cache, to the
+ * running transaction if the current thread is in an operation. */
+void
+journal_dirty (disk_sector_t sector) {
+	struct pin key;
+
+	if (!enabled || thread_current ()->journal_depth == 0)
+		return;
+
+	key.sector = sector;
+	lock_acquire (&pin_lock);
+	if (hash_find (&pins, &key.elem) == NULL) {
+		struct pin *pin = malloc (sizeof *pin);
+		if (pin == NULL)
+			PANIC ("journal: out of memory");
+		pin->sector = sector;
+		pin->data = NULL;
+		hash_insert (&pins, &pin->elem);
+	}
+	lock_release (&pin_lock);
+}
+
+/* Returns true if SECTOR belongs to a transaction that is not
+ * committed yet, in which case it must not be written home. */
+bool
+journal_pinned (disk_sector_t sector) {
+	struct pin key;
+	bool pinned;
+
+	key.sector = sector;
+	lock_acquire (&pin_lock);
+	pinned = hash_find (&pins, &key.elem) != NULL;
+	lock_release (&pin_lock);
+	return pinned;
+}
+
+/* Returns true if the current thread is inside an operation, where
+ * journal_commit() must not be called. */
+bool
+journal_in_operation (void) {
+	return thread_current ()->journal_depth > 0;
+}
+
+/* Keeps a copy of DATA, the contents of pinned SECTOR, for a buffer
+ * cache that has to drop the sector while the current thread cannot
+ * commit: it is inside an operation and every entry is pinned.  The
+ * commit journals the copy and writes it home; until then,
+ * journal_unstash() hands it back. */
+void
+journal_stash (disk_sector_t sector, const void *data) {
+	uint8_t *copy = malloc (DISK_SECTOR_SIZE);
+	struct pin key, *pin;
+	uint8_t *old;
+
+	if (copy == NULL)
+		PANIC ("journal: out of memory");
+	memcpy (copy, data, DISK_SECTOR_SIZE);
+
+	key.sector = sector;
+	lock_acquire (&pin_lock);
+	pin = hash_entry (hash_find (&pins, &key.elem), struct pin, elem);
+	old = pin->data;
+	pin->data = copy;
+	lock_release (&pin_lock);
+	free (old);
+}
+
+/* If a copy of SECTOR was stashed by journal_stash(), moves it into
+ * DATA and returns true: the caller caches it again, dirty.  Returns
+ * false otherwise. */
+bool
+journal_unstash (disk_sector_t sector, void *data) {
+	struct pin key;
+	struct hash_elem *e;
+	uint8_t *copy = NULL;
+
+	key.sector = sector;
+	lock_acquire (&pin_lock);
+	e = hash_find (&pins, &key.elem);
+	if (e != NULL) {
+		struct pin *pin = hash_entry (e, struct pin, elem);
+		copy = pin->data;
+		pin->data = NULL;
+	}
+	lock_release (&pin_lock);
+	if (copy == NULL)
+		return false;
+	memcpy (data, copy, DISK_SECTOR_SIZE);
+	free (copy);
+	return true;
+}
+
+/* Copies up to TXN_MAX pinned sector numbers into TXN_SECTORS.
+ * Returns the number of pinned sectors, which may be larger. */
+static size_t
+take_pins (void) {
+	struct hash_iterator i;
+	size_t cnt = 0;
+
+	lock_acquire (&pin_lock);
+	hash_first (&i, &pins);
+	while (cnt < TXN_MAX && hash_next (&i))
+		txn_sectors[cnt++] = hash_entry (hash_cur (&i), struct pin, elem)->sector;
+	cnt = hash_size (&pins);
+	lock_release (&pin_lock);
+	return cnt;
+}
+
+/* Reads the current contents of pinned SECTOR into DATA: the copy
+ * stashed by journal_stash(), if any, or else the cached one. */
+static void
+read_pinned (disk_sector_t sector, void *data) {
+	struct pin key, *pin;
+	bool stashed;
+
+	key.sector = sector;
+	lock_acquire (&pin_lock);
+	pin = hash_entry (hash_find (&pins, &key.elem), struct pin, elem);
+	stashed = pin->data != NULL;
+	if (stashed)
+		memcpy (data, pin->data, DISK_SECTOR_SIZE);
+	lock_release (&pin_lock);
+	if (!stashed)
+		buffer_cache_read (sector, data, 0, DISK_SECTOR_SIZE);
+}
+
+/* Writes the stashed sectors of the running transaction home: the
+ * cache does not hold them, so nothing else will.  PIN_LOCK stays
+ * held, so that journal_unstash() cannot hand out a stashed copy
+ * whose home is still stale. */
+static void
+write_stashed_home (void) {
+	struct hash_iterator i;
+
+	lock_acquire (&pin_lock);
+	hash_first (&i, &pins);
+	while (hash_next (&i)) {
+		struct pin *pin = hash_entry (hash_cur (&i), struct pin, elem);
+		if (pin->data != NULL)
+			disk_write (filesys_disk, pin->sector, pin->data);
+	}
+	lock_release (&pin_lock);
+}
+
+/* Writes the CNT sectors in SECTORS and DATA to the journal as one
+ * record, marked as continued in the next one if MORE is true. */
+static void
+write_record (const disk_sector_t *sectors, const uint8_t *data, size_t cnt,
+		bool more) {
+	ASSERT (cnt <= RECORD_MAX);
+
+	memset (desc, 0, sizeof *desc);
+	desc->magic = DESC_MAGIC;
+	desc->seq = next_seq;
+	desc->cnt = cnt;
+	memcpy (desc->sectors, sectors, cnt * sizeof *sectors);
+
+	memset (commit, 0, sizeof *commit);
+	commit->magic = COMMIT_MAGIC;
+	commit->seq = next_seq;
+	commit->cnt = cnt;
+	commit->more = more;
+	commit->checksum = checksum (desc, data, cnt);
+
+	/* The commit block is written last: until it is on disk, the
+	 * record does not count. */
+	disk_write (filesys_disk, super_sector + head, desc);
+	disk_write_multi (filesys_disk, super_sector + head + 1, data, cnt);
+	disk_write (filesys_disk, super_sector + head + 1 + cnt, commit);
+
+	head += cnt + 2;
+	next_seq++;
+}
+
+/* Writes the CNT sectors in TXN_SECTORS and TXN_DATA to the journal
+ * as one transaction, in as few records as possible. */
+static void
+write_txn (size_t cnt) {
+	size_t done, n;
+
+	ASSERT (head + TXN_SPACE (cnt) <= JOURNAL_SECTORS);
+
+	for (done = 0; done < cnt; done += n) {
+		n = cnt - done < RECORD_MAX ? cnt - done : RECORD_MAX;
+		write_record (txn_sectors + done, txn_data + done * DISK_SECTOR_SIZE,
+				n, done + n < cnt);
+	}
+}
+
+/* Writes every committed sector home and empties the journal.  The
+ * sectors of the running transaction stay where they are. */
+static void
+checkpoint (void) {
+	buffer_cache_flush ();
+#ifdef EFILESYS
+	fat_flush ();
+#endif
+	write_super ();
+}
+
+/* Commits the running transaction.  Waits for the operations in
+ * progress to end and holds off new ones meanwhile, so it must not
+ * be called from inside an operation. */
+void
+journal_commit (void) {
+	size_t pinned, cnt;
+	enum disk_origin origin;
+
+	ASSERT (!journal_in_operation ());
+
+	if (!enabled)
+		return;
+	origin = disk_set_origin (DISK_IO_JOURNAL);
+
+	lock_acquire (&journal_lock);
+	while (committing)
+		cond_wait (&commit_done, &journal_lock);
+	committing = true;
+	while (handle_cnt > 0)
+		cond_wait (&handles_done, &journal_lock);
+	lock_release (&journal_lock);
+
+	/* The transaction is journaled as a whole or not at all: its FAT
+	 * sectors count against TXN_MAX along with the pinned ones. */
+	pinned = take_pins ();
+	cnt = txn_size ();
+	if (cnt <= TXN_MAX) {
+		size_t i;
+
+		for (i = 0; i < pinned; i++)
+			read_pinned (txn_sectors[i], txn_data + i * DISK_SECTOR_SIZE);
+#ifdef EFILESYS
+		fat_take_dirty (txn_sectors + pinned,
+				txn_data + pinned * DISK_SECTOR_SIZE, cnt - pinned);
+#endif
+		if (head + TXN_SPACE (cnt) > JOURNAL_SECTORS)
+			checkpoint ();
+		if (cnt > 0)
+			write_txn (cnt);
+
+		/* The FAT is not kept in the buffer cache, so its sectors are
+		 * written home here. */
+		write_home (txn_sectors + pinned, txn_data + pinned * DISK_SECTOR_SIZE,
+				cnt - pinned);
+	} else
+		printf ("journal: %zu sectors exceed the journal; "
+				"writing them unprotected.\n", cnt);
+	write_stashed_home ();
+
+	lock_acquire (&pin_lock);
+	hash_clear (&pins, pin_destroy);
+	lock_release (&pin_lock);
+
+	/* A transaction larger than TXN_MAX, which no operation within its
+	 * credits comes near, is written in place by the checkpoint. */
+	if (cnt > TXN_MAX || head + TXN_SPACE (RECORD_MAX) > JOURNAL_SECTORS)
+		checkpoint ();
+
+	lock_acquire (&journal_lock);
+	committing = false;
+	cond_broadcast (&commit_done, &journal_lock);
+	lock_release (&journal_lock);
+	disk_set_origin (origin);
+}
+
+/* Commits periodically, bounding the work lost on a crash. */
+static void
+journal_daemon (void *aux UNUSED) {
+	for (;;) {
+		timer_sleep (COMMIT_INTERVAL);
+		journal_commit ();
+	}
+}
@@ -1,6 +1,23 @@
-/* page_cache.c: Implementation of Page Cache (Buffer Cache). */
+/* page_cache.c: Implementation of Page Cache (Buffer Cache).
+ *
+ * With VM enabled, the buffer cache keeps file system sectors in
+ * VM_PAGE_CACHE pages whose frames come from the same frame table as
+ * user memory.  The cache therefore grows while memory is free and
+ * shrinks when the eviction clock picks its frames: swap_out writes
+ * the dirty sectors back, and the next access swaps the page in
+ * again, reading all of its sectors at once. */
 
 #include "vm/vm.h"
+#include <debug.h>
+#include <stdlib.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/thread.h"
+
+#if defined (VM) && defined (EFILESYS)
 static bool page_cache_readahead (struct page *page, void *kva);
 static bool page_cache_writeback (struct page *page);
 static void page_cache_destroy (struct page *page);
@@ -15,36 +32,412 @@ static const struct page_operations page_cache_op = {
 
 tid_t page_cache_workerd;
 
+/* Ticks between two writeback passes of page_cache_kworkerd. */
+#define WRITEBACK_INTERVAL (TIMER_FREQ * 10)
+
+/* Most runs of dirty sectors in a page, hence most write requests
+ * for one page. */
+#define RUNS_MAX (PAGE_CACHE_SECTORS / 2)
+
+/* Pages whose writes page_cache_flush() submits together. */
+#define FLUSH_BATCH 8
+
+/* Pages whose reads page_cache_prefetch() submits together. */
+#define PREFETCH_BATCH 8
+
+/* Every page cache page, resident or not, keyed by its first
+ * sector.  Pages are never removed, so a pointer obtained from the
+ * index stays valid. */
+static struct hash pages;
+static struct lock pages_lock;
+
+static void page_cache_kworkerd (void *aux);
+
+/* Returns a hash value for page cache page P_. */
+static uint64_t
+page_cache_hash (const struct hash_elem *p_, void *aux UNUSED) {
+	const struct page *p = hash_entry (p_, struct page, page_cache.elem);
+	return hash_int (p->page_cache.sector);
+}
+
+/* Returns true if page cache page A_ precedes page B_. */
+static bool
+page_cache_less (const struct hash_elem *a_, const struct hash_elem *b_,
+		void *aux UNUSED) {
+	const struct page *a = hash_entry (a_, struct page, page_cache.elem);
+	const struct page *b = hash_entry (b_, struct page, page_cache.elem);
+	return a->page_cache.sector < b->page_cache.sector;
+}
+
 /* The initializer of file vm */
 void
 pagecache_init (void) {
-	/* TODO: Create a worker daemon for page cache with page_cache_kworkerd */
+	hash_init (&pages, page_cache_hash, page_cache_less, NULL);
+	lock_init (&pages_lock);
+	page_cache_workerd = thread_create ("page_cache_kworkerd", PRI_DEFAULT,
+			page_cache_kworkerd, NULL);
 }
 
 /* Initialize the page cache */
 bool
-page_cache_initializer (struct page *page, enum vm_type type, void *kva) {
+page_cache_initializer (struct page *page, enum vm_type type UNUSED,
+		void *kva UNUSED) {
+	struct page_cache *pc = &page->page_cache;
+
 	/* Set up the handler */
 	page->operations = &page_cache_op;
 
+	pc->dirty = 0;
+	pc->accessed = false;
+	lock_init (&pc->lock);
+	return true;
+}
+
+/* Returns the number of sectors of PC that lie on the disk. */
+static size_t
+sector_cnt (const struct page_cache *pc) {
+	disk_sector_t size = disk_size (filesys_disk);
+	return size - pc->sector < PAGE_CACHE_SECTORS
+		? size - pc->sector : PAGE_CACHE_SECTORS;
+}
+
+/* Returns true if a dirty sector of PAGE is pinned by the journal. */
+static bool
+has_pinned (struct page *page) {
+	struct page_cache *pc = &page->page_cache;
+	size_t i;
+
+	for (i = 0; i < PAGE_CACHE_SECTORS; i++)
+		if ((pc->dirty & (1 << i)) && journal_pinned (pc->sector + i))
+			return true;
+	return false;
+}
+
+/* Returns true if sector I of PAGE is dirty and may be written
+ * home. */
+static bool
+writable_sector (struct page *page, size_t i) {
+	struct page_cache *pc = &page->page_cache;
+	return (pc->dirty & (1 << i)) && !journal_pinned (pc->sector + i);
+}
+
+/* Submits the writes of the dirty sectors of resident PAGE to
+ * BATCH, except those pinned by the journal, which stay dirty.  Each
+ * run of consecutive sectors is written by one request from REQS,
+ * which must have room for RUNS_MAX.  Returns the number of requests
+ * used.  The page's lock must be held until BATCH is complete. */
+static size_t
+submit_dirty (struct page *page, struct disk_batch *batch,
+		struct disk_request *reqs) {
+	struct page_cache *pc = &page->page_cache;
+	size_t i, cnt, req_cnt = 0;
+
+	ASSERT (lock_held_by_current_thread (&pc->lock));
+	ASSERT (page->frame != NULL);
+
+	for (i = 0; i < PAGE_CACHE_SECTORS; i += cnt) {
+		cnt = 1;
+		if (!writable_sector (page, i))
+			continue;
+		while (i + cnt < PAGE_CACHE_SECTORS && writable_sector (page, i + cnt))
+			cnt++;
+		ASSERT (req_cnt < RUNS_MAX);
+		disk_request_init (&reqs[req_cnt], filesys_disk, pc->sector + i,
+				(uint8_t *) page->frame->kva + i * DISK_SECTOR_SIZE, cnt, true,
+				NULL, NULL);
+		disk_batch_submit (batch, &reqs[req_cnt++]);
+		pc->dirty &= ~(((1 << cnt) - 1) << i);
+	}
+	return req_cnt;
+}
+
+/* Writes the dirty sectors of resident PAGE back to disk, except
+ * those pinned by the journal, which stay dirty.  The page's lock
+ * must be held. */
+static void
+write_dirty (struct page *page) {
+	struct disk_request reqs[RUNS_MAX];
+	struct disk_batch batch;
+
+	disk_batch_init (&batch);
+	submit_dirty (page, &batch, reqs);
+	disk_batch_wait (&batch);
 }
 
 /* Utilze the Swap in mechanism to implement readhead */
 static bool
 page_cache_readahead (struct page *page, void *kva) {
+	struct page_cache *pc = &page->page_cache;
+
+	/* Whatever sector was asked for, the whole page is read, with one
+	 * disk command, so the sectors that follow it are already cached
+	 * when a sequential reader gets to them. */
+	disk_read_multi (filesys_disk, pc->sector, kva, sector_cnt (pc));
+	pc->dirty = 0;
+	return true;
 }
 
 /* Utilze the Swap out mechanism to implement writeback */
 static bool
 page_cache_writeback (struct page *page) {
+	struct page_cache *pc = &page->page_cache;
+	enum disk_origin origin;
+
+	/* A page in use cannot be evicted; the caller picks another
+	 * victim.  This includes a page locked by the evicting thread
+	 * itself, e.g. when copying into a user buffer faults, and a page
+	 * holding sectors of an uncommitted transaction. */
+	if (lock_held_by_current_thread (&pc->lock)
+			|| !lock_try_acquire (&pc->lock))
+		return false;
+	if (has_pinned (page)) {
+		lock_release (&pc->lock);
+		return false;
+	}
+	origin = disk_set_origin (DISK_IO_CACHE);
+	write_dirty (page);
+	disk_set_origin (origin);
+	page->frame = NULL;
+	lock_release (&pc->lock);
+	return true;
 }
 
 /* Destory the page_cache. */
 static void
 page_cache_destroy (struct page *page) {
+	struct page_cache *pc = &page->page_cache;
+
+	lock_acquire (&pc->lock);
+	if (page->frame != NULL) {
+		write_dirty (page);
+		lock_acquire (&frame_table.lock);
+		list_remove (&page->frame->frame_elem);
+		lock_release (&frame_table.lock);
+		palloc_free_page (page->frame->kva);
+		free (page->frame);
+		page->frame = NULL;
+	}
+	lock_release (&pc->lock);
+}
+
+/* Returns the page caching SECTOR, creating it if necessary. */
+static struct page *
+find_page (disk_sector_t sector) {
+	struct page key;
+	struct page *page;
+	struct hash_elem *e;
+
+	key.page_cache.sector = sector - sector % PAGE_CACHE_SECTORS;
+	lock_acquire (&pages_lock);
+	e = hash_find (&pages, &key.page_cache.elem);
+	if (e != NULL)
+		page = hash_entry (e, struct page, page_cache.elem);
+	else {
+		page = malloc (sizeof *page);
+		if (page == NULL)
+			PANIC ("page cache: out of memory");
+		page->va = NULL;
+		page->frame = NULL;
+		page->writable = true;
+		page->owner = NULL;
+		page_cache_initializer (page, VM_PAGE_CACHE, NULL);
+		page->page_cache.sector = key.page_cache.sector;
+		hash_insert (&pages, &page->page_cache.elem);
+	}
+	lock_release (&pages_lock);
+	return page;
+}
+
+/* Returns the page caching SECTOR, resident and with its lock
+ * held. */
+static struct page *
+acquire_page (disk_sector_t sector) {
+	struct page *page = find_page (sector);
+	struct page_cache *pc = &page->page_cache;
+
+	lock_acquire (&pc->lock);
+	if (page->frame == NULL && !vm_claim_kernel_page (page))
+		PANIC ("page cache: cannot load sector %"PRDSNu, sector);
+	pc->accessed = true;
+	return page;
+}
+
+/* Returns the address of SECTOR's data within resident PAGE. */
+static uint8_t *
+sector_data (struct page *page, disk_sector_t sector) {
+	return (uint8_t *) page->frame->kva
+		+ (sector - page->page_cache.sector) * DISK_SECTOR_SIZE;
+}
+
+/* Reads SIZE bytes at offset SECTOR_OFS within SECTOR into BUFFER. */
+void
+page_cache_read (disk_sector_t sector, void *buffer, off_t sector_ofs,
+		int size) {
+	struct page *page = acquire_page (sector);
+
+	memcpy (buffer, sector_data (page, sector) + sector_ofs, size);
+	lock_release (&page->page_cache.lock);
+}
+
+/* Writes SIZE bytes from BUFFER at offset SECTOR_OFS within
+ * SECTOR. */
+void
+page_cache_write (disk_sector_t sector, const void *buffer,
+		off_t sector_ofs, int size) {
+	struct page *page = acquire_page (sector);
+	struct page_cache *pc = &page->page_cache;
+
+	memcpy (sector_data (page, sector) + sector_ofs, buffer, size);
+	pc->dirty |= 1 << (sector - pc->sector);
+	lock_release (&pc->lock);
+}
+
+/* Makes the pages holding the CNT sectors starting at SECTOR
+ * resident.  Pages that are resident already or in use are skipped.
+ * The reads of up to PREFETCH_BATCH pages are submitted together, so
+ * the disk orders them and merges those of consecutive pages; each
+ * page stays locked, and its frame pinned, until the batch is
+ * complete. */
+void
+page_cache_prefetch (disk_sector_t sector, size_t cnt) {
+	disk_sector_t end = sector + cnt;
+
+	sector -= sector % PAGE_CACHE_SECTORS;
+	while (sector < end) {
+		struct disk_request reqs[PREFETCH_BATCH];
+		struct page *loading[PREFETCH_BATCH];
+		struct disk_batch batch;
+		size_t n = 0, i;
+
+		disk_batch_init (&batch);
+		for (; sector < end && n < PREFETCH_BATCH;
+				sector += PAGE_CACHE_SECTORS) {
+			struct page *page = find_page (sector);
+			struct page_cache *pc = &page->page_cache;
+			struct frame *frame;
+
+			if (!lock_try_acquire (&pc->lock))
+				continue;
+			if (page->frame != NULL) {
+				lock_release (&pc->lock);
+				continue;
+			}
+			frame = vm_get_frame ();
+			frame->page = page;
+			page->frame = frame;
+			pc->accessed = true;
+			disk_request_init (&reqs[n], filesys_disk, pc->sector, frame->kva,
+					sector_cnt (pc), false, NULL, NULL);
+			disk_batch_submit (&batch, &reqs[n]);
+			loading[n++] = page;
+		}
+		disk_batch_wait (&batch);
+
+		for (i = 0; i < n; i++) {
+			struct page *page = loading[i];
+
+			page->page_cache.dirty = 0;
+			page->frame->pinned = false;
+			lock_release (&page->page_cache.lock);
+		}
+	}
+}
+
+/* Orders page cache pages A_ and B_ by first sector, for qsort(). */
+static int
+compare_sectors (const void *a_, const void *b_) {
+	const struct page *a = *(struct page * const *) a_;
+	const struct page *b = *(struct page * const *) b_;
+
+	return a->page_cache.sector < b->page_cache.sector ? -1
+		: a->page_cache.sector > b->page_cache.sector;
+}
+
+/* Writes the dirty sectors of every resident page back to disk.  The
+ * writes of up to FLUSH_BATCH pages are submitted together, so the
+ * disk orders them and merges those to consecutive sectors. */
+void
+page_cache_flush (void) {
+	struct hash_iterator i;
+	struct page **snapshot;
+	struct disk_request *reqs;
+	size_t cnt = 0, n;
+
+	/* Disk writes happen without PAGES_LOCK, on a copy of the index;
+	 * pages are never freed, so the copy stays valid. */
+	lock_acquire (&pages_lock);
+	snapshot = malloc (hash_size (&pages) * sizeof *snapshot);
+	if (snapshot != NULL) {
+		hash_first (&i, &pages);
+		while (hash_next (&i))
+			snapshot[cnt++] = hash_entry (hash_cur (&i), struct page,
+					page_cache.elem);
+	}
+	lock_release (&pages_lock);
+	if (snapshot == NULL)
+		return;
+	reqs = malloc (FLUSH_BATCH * RUNS_MAX * sizeof *reqs);
+	if (reqs == NULL) {
+		free (snapshot);
+		return;
+	}
+
+	/* Page locks are acquired in sector order, so two flushes cannot
+	 * wait for each other. */
+	qsort (snapshot, cnt, sizeof *snapshot, compare_sectors);
+	for (n = 0; n < cnt; ) {
+		struct disk_batch batch;
+		size_t first = n, req_cnt = 0;
+
+		disk_batch_init (&batch);
+		for (; n < cnt && n - first < FLUSH_BATCH; n++) {
+			struct page *page = snapshot[n];
+
+			lock_acquire (&page->page_cache.lock);
+			if (page->frame != NULL && page->page_cache.dirty)
+				req_cnt += submit_dirty (page, &batch, reqs + req_cnt);
+		}
+		disk_batch_wait (&batch);
+		for (; first < n; first++)
+			lock_release (&snapshot[first]->page_cache.lock);
+	}
+	free (reqs);
+	free (snapshot);
+}
+
+/* Writes SECTOR back to disk if it is resident and dirty. */
+void
+page_cache_flush_sector (disk_sector_t sector) {
+	struct page key;
+	struct page *page = NULL;
+	struct hash_elem *e;
+
+	key.page_cache.sector = sector - sector % PAGE_CACHE_SECTORS;
+	lock_acquire (&pages_lock);
+	e = hash_find (&pages, &key.page_cache.elem);
+	if (e != NULL)
+		page = hash_entry (e, struct page, page_cache.elem);
+	lock_release (&pages_lock);
+	if (page == NULL)
+		return;
+
+	lock_acquire (&page->page_cache.lock);
+	if (page->frame != NULL
+			&& (page->page_cache.dirty & (1 << (sector - key.page_cache.sector)))
+			&& !journal_pinned (sector)) {
+		disk_write (filesys_disk, sector, sector_data (page, sector));
+		page->page_cache.dirty &= ~(1 << (sector - key.page_cache.sector));
+	}
+	lock_release (&page->page_cache.lock);
 }
 
 /* Worker thread for page cache */
 static void
-page_cache_kworkerd (void *aux) {
+page_cache_kworkerd (void *aux UNUSED) {
+	disk_set_origin (DISK_IO_CACHE);
+	for (;;) {
+		timer_sleep (WRITEBACK_INTERVAL);
+		page_cache_flush ();
+	}
 }
+#endif /* VM && EFILESYS */
@@ -2,7 +2,11 @@
 #define DEVICES_DISK_H
 
 #include <inttypes.h>
+#include <list.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include "threads/synch.h"
 
 /* Size of a disk sector in bytes. */
 #define DISK_SECTOR_SIZE 512
@@ -15,13 +19,91 @@ typedef uint32_t disk_sector_t;
  * printf ("sector=%"PRDSNu"\n", sector); */
 #define PRDSNu PRIu32
 
+/* Most sectors transferred by one disk command. */
+#define DISK_MULTI_MAX 256
+
+struct disk_request;
+
+/* What disk I/O is done for, for accounting. */
+enum disk_origin {
+	DISK_IO_OTHER,              /* None of the below. */
+	DISK_IO_SWAP,               /* Swapping anonymous pages. */
+	DISK_IO_DATA,               /* Contents of files and directories. */
+	DISK_IO_META,               /* Inodes and index blocks. */
+	DISK_IO_FREE_MAP,           /* Free map or FAT. */
+	DISK_IO_CACHE,              /* Cache writeback and read-ahead. */
+	DISK_IO_JOURNAL,            /* File system journal. */
+	DISK_ORIGIN_CNT
+};
+
+/* Called when a disk request is complete. */
+typedef void disk_request_func (struct disk_request *, void *aux);
+
+/* A transfer of consecutive sectors between a disk and memory,
+   queued on the disk's channel.  The submitter owns it; it must
+   stay in place until the transfer is complete. */
+struct disk_request {
+	struct disk *disk;          /* Disk. */
+	disk_sector_t sector;       /* First sector. */
+	size_t cnt;                 /* Number of sectors. */
+	void *buffer;               /* CNT * DISK_SECTOR_SIZE bytes. */
+	bool write;                 /* Write, or read? */
+	disk_request_func *done;    /* Called on completion, or null. */
+	void *aux;                  /* Passed to DONE. */
+
+	struct semaphore complete;  /* Up'd on completion if DONE is null. */
+	enum disk_origin origin;    /* Submitter's origin. */
+	int64_t submitted;          /* Timer tick of submission. */
+	uint64_t submit_us;         /* Microseconds at submission. */
+	struct list_elem elem;      /* Element in a channel's queue. */
+};
+
+/* Requests submitted together, so that the channel's elevator can
+   order and merge them, and reaped in the order the disk completes
+   them. */
+struct disk_batch {
+	struct list done;           /* Completed requests not yet reaped. */
+	struct lock lock;           /* Protects DONE. */
+	struct semaphore ready;     /* Up'd once per completed request. */
+	size_t pending;             /* Submitted requests not yet reaped. */
+};
+
+/* How a kind of disk carries out requests. */
+struct disk_ops {
+	/* Starts REQ and calls disk_complete() on it once its
+	   transfer is done, possibly before returning. */
+	void (*submit) (struct disk_request *req);
+};
+
 void disk_init (void);
 void disk_print_stats (void);
 
 struct disk *disk_get (int chan_no, int dev_no);
+struct disk *disk_find (const char *name);
+struct disk *disk_register (const char *name, disk_sector_t capacity,
+		const struct disk_ops *, void *aux);
+void *disk_aux (const struct disk *);
+const char *disk_name (const struct disk *);
 disk_sector_t disk_size (struct disk *);
 void disk_read (struct disk *, disk_sector_t, void *);
 void disk_write (struct disk *, disk_sector_t, const void *);
+void disk_read_multi (struct disk *, disk_sector_t, void *, size_t cnt);
+void disk_write_multi (struct disk *, disk_sector_t, const void *,
+		size_t cnt);
+
+void disk_request_init (struct disk_request *, struct disk *,
+		disk_sector_t, void *buffer, size_t cnt, bool write,
+		disk_request_func *done, void *aux);
+void disk_submit (struct disk_request *);
+void disk_wait (struct disk_request *);
+void disk_complete (struct disk_request *);
+
+void disk_batch_init (struct disk_batch *);
+void disk_batch_submit (struct disk_batch *, struct disk_request *);
+struct disk_request *disk_batch_next (struct disk_batch *);
+void disk_batch_wait (struct disk_batch *);
+
+enum disk_origin disk_set_origin (enum disk_origin);
 
 void 	register_disk_inspect_intr ();
 #endif /* devices/disk.h */
@@ -0,0 +1,12 @@
+#ifndef DEVICES_RAMDISK_H
+#define DEVICES_RAMDISK_H
+
+#include <stddef.h>
+
+/* Most RAM disks. */
+#define RAMDISK_MAX 4
+
+void ramdisk_configure (size_t kb);
+void ramdisk_init (void);
+
+#endif /* devices/ramdisk.h */
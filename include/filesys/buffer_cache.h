@@ -0,0 +1,25 @@
+#ifndef FILESYS_BUFFER_CACHE_H
+#define FILESYS_BUFFER_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/disk.h"
+#include "filesys/off_t.h"
+
+/* Number of sectors held by the buffer cache. */
+#define BUFFER_CACHE_SIZE 64
+
+void buffer_cache_init (void);
+void buffer_cache_done (void);
+
+void buffer_cache_read (disk_sector_t, void *, off_t sector_ofs, int size);
+void buffer_cache_write (disk_sector_t, const void *, off_t sector_ofs,
+		int size);
+void buffer_cache_read_ahead (disk_sector_t, size_t cnt);
+void buffer_cache_flush (void);
+void buffer_cache_flush_sector (disk_sector_t);
+#if defined (VM) && defined (EFILESYS)
+void buffer_cache_enable_page_cache (void);
+#endif
+
+#endif /* filesys/buffer_cache.h */
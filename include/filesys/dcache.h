@@ -0,0 +1,17 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/disk.h"
+
+/* Number of names held by the directory entry cache. */
+#define DCACHE_SIZE 128
+
+void dcache_init (void);
+bool dcache_lookup (disk_sector_t dir_sector, const char *name,
+		bool *found, disk_sector_t *inode_sector);
+void dcache_insert (disk_sector_t dir_sector, const char *name,
+		bool found, disk_sector_t inode_sector);
+void dcache_invalidate (disk_sector_t dir_sector, const char *name);
+
+#endif /* filesys/dcache.h */
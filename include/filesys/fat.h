@@ -23,6 +23,9 @@ void fat_open (void);
 void fat_close (void);
 void fat_create (void);
 void fat_close (void);
+void fat_flush (void);
+size_t fat_take_dirty (disk_sector_t *sectors, uint8_t *data, size_t max);
+size_t fat_dirty_cnt (void);
 
 cluster_t fat_create_chain (
     cluster_t clst /* Cluster # to stretch, 0: Create a new chain */
@@ -34,5 +37,6 @@ void fat_remove_chain (
 cluster_t fat_get (cluster_t clst);
 void fat_put (cluster_t clst, cluster_t val);
 disk_sector_t cluster_to_sector (cluster_t clst);
+cluster_t sector_to_cluster (disk_sector_t sector);
 
 #endif /* filesys/fat.h */
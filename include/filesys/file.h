@@ -13,6 +13,9 @@ struct file {
 	struct inode *inode;        /* File's inode. */
 	off_t pos;                  /* Current position. */
 	bool deny_write;            /* Has file_deny_write() been called? */
+	off_t ra_next;              /* Offset a sequential read starts at. */
+	off_t ra_end;               /* End of the data already read ahead. */
+	int ra_window;              /* Read-ahead window, in sectors. */
 };
 
 /* Opening and closing files. */
@@ -0,0 +1,64 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "devices/disk.h"
+
+/* Number of sectors of the journal, which occupies the last sectors
+ * of the file system disk.  Formatting keeps them out of the free
+ * space. */
+#define JOURNAL_SECTORS 128
+
+/* Identify the blocks of the journal, laid out as below. */
+#define SUPER_MAGIC 0x4c4e524a          /* "JRNL" */
+#define DESC_MAGIC 0x43534544           /* "DESC" */
+#define COMMIT_MAGIC 0x54494d43         /* "CMIT" */
+
+/* First sector of the journal.  Records follow it. */
+struct super_block {
+	uint32_t magic;                     /* SUPER_MAGIC. */
+	uint32_t seq;                       /* Sequence number of first record. */
+	uint32_t start;                     /* Offset of first record. */
+	uint32_t unused[125];               /* Not used. */
+};
+
+/* First sector of a record. */
+struct descriptor {
+	uint32_t magic;                     /* DESC_MAGIC. */
+	uint32_t seq;                       /* Sequence number. */
+	uint32_t cnt;                       /* Number of sectors. */
+	disk_sector_t sectors[125];         /* Home of each sector. */
+};
+
+/* Last sector of a record.  A record without a valid commit block
+ * is ignored, and so is a transaction whose last record, the first
+ * one with MORE clear, is ignored. */
+struct commit_block {
+	uint32_t magic;                     /* COMMIT_MAGIC. */
+	uint32_t seq;                       /* Sequence number. */
+	uint32_t cnt;                       /* Number of sectors. */
+	uint32_t more;                      /* Continued in the next record? */
+	uint64_t checksum;                  /* Of descriptor and sectors. */
+	uint32_t unused[122];               /* Not used. */
+};
+
+disk_sector_t journal_start (void);
+
+void journal_init (void);
+void journal_format (void);
+void journal_recover (void);
+void journal_open (void);
+void journal_done (void);
+
+void journal_begin (void);
+void journal_end (void);
+void journal_commit (void);
+bool journal_in_operation (void);
+
+void journal_dirty (disk_sector_t);
+bool journal_pinned (disk_sector_t);
+void journal_stash (disk_sector_t, const void *);
+bool journal_unstash (disk_sector_t, void *);
+
+#endif /* filesys/journal.h */
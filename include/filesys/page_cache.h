@@ -1,12 +1,38 @@
 #ifndef FILESYS_PAGE_CACHE_H
 #define FILESYS_PAGE_CACHE_H
-#include "vm/vm.h"
+#include <hash.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "devices/disk.h"
+#include "filesys/off_t.h"
+#include "threads/synch.h"
 
 struct page;
 enum vm_type;
 
-struct page_cache {};
+/* Number of consecutive disk sectors held by one page cache page. */
+#define PAGE_CACHE_SECTORS 8
 
-void page_cache_init (void);
+/* A page of the page cache, holding PAGE_CACHE_SECTORS consecutive
+ * sectors of the file system disk in a frame of the frame table.
+ * Under memory pressure the frame is reclaimed like a user frame:
+ * swap_out writes the dirty sectors back and swap_in reads them
+ * again.  The page itself stays in the index while not resident. */
+struct page_cache {
+	disk_sector_t sector;       /* First sector, PAGE_CACHE_SECTORS aligned. */
+	uint8_t dirty;              /* One bit per modified sector. */
+	bool accessed;              /* Used since the clock hand passed? */
+	struct hash_elem elem;      /* Element in the page cache index. */
+	struct lock lock;           /* Protects contents, DIRTY and the frame. */
+};
+
+void pagecache_init (void);
 bool page_cache_initializer (struct page *page, enum vm_type type, void *kva);
+
+void page_cache_read (disk_sector_t, void *, off_t sector_ofs, int size);
+void page_cache_write (disk_sector_t, const void *, off_t sector_ofs,
+		int size);
+void page_cache_prefetch (disk_sector_t, size_t cnt);
+void page_cache_flush (void);
+void page_cache_flush_sector (disk_sector_t);
 #endif
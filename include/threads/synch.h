@@ -40,6 +40,26 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
+/* Reader-writer lock. */
+struct rwlock {
+	struct lock lock;           /* Held by the writer; passed by readers. */
+	struct lock guard;          /* Protects the members below. */
+	struct condition no_readers;    /* Signaled when READERS drops to 0. */
+	struct condition no_writers;    /* Signaled when WRITERS drops to 0. */
+	unsigned readers;           /* Number of threads reading. */
+	unsigned writers;           /* Number of writers waiting for LOCK. */
+	bool prefer_writers;        /* Do readers wait for waiting writers? */
+};
+
+void rwlock_init (struct rwlock *, bool prefer_writers);
+void rwlock_acquire_read (struct rwlock *);
+bool rwlock_try_acquire_read (struct rwlock *);
+void rwlock_release_read (struct rwlock *);
+void rwlock_acquire_write (struct rwlock *);
+bool rwlock_try_acquire_write (struct rwlock *);
+void rwlock_release_write (struct rwlock *);
+bool rwlock_held_for_write (const struct rwlock *);
+
 bool cmp_sem_priority(const struct list_elem *a, const struct list_elem *b, void *aux UNUSED);
 bool cmp_donors_priority(const struct list_elem *a, const struct list_elem *b, void *aux UNUSED);
 
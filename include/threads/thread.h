@@ -34,8 +34,8 @@ typedef int tid_t;
 #define PRI_MAX 63                      /* Highest priority. */
 
 /* ------------------ project2 -------------------- */
-#define FDT_PAGES 3		/* pages to allocate for file descriptor tables (thread_create, process_exit) */
-#define FDCOUNT_LIMIT FDT_PAGES *(1 << 9)		/* limit fd_idx */
+#define FDT_INIT_CNT 16		/* slots of a new fd table, doubled when it fills up */
+#define FDCOUNT_LIMIT 1536		/* most slots an fd table grows to */
 /* ------------------------------------------------ */
 
 /* A kernel thread or user process.
@@ -129,6 +129,13 @@ struct thread {
 	/* Table for whole virtual memory owned by thread. */
 	struct supplemental_page_table spt;
 #endif
+#ifdef FILESYS
+	/* Owned by filesys/journal.c. */
+	int journal_depth;                  /* Nesting of journal_begin(). */
+#endif
+
+	/* Owned by devices/disk.c. */
+	int disk_origin;                    /* Charged for disk I/O. */
 
 	/* Owned by thread.c. */
 	struct intr_frame tf;               /* Information for switching */
@@ -157,8 +164,11 @@ struct thread {
 
 	/* --- Project 2 : File Descriptor --- */ 
 	/* fd table 파일 구조체와 fd index */
-	struct file **fd_table;   /* allocated in thread_create */
-	int fd_idx;              /* for open file's fd in fd_table */
+	struct file **fd_table;   /* null until the thread becomes a user process */
+	uint64_t *fd_used;        /* bit FD set while fd_table[FD] is taken */
+	int fd_cnt;               /* number of slots in fd_table */
+	int fd_idx;               /* every fd below fd_idx is taken */
+	int fd_end;               /* one past the highest fd taken */
 
 	int stdin_count;
 	int stdout_count;
@@ -5,9 +5,10 @@
 void syscall_init (void);
 
 /* ---- Project 2 : File Descriptor ---- */
-/* 파일 사용 시 lock하여 상호배제 구현 */
-struct lock filesys_lock;
-
+struct thread;
 struct file *find_file_by_fd(int fd);
+bool fdt_init (void);
+bool fdt_duplicate (struct thread *parent);
+void fdt_destroy (void);
 
 #endif /* userprog/syscall.h */
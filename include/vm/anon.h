@@ -3,6 +3,15 @@
 #include "vm/vm.h"
 struct page;
 enum vm_type;
+struct zswap_entry;
+struct ksm_node;
+
+/* Where an anonymous page's contents are. */
+enum anon_swap {
+	ANON_RESIDENT,      /* In its frame, or not yet swapped out. */
+	ANON_IN_ZSWAP,      /* Compressed in memory, see ZSWAP. */
+	ANON_ON_DISK,       /* In swap slot SEC_NO_IDX. */
+};
 
 struct anon_page {
 
@@ -12,9 +21,16 @@ struct anon_page {
 	void *aux;
 
 	uint64_t sec_no_idx;
+	enum anon_swap swap;
+	struct zswap_entry *zswap;  /* Null for a zero page. */
+	struct ksm_node *ksm;       /* Shared frame, if merged. */
+	uint64_t ksm_checksum;      /* Checksum at ksmd's last visit. */
 };
 
+extern const char *swap_disk_spec;
+
 void vm_anon_init (void);
 bool anon_initializer (struct page *page, enum vm_type type, void *kva);
+void swap_bench (char **argv);
 
 #endif
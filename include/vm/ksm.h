@@ -0,0 +1,16 @@
+#ifndef VM_KSM_H
+#define VM_KSM_H
+#include <stdbool.h>
+
+struct page;
+struct ksm_node;
+
+extern bool ksm_enabled;
+
+void ksm_init (void);
+bool ksm_split (struct page *page);
+void ksm_unshare (struct page *page);
+bool ksm_release (struct page *page);
+void ksm_print_stats (void);
+
+#endif
@@ -55,6 +55,7 @@ struct page {
 	/* --- project3-1 --- */
 	struct hash_elem hash_elem; /* Hash table element. */
 	bool writable;
+	struct thread *owner;       /* Thread whose pml4 maps it, if any. */
 
 	/* Per-type data are binded into the union.
 	 * Each function automatically detects the current union */
@@ -79,6 +80,7 @@ struct frame {
 	struct page *page;
 	/* --- project3-1 --- */
 	struct list_elem frame_elem;
+	bool pinned;                /* Being filled in, not to be evicted. */
 
 };
 struct frame_table frame_table;
@@ -140,6 +142,9 @@ bool vm_alloc_page_with_initializer (enum vm_type type, void *upage,
 		bool writable, vm_initializer *init, void *aux);
 void vm_dealloc_page (struct page *page);
 bool vm_claim_page (void *va);
+bool vm_claim_kernel_page (struct page *page);
+struct frame *vm_get_frame (void);
+void vm_free_frame (struct frame *frame);
 enum vm_type page_get_type (struct page *page);
 
 #endif  /* VM_VM_H */
@@ -0,0 +1,28 @@
+#ifndef VM_ZSWAP_H
+#define VM_ZSWAP_H
+#include <stdbool.h>
+#include <stddef.h>
+#include "threads/vaddr.h"
+
+struct zswap_entry;
+
+/* Default size limit of the compressed page pool, in pages. */
+#define ZSWAP_POOL_PAGES 256
+
+/* A page that does not compress to this size or less goes to
+ * disk. */
+#define ZSWAP_MAX_STORED (PGSIZE * 3 / 4)
+
+extern size_t zswap_pool_limit;
+
+void zswap_init (void);
+bool zswap_store (const void *page, struct zswap_entry **entryp);
+void zswap_load (struct zswap_entry *entry, void *page);
+void zswap_free (struct zswap_entry *entry);
+void zswap_count_disk_load (void);
+void zswap_print_stats (void);
+
+size_t zswap_compress (const void *page, void *dst, size_t limit);
+void zswap_decompress (const void *src, size_t size, void *page);
+
+#endif
@@ -0,0 +1,73 @@
+/* Writes a file, then touches more anonymous memory than the machine
+   has, so that the cached sectors of the file are evicted along with
+   other pages and the dirty ones written back.  Reading the file
+   again must give back what was written.
+   For this test, Pintos memory size is 10MB. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+#define FILE_SIZE (256 * 1024)
+#define CHUNK_SIZE (16 * 1024 * 1024)
+#define PAGE_COUNT (CHUNK_SIZE / PAGE_SIZE)
+
+static const char file_name[] = "data";
+static char buf[PAGE_SIZE];
+static char big_chunk[CHUNK_SIZE];
+
+/* Fills BUF with the contents of page OFS / PAGE_SIZE of the file. */
+static void
+fill (size_t ofs)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof buf; i++)
+    buf[i] = (ofs + i) % 251;
+}
+
+void
+test_main (void)
+{
+  long long read_cnt;
+  size_t ofs, i;
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  msg ("write \"%s\"", file_name);
+  for (ofs = 0; ofs < FILE_SIZE; ofs += sizeof buf)
+    {
+      fill (ofs);
+      if (write (fd, buf, sizeof buf) != sizeof buf)
+        fail ("write %zu bytes at offset %zu failed", sizeof buf, ofs);
+    }
+
+  msg ("touch %d MB of memory", CHUNK_SIZE / (1024 * 1024));
+  for (i = 0; i < PAGE_COUNT; i++)
+    big_chunk[i * PAGE_SIZE] = (char) i;
+  for (i = 0; i < PAGE_COUNT; i++)
+    if (big_chunk[i * PAGE_SIZE] != (char) i)
+      fail ("memory is inconsistent in page %zu", i);
+
+  msg ("read \"%s\"", file_name);
+  read_cnt = get_fs_disk_read_cnt ();
+  seek (fd, 0);
+  for (ofs = 0; ofs < FILE_SIZE; ofs += sizeof buf)
+    {
+      char data[PAGE_SIZE];
+
+      fill (ofs);
+      if (read (fd, data, sizeof data) != sizeof data)
+        fail ("read %zu bytes at offset %zu failed", sizeof data, ofs);
+      if (memcmp (data, buf, sizeof data))
+        fail ("file content mismatch at offset %zu", ofs);
+    }
+  CHECK (get_fs_disk_read_cnt () > read_cnt,
+         "cached sectors were evicted and read back");
+
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(bc-evict) begin
+(bc-evict) create "data"
+(bc-evict) open "data"
+(bc-evict) write "data"
+(bc-evict) touch 16 MB of memory
+(bc-evict) read "data"
+(bc-evict) cached sectors were evicted and read back
+(bc-evict) close "data"
+(bc-evict) end
+EOF
+pass;
@@ -0,0 +1,129 @@
+/* Commits two transactions, each changing one sector, then throws
+   away the commit block of the second and both sectors' home copies,
+   as a crash between writing the record and its commit block would.
+   Replaying the journal must bring back the first change and ignore
+   the second. */
+
+#include <debug.h>
+#include <string.h>
+#include "tests/threads/tests.h"
+#include "devices/disk.h"
+#include "filesys/buffer_cache.h"
+#include "filesys/filesys.h"
+#include "filesys/journal.h"
+#ifdef EFILESYS
+#include "filesys/fat.h"
+#else
+#include "filesys/free-map.h"
+#endif
+
+static uint8_t old[DISK_SECTOR_SIZE];   /* Home contents at the crash. */
+static uint8_t first[DISK_SECTOR_SIZE]; /* Committed by the first record. */
+static uint8_t second[DISK_SECTOR_SIZE];/* Committed by the second record. */
+static uint8_t buf[DISK_SECTOR_SIZE];
+
+static struct super_block sb;
+static struct descriptor desc;
+
+/* Returns a free sector to scribble on. */
+static disk_sector_t
+scratch_sector (void)
+{
+  disk_sector_t sector;
+
+#ifdef EFILESYS
+  cluster_t clst = fat_create_chain (0);
+  if (clst == 0)
+    fail ("disk full");
+  sector = cluster_to_sector (clst);
+#else
+  if (!free_map_allocate (1, &sector))
+    fail ("disk full");
+#endif
+  return sector;
+}
+
+/* Commits a transaction that writes DATA to SECTOR. */
+static void
+commit_sector (disk_sector_t sector, const void *data)
+{
+  journal_begin ();
+  buffer_cache_write (sector, data, 0, DISK_SECTOR_SIZE);
+  journal_end ();
+  journal_commit ();
+}
+
+/* Returns the offset within the journal of the record that journals
+   SECTOR, reading its descriptor into DESC. */
+static size_t
+find_record (disk_sector_t sector)
+{
+  disk_sector_t start = journal_start ();
+  uint32_t seq = sb.seq;
+  size_t pos, i;
+
+  for (pos = sb.start; pos + 2 <= JOURNAL_SECTORS; pos += desc.cnt + 2)
+    {
+      disk_read (filesys_disk, start + pos, &desc);
+      if (desc.magic != DESC_MAGIC || desc.seq != seq++)
+        break;
+      for (i = 0; i < desc.cnt; i++)
+        if (desc.sectors[i] == sector)
+          return pos;
+    }
+  fail ("no record of sector %"PRDSNu" in the journal", sector);
+  NOT_REACHED ();
+}
+
+void
+test_journal_recover (void)
+{
+  disk_sector_t s1, s2;
+  size_t pos;
+
+  memset (old, 'o', sizeof old);
+  memset (first, '1', sizeof first);
+  memset (second, '2', sizeof second);
+
+  /* Both sectors start out on disk with OLD, and nothing else is
+     left in the running transaction. */
+  s1 = scratch_sector ();
+  s2 = scratch_sector ();
+  buffer_cache_write (s1, old, 0, DISK_SECTOR_SIZE);
+  buffer_cache_write (s2, old, 0, DISK_SECTOR_SIZE);
+  journal_commit ();
+  buffer_cache_flush ();
+
+  msg ("commit two transactions");
+  commit_sector (s1, first);
+  commit_sector (s2, second);
+
+  /* The cached copies are clean from here on, so nothing else writes
+     the sectors home. */
+  buffer_cache_flush ();
+
+  msg ("lose the commit block of the second");
+  disk_read (filesys_disk, journal_start (), &sb);
+  if (sb.magic != SUPER_MAGIC)
+    fail ("bad journal super block");
+  find_record (s1);
+  pos = find_record (s2);
+  memset (buf, 0, sizeof buf);
+  disk_write (filesys_disk, journal_start () + pos + desc.cnt + 1, buf);
+  disk_write (filesys_disk, s1, old);
+  disk_write (filesys_disk, s2, old);
+
+  msg ("replay the journal");
+  journal_recover ();
+
+  disk_read (filesys_disk, s1, buf);
+  if (memcmp (buf, first, sizeof buf))
+    fail ("first transaction lost");
+  msg ("first transaction replayed");
+
+  disk_read (filesys_disk, s2, buf);
+  if (memcmp (buf, old, sizeof buf))
+    fail ("second transaction replayed without its commit block");
+  msg ("second transaction ignored");
+  pass ();
+}
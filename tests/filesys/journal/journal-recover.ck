@@ -0,0 +1,15 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(journal-recover) begin
+(journal-recover) commit two transactions
+(journal-recover) lose the commit block of the second
+(journal-recover) replay the journal
+(journal-recover) first transaction replayed
+(journal-recover) second transaction ignored
+(journal-recover) PASS
+(journal-recover) end
+EOF
+pass;
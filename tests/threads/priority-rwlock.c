@@ -0,0 +1,61 @@
+/* The main thread acquires a reader-writer lock for reading.  A
+   higher-priority reader then acquires and releases it alongside
+   the main thread.  A writer of still higher priority blocks until
+   the main thread has released its read lock, and a reader that
+   arrives while the writer waits gets the lock only after the
+   writer has released it. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/init.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+static thread_func reader_thread_func;
+static thread_func writer_thread_func;
+
+void
+test_priority_rwlock (void) 
+{
+  struct rwlock rw;
+
+  /* This test does not work with the MLFQS. */
+  ASSERT (!thread_mlfqs);
+
+  /* Make sure our priority is the default. */
+  ASSERT (thread_get_priority () == PRI_DEFAULT);
+
+  rwlock_init (&rw, true);
+  rwlock_acquire_read (&rw);
+  msg ("Main thread acquired read lock.");
+  thread_create ("reader", PRI_DEFAULT + 1, reader_thread_func, &rw);
+  thread_create ("writer", PRI_DEFAULT + 2, writer_thread_func, &rw);
+  if (rwlock_try_acquire_read (&rw))
+    fail ("Main thread acquired read lock while writer waits.");
+  msg ("Main thread could not acquire read lock again.");
+  thread_create ("reader", PRI_DEFAULT + 1, reader_thread_func, &rw);
+  rwlock_release_read (&rw);
+  msg ("Main thread finished.");
+}
+
+static void
+reader_thread_func (void *rw_) 
+{
+  struct rwlock *rw = rw_;
+
+  rwlock_acquire_read (rw);
+  msg ("Reader acquired read lock.");
+  rwlock_release_read (rw);
+  msg ("Reader finished.");
+}
+
+static void
+writer_thread_func (void *rw_) 
+{
+  struct rwlock *rw = rw_;
+
+  rwlock_acquire_write (rw);
+  msg ("Writer acquired write lock.");
+  rwlock_release_write (rw);
+  msg ("Writer finished.");
+}
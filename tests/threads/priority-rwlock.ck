@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(priority-rwlock) begin
+(priority-rwlock) Main thread acquired read lock.
+(priority-rwlock) Reader acquired read lock.
+(priority-rwlock) Reader finished.
+(priority-rwlock) Main thread could not acquire read lock again.
+(priority-rwlock) Writer acquired write lock.
+(priority-rwlock) Writer finished.
+(priority-rwlock) Reader acquired read lock.
+(priority-rwlock) Reader finished.
+(priority-rwlock) Main thread finished.
+(priority-rwlock) end
+EOF
+pass;
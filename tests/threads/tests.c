@@ -29,6 +29,7 @@ static const struct test tests[] =
     {"priority-preempt", test_priority_preempt},
     {"priority-sema", test_priority_sema},
     {"priority-condvar", test_priority_condvar},
+    {"priority-rwlock", test_priority_rwlock},
     {"mlfqs-load-1", test_mlfqs_load_1},
     {"mlfqs-load-60", test_mlfqs_load_60},
     {"mlfqs-load-avg", test_mlfqs_load_avg},
@@ -38,6 +39,12 @@ static const struct test tests[] =
     {"mlfqs-nice-2", test_mlfqs_nice_2},
     {"mlfqs-nice-10", test_mlfqs_nice_10},
     {"mlfqs-block", test_mlfqs_block},
+#ifdef FILESYS
+    {"journal-recover", test_journal_recover},
+#endif
+#ifdef VM
+    {"zswap-roundtrip", test_zswap_roundtrip},
+#endif
   };
 
 static const char *test_name;
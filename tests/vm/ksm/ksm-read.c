@@ -0,0 +1,83 @@
+/* Waits until ksmd merges two identical pages, which the child of a
+   fork shares with its parent as well, then read()s from a file into
+   one of the child's.  The kernel must give that page a private copy
+   before writing into it: no other page may change. */
+
+#include <string.h>
+#include <syscall.h>
+#include <stdbool.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+#define READ_SIZE 512
+#define SPIN_MAX 20000000
+
+static char pages[2][PAGE_SIZE] __attribute__ ((aligned (PAGE_SIZE)));
+
+/* Returns byte I of the pattern the pages are filled with. */
+static char
+pattern (size_t i)
+{
+  return 'a' + i % 26;
+}
+
+static void
+fill (char *page)
+{
+  size_t i;
+
+  for (i = 0; i < PAGE_SIZE; i++)
+    page[i] = pattern (i);
+}
+
+/* Returns true if PAGE still has its pattern from byte OFS on. */
+static bool
+intact (const char *page, size_t ofs)
+{
+  size_t i;
+
+  for (i = ofs; i < PAGE_SIZE; i++)
+    if (page[i] != pattern (i))
+      return false;
+  return true;
+}
+
+static bool
+merged (void)
+{
+  return get_phys_addr (pages[0]) == get_phys_addr (pages[1]);
+}
+
+void
+test_main (void)
+{
+  char zeros[READ_SIZE];
+  pid_t child;
+  size_t i;
+  int fd;
+
+  fill (pages[0]);
+  fill (pages[1]);
+  memset (zeros, 0, sizeof zeros);
+  CHECK (create ("data", READ_SIZE), "create \"data\"");
+  CHECK ((fd = open ("data")) > 1, "open \"data\"");
+
+  child = fork ("child");
+  if (child == 0)
+    {
+      for (i = 0; i < SPIN_MAX && !merged (); i++)
+        continue;
+      CHECK (merged (), "pages merged");
+      CHECK (read (fd, pages[0], READ_SIZE) == READ_SIZE,
+             "read into merged page");
+      CHECK (!merged (), "page split");
+      CHECK (!memcmp (pages[0], zeros, READ_SIZE) && intact (pages[0], READ_SIZE),
+             "page read into");
+      CHECK (intact (pages[1], 0), "other page unchanged");
+      return;
+    }
+  wait (child);
+  CHECK (intact (pages[0], 0) && intact (pages[1], 0),
+         "parent's pages unchanged");
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(ksm-read) begin
+(ksm-read) create "data"
+(ksm-read) open "data"
+(ksm-read) pages merged
+(ksm-read) read into merged page
+(ksm-read) page split
+(ksm-read) page read into
+(ksm-read) other page unchanged
+(ksm-read) end
+(ksm-read) parent's pages unchanged
+(ksm-read) end
+EOF
+pass;
@@ -0,0 +1,76 @@
+/* Reads a large file over and over while a child process dirties
+   more anonymous memory than fits in RAM, so that file system
+   reads and swap-outs are in flight at the same time.  The parent
+   checks the data it reads, the child the data it swaps back in.
+   For this test, Pintos memory size is 10MB and zswap is off, so
+   neither the child's pages, which are filled with incompressible
+   data anyway, nor the file's page cache stay resident; the disk
+   statistics printed at power off give the throughput of each
+   disk under the mixed load. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/arc4.h"
+#include "tests/lib.h"
+#include "tests/main.h"
+#include "tests/vm/large.inc"
+
+#define PAGE_SIZE 4096
+#define ONE_MB (1 << 20)
+#define CHUNK_SIZE (16 * ONE_MB)
+
+/* Times the parent reads the whole file. */
+#define READ_PASSES 4
+
+static char big_chunks[CHUNK_SIZE];
+static char buf[PAGE_SIZE];
+
+/* Encrypts the zeros in BIG_CHUNKS, so that every page is swapped
+   out with random-looking data, then decrypts them again, which
+   swaps each page back in, and checks for the zeros. */
+static void
+swap_child (void)
+{
+  struct arc4 arc4;
+  size_t i;
+
+  arc4_init (&arc4, "swap-read", 9);
+  arc4_crypt (&arc4, big_chunks, CHUNK_SIZE);
+  arc4_init (&arc4, "swap-read", 9);
+  arc4_crypt (&arc4, big_chunks, CHUNK_SIZE);
+  for (i = 0; i < CHUNK_SIZE; i++)
+    if (big_chunks[i] != 0)
+      fail ("byte %zu swapped back in with bad data", i);
+  exit (0);
+}
+
+void
+test_main (void)
+{
+  size_t len = strlen (large);
+  size_t pass, ofs;
+  pid_t child;
+  int handle;
+
+  child = fork ("child-swap-read");
+  if (child == 0)
+    swap_child ();
+
+  CHECK ((handle = open ("large.txt")) > 1, "open \"large.txt\"");
+  msg ("read \"large.txt\" %d times", READ_PASSES);
+  for (pass = 0; pass < READ_PASSES; pass++)
+    {
+      seek (handle, 0);
+      for (ofs = 0; ofs < len; ofs += PAGE_SIZE)
+        {
+          size_t size = len - ofs < PAGE_SIZE ? len - ofs : PAGE_SIZE;
+
+          if (read (handle, buf, size) != (int) size)
+            fail ("read of \"large.txt\" failed at offset %zu", ofs);
+          if (memcmp (buf, large + ofs, size))
+            fail ("read of \"large.txt\" returned bad data at offset %zu", ofs);
+        }
+    }
+  close (handle);
+  CHECK (wait (child) == 0, "wait for child");
+}
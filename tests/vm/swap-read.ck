@@ -0,0 +1,22 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+
+our ($test);
+my (@output) = read_text_file ("$test.output");
+
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(swap-read) begin
+(swap-read) open "large.txt"
+(swap-read) read "large.txt" 4 times
+(swap-read) wait for child
+(swap-read) end
+EOF
+
+# The child's pages must really have gone to the swap disk.
+my ($swap) = grep (/^hd1:1: \d+ reads, \d+ writes/, @output);
+fail "no statistics for the swap disk hd1:1\n" if !defined $swap;
+my ($writes) = $swap =~ /(\d+) writes/;
+fail "nothing was written to the swap disk hd1:1\n" if $writes == 0;
+pass;
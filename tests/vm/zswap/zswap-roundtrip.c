@@ -0,0 +1,146 @@
+/* Compresses and decompresses a page of zeros, random pages, highly
+   repetitive pages and a page that compresses to exactly
+   ZSWAP_MAX_STORED bytes, the most zswap keeps, checking that each
+   comes back unchanged.  Every compression is also checked not to
+   write past the room it is given. */
+
+#include <random.h>
+#include <stdint.h>
+#include <string.h>
+#include "tests/threads/tests.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+#include "vm/zswap.h"
+
+/* Bytes past the room given to the compressor that must not change. */
+#define GUARD 16
+
+/* Room for any compressed page: a page of literals, plus one flag
+   byte per 8 of them. */
+#define OUT_SIZE ((size_t) PGSIZE + PGSIZE / 8)
+
+static uint8_t *page;           /* Page to compress. */
+static uint8_t *out;            /* Compressed page, and guard bytes. */
+static uint8_t *back;           /* Decompressed page. */
+
+/* Compresses PAGE with room for LIMIT bytes and returns the size of
+   the result, or 0 if it did not fit. */
+static size_t
+compress (size_t limit)
+{
+  size_t size, i;
+
+  memset (out + limit, 0xa5, GUARD);
+  size = zswap_compress (page, out, limit);
+  for (i = 0; i < GUARD; i++)
+    if (out[limit + i] != 0xa5)
+      fail ("compressor wrote past %zu bytes of room", limit);
+  if (size > limit)
+    fail ("compressor returned %zu bytes for %zu bytes of room", size, limit);
+  return size;
+}
+
+/* Compresses PAGE and checks that it decompresses to itself.
+   Returns the compressed size. */
+static size_t
+round_trip (const char *what)
+{
+  size_t size = compress (OUT_SIZE);
+
+  if (size == 0)
+    fail ("%s: did not compress into %zu bytes", what, OUT_SIZE);
+  memset (back, 0xcc, PGSIZE);
+  zswap_decompress (out, size, back);
+  if (memcmp (page, back, PGSIZE))
+    fail ("%s: changed by compression", what);
+  return size;
+}
+
+/* Fills PAGE with LITERALS bytes in which no 3 consecutive bytes
+   repeat, so that none compresses, followed by a copy of the first
+   COPY of them and zeros. */
+static void
+fill_literals (size_t literals, size_t copy)
+{
+  size_t i;
+
+  memset (page, 0, PGSIZE);
+  for (i = 0; i < literals; i++)
+    page[i] = i % 2 == 0 ? i / 2 % 200 + 1 : 201 + i / 2 / 200;
+  memcpy (page + literals, page, copy);
+}
+
+/* Finds a page that compresses to exactly ZSWAP_MAX_STORED bytes.
+   Adding literals may grow the output by 2 bytes at once; a copy of
+   17 bytes takes one byte less to encode than one of 18, which fills
+   the gap. */
+static void
+find_max_stored_page (void)
+{
+  static const size_t copies[] = {0, 17, 18};
+  size_t literals, i;
+
+  for (literals = PGSIZE / 2; literals < PGSIZE - 18; literals++)
+    for (i = 0; i < sizeof copies / sizeof *copies; i++)
+      {
+        fill_literals (literals, copies[i]);
+        if (compress (OUT_SIZE) == ZSWAP_MAX_STORED)
+          return;
+      }
+  fail ("no page compresses to exactly %d bytes", ZSWAP_MAX_STORED);
+}
+
+void
+test_zswap_roundtrip (void)
+{
+  struct zswap_entry *entry;
+  size_t i, limit;
+
+  page = palloc_get_page (PAL_ASSERT);
+  back = palloc_get_page (PAL_ASSERT);
+  out = palloc_get_multiple (PAL_ASSERT, 2);
+
+  memset (page, 0, PGSIZE);
+  round_trip ("zero page");
+  msg ("zero page");
+
+  random_init (0);
+  for (i = 0; i < 8; i++)
+    {
+      random_bytes (page, PGSIZE);
+      round_trip ("random page");
+      if (compress (ZSWAP_MAX_STORED) != 0)
+        fail ("random page compressed to %d bytes", ZSWAP_MAX_STORED);
+    }
+  msg ("random pages");
+
+  memset (page, 0x5a, PGSIZE);
+  round_trip ("page of one byte");
+  for (i = 0; i < PGSIZE; i++)
+    page[i] = "abc"[i % 3];
+  round_trip ("page of period 3");
+  for (i = 0; i < PGSIZE; i++)
+    page[i] = i % 300 < 150 ? i % 7 : 0xff;
+  round_trip ("page of runs");
+  msg ("repetitive pages");
+
+  find_max_stored_page ();
+  round_trip ("page of ZSWAP_MAX_STORED bytes");
+  for (limit = ZSWAP_MAX_STORED - GUARD; limit < ZSWAP_MAX_STORED; limit++)
+    if (compress (limit) != 0)
+      fail ("compressed into %zu bytes of room", limit);
+  if (compress (ZSWAP_MAX_STORED) != ZSWAP_MAX_STORED)
+    fail ("did not compress into exactly %d bytes", ZSWAP_MAX_STORED);
+  if (!zswap_store (page, &entry) || entry == NULL)
+    fail ("zswap refused a page of %d bytes", ZSWAP_MAX_STORED);
+  memset (back, 0xcc, PGSIZE);
+  zswap_load (entry, back);
+  if (memcmp (page, back, PGSIZE))
+    fail ("page changed by zswap_store() and zswap_load()");
+  msg ("page of exactly ZSWAP_MAX_STORED bytes");
+
+  palloc_free_multiple (out, 2);
+  palloc_free_page (back);
+  palloc_free_page (page);
+  pass ();
+}
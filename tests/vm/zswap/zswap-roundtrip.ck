@@ -0,0 +1,14 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(zswap-roundtrip) begin
+(zswap-roundtrip) zero page
+(zswap-roundtrip) random pages
+(zswap-roundtrip) repetitive pages
+(zswap-roundtrip) page of exactly ZSWAP_MAX_STORED bytes
+(zswap-roundtrip) PASS
+(zswap-roundtrip) end
+EOF
+pass;
@@ -31,9 +31,12 @@
 #include "tests/threads/tests.h"
 #ifdef VM
 #include "vm/vm.h"
+#include "vm/ksm.h"
+#include "vm/zswap.h"
 #endif
 #ifdef FILESYS
 #include "devices/disk.h"
+#include "devices/ramdisk.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif
@@ -109,6 +112,7 @@ main (void) {
 #ifdef FILESYS
 	/* Initialize file system. */
 	disk_init ();
+	ramdisk_init ();
 	filesys_init (format_filesys);
 #endif
 
@@ -216,6 +220,10 @@ parse_options (char **argv) {
 #ifdef FILESYS
 		else if (!strcmp (name, "-f"))
 			format_filesys = true;
+		else if (!strcmp (name, "-ramdisk"))
+			ramdisk_configure (atoi (value));
+		else if (!strcmp (name, "-fsdisk"))
+			filesys_disk_name = value;
 #endif
 		else if (!strcmp (name, "-rs"))
 			random_init (atoi (value));
@@ -226,6 +234,14 @@ parse_options (char **argv) {
 			user_page_limit = atoi (value);
 		else if (!strcmp (name, "-threads-tests"))
 			thread_tests = true;
+#endif
+#ifdef VM
+		else if (!strcmp (name, "-swap"))
+			swap_disk_spec = value;
+		else if (!strcmp (name, "-zswap"))
+			zswap_pool_limit = atoi (value);
+		else if (!strcmp (name, "-ksm"))
+			ksm_enabled = true;
 #endif
 		else
 			PANIC ("unknown option `%s' (use -h for help)", name);
@@ -272,6 +288,9 @@ run_actions (char **argv) {	// command line에 썼던 내용을 동작시키는
 		{"rm", 2, fsutil_rm},
 		{"put", 2, fsutil_put},
 		{"get", 2, fsutil_get},
+#endif
+#ifdef VM
+		{"swapbench", 1, swap_bench},
 #endif
 		{NULL, 0, NULL},
 	};
@@ -320,15 +339,29 @@ usage (void) {
 			"Use these actions indirectly via `pintos' -g and -p options:\n"
 			"  put FILE           Put FILE into file system from scratch disk.\n"
 			"  get FILE           Get FILE from file system into scratch disk.\n"
+#endif
+#ifdef VM
+			"  swapbench          Measure swap disk throughput.\n"
 #endif
 			"\nOptions:\n"
 			"  -h                 Print this help message and power off.\n"
 			"  -q                 Power off VM after actions or on panic.\n"
 			"  -f                 Format file system disk during startup.\n"
+#ifdef FILESYS
+			"  -ramdisk=KB        Add a KB kB RAM disk, named rd0, rd1, ...\n"
+			"  -fsdisk=DISK       Keep the file system on DISK (default hd0:1).\n"
+#endif
 			"  -rs=SEED           Set random number seed to SEED.\n"
 			"  -mlfqs             Use multi-level feedback queue scheduler.\n"
 #ifdef USERPROG
 			"  -ul=COUNT          Limit user memory to COUNT pages.\n"
+#endif
+#ifdef VM
+			"  -swap=DISK,...     Swap round-robin to DISKs, e.g. hd1:1 or rd0\n"
+			"                     (default hd1:1).\n"
+			"  -zswap=PAGES       Keep compressed swap in up to PAGES pages, 0 for\n"
+			"                     none (default 256).\n"
+			"  -ksm               Merge identical anonymous pages in background.\n"
 #endif
 			);
 	power_off ();
@@ -357,6 +390,10 @@ print_stats (void) {
 	thread_print_stats ();
 #ifdef FILESYS
 	disk_print_stats ();
+#endif
+#ifdef VM
+	zswap_print_stats ();
+	ksm_print_stats ();
 #endif
 	console_print_stats ();
 	kbd_print_stats ();
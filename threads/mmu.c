@@ -271,6 +271,22 @@ pml4_clear_page (uint64_t *pml4, void *upage) {
 	}
 }
 
+/* Makes user virtual page UPAGE in PML4 read/write if WRITABLE
+ * is true, read-only otherwise.  UPAGE need not be mapped. */
+void
+pml4_set_writable (uint64_t *pml4, const void *upage, bool writable) {
+	uint64_t *pte = pml4e_walk (pml4, (uint64_t) upage, false);
+	if (pte) {
+		if (writable)
+			*pte |= PTE_W;
+		else
+			*pte &= ~(uint64_t) PTE_W;
+
+		if (rcr3 () == vtop (pml4))
+			invlpg ((uint64_t) upage);
+	}
+}
+
 /* Returns true if the PTE for virtual page VPAGE in PML4 is dirty,
  * that is, if the page has been modified since the PTE was
  * installed.
@@ -422,6 +422,143 @@ cond_broadcast (struct condition *cond, struct lock *lock) {
 		cond_signal (cond, lock);
 }
 
+/* Initializes RW as a reader-writer lock.  Any number of readers
+   may hold RW at once, or a single writer.
+
+   Threads are let in through LOCK, in the order LOCK hands itself
+   out, i.e. by priority.  A writer keeps LOCK until it releases RW,
+   so whoever waits behind a writer donates its priority to it.  A
+   reader only passes through LOCK; a writer that waits for readers
+   to leave does not donate to them.
+
+   If PREFER_WRITERS is true, a reader also waits while any writer is
+   waiting, so that a steady stream of readers cannot keep writers
+   out. */
+void
+rwlock_init (struct rwlock *rw, bool prefer_writers) {
+	ASSERT (rw != NULL);
+
+	lock_init (&rw->lock);
+	lock_init (&rw->guard);
+	cond_init (&rw->no_readers);
+	cond_init (&rw->no_writers);
+	rw->readers = 0;
+	rw->writers = 0;
+	rw->prefer_writers = prefer_writers;
+}
+
+/* Acquires RW for reading, sleeping until no writer holds it and,
+   if RW prefers writers, none is waiting. */
+void
+rwlock_acquire_read (struct rwlock *rw) {
+	ASSERT (rw != NULL);
+	ASSERT (!intr_context ());
+
+	lock_acquire (&rw->lock);
+	lock_acquire (&rw->guard);
+	while (rw->prefer_writers && rw->writers > 0) {
+		lock_release (&rw->guard);
+		cond_wait (&rw->no_writers, &rw->lock);
+		lock_acquire (&rw->guard);
+	}
+	rw->readers++;
+	lock_release (&rw->guard);
+	lock_release (&rw->lock);
+}
+
+/* Tries to acquire RW for reading without waiting for a writer.
+   Returns true if successful, false on failure. */
+bool
+rwlock_try_acquire_read (struct rwlock *rw) {
+	bool success;
+
+	ASSERT (rw != NULL);
+
+	if (!lock_try_acquire (&rw->lock))
+		return false;
+	lock_acquire (&rw->guard);
+	success = !rw->prefer_writers || rw->writers == 0;
+	if (success)
+		rw->readers++;
+	lock_release (&rw->guard);
+	lock_release (&rw->lock);
+	return success;
+}
+
+/* Releases RW, which the current thread acquired for reading. */
+void
+rwlock_release_read (struct rwlock *rw) {
+	ASSERT (rw != NULL);
+
+	lock_acquire (&rw->guard);
+	ASSERT (rw->readers > 0);
+	if (--rw->readers == 0)
+		cond_signal (&rw->no_readers, &rw->guard);
+	lock_release (&rw->guard);
+}
+
+/* Acquires RW for writing, sleeping until no other thread holds
+   it.  RW must not already be held by the current thread. */
+void
+rwlock_acquire_write (struct rwlock *rw) {
+	ASSERT (rw != NULL);
+	ASSERT (!intr_context ());
+
+	lock_acquire (&rw->guard);
+	rw->writers++;
+	lock_release (&rw->guard);
+
+	/* Holding LOCK keeps new readers out while the ones inside
+	   finish. */
+	lock_acquire (&rw->lock);
+	lock_acquire (&rw->guard);
+	rw->writers--;
+	while (rw->readers > 0)
+		cond_wait (&rw->no_readers, &rw->guard);
+	lock_release (&rw->guard);
+}
+
+/* Tries to acquire RW for writing without waiting for other
+   threads.  Returns true if successful, false on failure. */
+bool
+rwlock_try_acquire_write (struct rwlock *rw) {
+	bool success;
+
+	ASSERT (rw != NULL);
+
+	if (!lock_try_acquire (&rw->lock))
+		return false;
+	lock_acquire (&rw->guard);
+	success = rw->readers == 0;
+	lock_release (&rw->guard);
+	if (!success)
+		lock_release (&rw->lock);
+	return success;
+}
+
+/* Releases RW, which the current thread holds for writing. */
+void
+rwlock_release_write (struct rwlock *rw) {
+	ASSERT (rw != NULL);
+	ASSERT (rwlock_held_for_write (rw));
+
+	lock_acquire (&rw->guard);
+	if (rw->prefer_writers && rw->writers == 0)
+		cond_broadcast (&rw->no_writers, &rw->lock);
+	lock_release (&rw->guard);
+	lock_release (&rw->lock);
+}
+
+/* Returns true if the current thread holds RW for writing, false
+   otherwise.  Whether a thread holds RW for reading is not
+   recorded. */
+bool
+rwlock_held_for_write (const struct rwlock *rw) {
+	ASSERT (rw != NULL);
+
+	return lock_held_by_current_thread (&rw->lock);
+}
+
 bool
 cmp_sem_priority(const struct list_elem *a, const struct list_elem *b, void *aux UNUSED){
    int i = 0;
@@ -226,19 +226,8 @@ thread_create (const char *name, int priority,
 	list_push_back(&parent->child_list,&t->child_elem); // parent child 리스트에 생성한 child를 담는다
 
 	/* project 2 : File Descriptor */
-	/*
-	1) fd 값 초기화(0,1은 표준 입력, 출력) -> fdtable배열로 받았으므로 바로 값 넣어주면된다.
-	2) File Descriptor 테이블에 메모리 할당 -> malloc ?, calloc ?, memcpy, palloc?
-	*/
-
-	// Table이 배열로 받으므로 multiple을 쓰는 것 같다는 추측.
-	t->fd_table = palloc_get_multiple(PAL_ZERO, FDT_PAGES);
-	if(t->fd_table == NULL)
-		return TID_ERROR;
-
-	t->fd_table[0] = 1;
-	t->fd_table[1] = 2;
-	t->fd_idx = 2; // idx 2로 초기화
+	/* The fd table is made only once T becomes a user process, by
+	 * process_init() or __do_fork(). */
 
 	//count 초기화
 	t->stdin_count = 1;
@@ -7,6 +7,7 @@
 #include <string.h>
 #include "userprog/gdt.h"
 #include "userprog/tss.h"
+#include "userprog/syscall.h"
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
@@ -32,13 +33,14 @@ static void initd (void *f_name);
 static void __do_fork (void *);
 
 /* General process initializer for initd and other process. */
-static void
+static bool
 process_init (void) {
-	struct thread *current = thread_current ();
-
 	/* project 2 : Denying Write to Executable */
 	/* 파일 사용 시 lock 초기화 */
 	// lock_init(&deny_write_lock);
+
+	/* project 2 : File Descriptor */
+	return fdt_init ();
 }
 
 /* Starts the first userland program, called "initd", loaded from FILE_NAME.
@@ -80,9 +82,7 @@ initd (void *f_name) {
 	supplemental_page_table_init (&thread_current ()->spt);
 #endif
 
-	process_init ();
-	
-	if (process_exec (f_name) < 0)
+	if (!process_init () || process_exec (f_name) < 0)
 		PANIC("Fail to launch initd\n");
 	NOT_REACHED ();
 }
@@ -221,21 +221,9 @@ __do_fork (void *aux) {
 	 * TODO:       from the fork() until this function successfully duplicates
 	 * TODO:       the resources of parent.*/
 
-	if (parent->fd_idx >= FDCOUNT_LIMIT)
+	if (!fdt_duplicate (parent))
 		goto error;
-	
-	current->fd_table[0] = parent->fd_table[0]; // stdin
-	current->fd_table[1] = parent->fd_table[1]; // stdout
-
-	for (int i = 2 ; i < FDCOUNT_LIMIT ;i++ ){
-		struct file *f = parent->fd_table[i];
-		if (f == NULL){
-			continue;
-		}
-		current->fd_table[i] = file_duplicate(f);
-	}
 
-	current->fd_idx = parent->fd_idx;
 	// if child loaded successfully, wake up parent in process_fork
 	sema_up(&current->fork_sema);
 	// process_init ();
@@ -419,13 +407,8 @@ process_exit (void) {
 	 * TODO: project2/process_termination.html).
 	 * TODO: We recommend you to implement process resource cleanup here. */
 
-	// close all opened files
-	for (int i=0; i<FDCOUNT_LIMIT; i++)
-	{
-		close(i);
-	}
-    
-	palloc_free_multiple(curr->fd_table, FDT_PAGES); 	// for multi-oom(메모리 누수)
+	// close all opened files and free the fd table
+	fdt_destroy ();
 	file_close(curr->running); 	// for rox- (실행중에 수정 못하도록)
 
 	process_cleanup (); // pml4를 날림(이 함수를 call 한 thread의 pml4)
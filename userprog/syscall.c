@@ -14,8 +14,12 @@
 #include "userprog/process.h"
 #include "kernel/stdio.h"
 #include "threads/palloc.h"
+#include "threads/malloc.h"
+#include <round.h>
+#include <string.h>
 /* ------------------------------- */
 #include "vm/vm.h"
+#include "vm/ksm.h"
 
 
 /* System call.
@@ -61,7 +65,7 @@ int add_file_to_fdt(struct file *file);
 void remove_file_from_fdt(int fd);
 
 /* project 3 */
-void check_buf(void *addr);
+void check_buf(void *addr, unsigned size);
 
 void
 syscall_init (void) {
@@ -74,9 +78,6 @@ syscall_init (void) {
 	 * mode stack. Therefore, we masked the FLAG_FL. */
 	write_msr(MSR_SYSCALL_MASK,
 			FLAG_IF | FLAG_TF | FLAG_DF | FLAG_IOPL | FLAG_AC | FLAG_NT);
-	
-	/* 파일 사용 시 lock 초기화 */
-	lock_init(&filesys_lock);
 }
 
 /* The main system call interface */
@@ -189,15 +190,26 @@ check_address(void *addr)
 
 }
 
-void check_buf(void *addr){
+/* Kills the process if the SIZE bytes at ADDR, which the kernel is
+ * about to write, cover a read-only page.  Merged pages get a private
+ * frame first.  The check stops at the first page the process does
+ * not have, as the write faults there anyway. */
+void check_buf(void *addr, unsigned size){
 	struct thread *t = thread_current();
+	void *upage;
 
-	struct page *p = spt_find_page(&t->spt, addr);
-	if(p!=NULL && !p->writable){
-		// printf(">> p->writable : %d\n",p->writable);
-		exit(-1);
+	for (upage = pg_round_down (addr); upage < addr + size; upage += PGSIZE) {
+		struct page *p = spt_find_page(&t->spt, upage);
+		if (p == NULL)
+			break;
+		if(!p->writable){
+			exit(-1);
+		}
+#ifdef VM
+		if (ksm_enabled)
+			ksm_unshare (p);
+#endif
 	}
-
 }
 
 
@@ -273,50 +285,178 @@ int wait(tid_t pid)
 
 /* Project 2 : File Descriptor */
 
+/* File descriptor tables exist only for user processes: initd gets
+ * one in process_init() and a child in fork gets a copy of its
+ * parent's.  A table starts with FDT_INIT_CNT slots and doubles when
+ * it fills up, up to FDCOUNT_LIMIT.  Bit FD of fd_used is set while
+ * slot FD is taken, and no fd below fd_idx is free, so the lowest
+ * free fd is found a word at a time from fd_idx on. */
+
+#define FDT_WORD_BITS 64
+#define FDT_WORDS(CNT) DIV_ROUND_UP (CNT, FDT_WORD_BITS)
+
+/* Gives T an empty table of CNT slots. */
+static bool
+fdt_alloc (struct thread *t, int cnt) {
+	t->fd_table = calloc (cnt, sizeof *t->fd_table);
+	t->fd_used = calloc (FDT_WORDS (cnt), sizeof *t->fd_used);
+	if (t->fd_table == NULL || t->fd_used == NULL) {
+		free (t->fd_table);
+		free (t->fd_used);
+		t->fd_table = NULL;
+		t->fd_used = NULL;
+		return false;
+	}
+	t->fd_cnt = cnt;
+	t->fd_idx = 0;
+	t->fd_end = 0;
+	return true;
+}
+
+/* Doubles the number of slots of T's table. */
+static bool
+fdt_grow (struct thread *t) {
+	int cnt = t->fd_cnt * 2 < FDCOUNT_LIMIT ? t->fd_cnt * 2 : FDCOUNT_LIMIT;
+	struct file **table;
+	uint64_t *used;
+
+	if (t->fd_cnt >= FDCOUNT_LIMIT)
+		return false;
+	if (FDT_WORDS (cnt) > FDT_WORDS (t->fd_cnt)) {
+		used = realloc (t->fd_used, FDT_WORDS (cnt) * sizeof *used);
+		if (used == NULL)
+			return false;
+		memset (used + FDT_WORDS (t->fd_cnt), 0,
+				(FDT_WORDS (cnt) - FDT_WORDS (t->fd_cnt)) * sizeof *used);
+		t->fd_used = used;
+	}
+	table = realloc (t->fd_table, cnt * sizeof *table);
+	if (table == NULL)
+		return false;
+	memset (table + t->fd_cnt, 0, (cnt - t->fd_cnt) * sizeof *table);
+	t->fd_table = table;
+	t->fd_cnt = cnt;
+	return true;
+}
+
+/* Puts FILE in free slot FD of T's table. */
+static void
+fdt_install (struct thread *t, int fd, struct file *file) {
+	t->fd_table[fd] = file;
+	t->fd_used[fd / FDT_WORD_BITS] |= 1ULL << (fd % FDT_WORD_BITS);
+	if (fd >= t->fd_end)
+		t->fd_end = fd + 1;
+}
+
+/* Gives the current thread, which is becoming a user process, its
+ * fd table, with the console as fds 0 and 1. */
+bool
+fdt_init (void) {
+	struct thread *cur = thread_current ();
+
+	if (!fdt_alloc (cur, FDT_INIT_CNT))
+		return false;
+	fdt_install (cur, 0, (struct file *) (uintptr_t) STDIN);
+	fdt_install (cur, 1, (struct file *) (uintptr_t) STDOUT);
+	cur->fd_idx = 2;
+	return true;
+}
+
+/* Gives the current thread a copy of PARENT's fd table, duplicating
+ * its open files.  Only the slots below PARENT's fd_end are copied,
+ * into a table just large enough for them. */
+bool
+fdt_duplicate (struct thread *parent) {
+	struct thread *cur = thread_current ();
+	int cnt = FDT_INIT_CNT;
+	int fd;
+
+	while (cnt < parent->fd_end)
+		cnt *= 2;
+	if (!fdt_alloc (cur, cnt < FDCOUNT_LIMIT ? cnt : FDCOUNT_LIMIT))
+		return false;
+	for (fd = 0; fd < parent->fd_end; fd++) {
+		struct file *file = parent->fd_table[fd];
+
+		if (file == NULL)
+			continue;
+		/* fds 0 and 1 are the console, not files. */
+		if (fd > 1 && (file = file_duplicate (file)) == NULL)
+			return false;
+		fdt_install (cur, fd, file);
+	}
+	cur->fd_idx = parent->fd_idx;
+	return true;
+}
+
+/* Closes every fd of the current thread and frees its table. */
+void
+fdt_destroy (void) {
+	struct thread *cur = thread_current ();
+	int fd;
+
+	if (cur->fd_table == NULL)
+		return;
+	for (fd = cur->fd_end - 1; fd >= 0; fd--)
+		close (fd);
+	free (cur->fd_table);
+	free (cur->fd_used);
+	cur->fd_table = NULL;
+	cur->fd_used = NULL;
+	cur->fd_cnt = 0;
+}
+
 struct file *find_file_by_fd(int fd)
 {
-	if (fd < 0 || fd >= FDCOUNT_LIMIT){
+	struct thread *cur = thread_current();
+
+	if (fd < 0 || fd >= cur->fd_cnt){
 		return NULL;
 	}
 	
-	struct thread *cur = thread_current();
-	
 	return cur->fd_table[fd];
 }
 
 /* 
 파일 객체(struct File)를 File Descriptor 테이블에 추가
-현재 스레드의 fd_idx(file descriptor Table index 끝값) 반환
+비어 있는 가장 작은 fd 반환, 테이블이 가득 차면 두 배로 늘린다
 */
 int add_file_to_fdt(struct file *file)
 {
-    struct thread *cur = thread_current();
-    struct file **fdt = cur->fd_table;
-
-    // Find open spot from the front
-    // fd 위치가 제한 범위 넘지않고, fd table의 인덱스 위치와 일치한다면
-    while (cur->fd_idx < FDCOUNT_LIMIT && fdt[cur->fd_idx])
-    {
-        cur->fd_idx++;
-    }
-
-    // error - fd table full
-    if (cur->fd_idx >= FDCOUNT_LIMIT){
-        return -1;
+	struct thread *cur = thread_current();
+	int words = FDT_WORDS (cur->fd_cnt);
+	int i = cur->fd_idx / FDT_WORD_BITS;
+	int fd;
+
+	// Find the first word with a free fd, from fd_idx on
+	while (i < words && cur->fd_used[i] == UINT64_MAX)
+		i++;
+	fd = i * FDT_WORD_BITS;
+	if (i < words)
+		fd += __builtin_ctzll (~cur->fd_used[i]);
+
+	// error - fd table full and cannot grow
+	if (fd >= cur->fd_cnt && !fdt_grow (cur)){
+		return -1;
 	}
-    fdt[cur->fd_idx] = file;
-    return cur->fd_idx;
+	fdt_install (cur, fd, file);
+	cur->fd_idx = fd + 1;
+	return fd;
 }
 
 void remove_file_from_fdt(int fd)
 {
 	struct thread *cur = thread_current();
-	if (fd < 0 || fd >= FDCOUNT_LIMIT){
+	if (fd < 0 || fd >= cur->fd_cnt){
 		return;
 	}
 
 	cur->fd_table[fd] = NULL;
-
+	cur->fd_used[fd / FDT_WORD_BITS] &= ~(1ULL << (fd % FDT_WORD_BITS));
+	if (fd < cur->fd_idx)
+		cur->fd_idx = fd;
+	while (cur->fd_end > 0 && cur->fd_table[cur->fd_end - 1] == NULL)
+		cur->fd_end--;
 }
 /*
 open(file) -> filesys_open(file) -> file_open(inode) -> file
@@ -327,7 +467,6 @@ file_obj = file이 되고, 이를 현재 스레드 파일 디스크립터 테이
 int open(const char *file) // 파일 객체에 대한 파일 디스크립터 부여
 {
 	check_address(file);
-	lock_acquire(&filesys_lock);
 
 	struct file *file_obj = filesys_open(file);
 	// printf("=== open ===\n");
@@ -349,7 +488,6 @@ int open(const char *file) // 파일 객체에 대한 파일 디스크립터 부
 		file_close(file_obj);
 	}
 
-	lock_release(&filesys_lock);
 	return fd;
 
 }
@@ -385,7 +523,7 @@ int read(int fd, void *buffer, unsigned size)
 	
 	check_address(buffer);
 	check_address(buffer+size-1);
-	check_buf(buffer);
+	check_buf(buffer, size);
 	int read_count; // 글자수 카운트 용(for문 사용하기 위해)
 	struct thread *cur = thread_current();
 	struct file *file_obj = find_file_by_fd(fd);
@@ -414,9 +552,7 @@ int read(int fd, void *buffer, unsigned size)
 	}
 	
 	else {
-			lock_acquire(&filesys_lock);
-			read_count = file_read(file_obj,buffer, size); // 여기서만 lock을 이용하는 이유?, 키보드 입력 받을 때는 왜 안하는지?
-			lock_release(&filesys_lock);
+			read_count = file_read(file_obj,buffer, size);
 	}
 
 	
@@ -451,9 +587,7 @@ int write(int fd, void *buffer, unsigned size)
 	}
 	
 	else {
-			lock_acquire(&filesys_lock);
 			read_count = file_write(file_obj,buffer, size);
-			lock_release(&filesys_lock);
 	}
 	return read_count;
 
@@ -1,8 +1,17 @@
 /* anon.c: Implementation of page for non-disk image (a.k.a. anonymous page). */
 
 #include "vm/vm.h"
+#include "vm/ksm.h"
+#include "vm/zswap.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
 #include "devices/disk.h"
+#include "devices/timer.h"
+#include "filesys/filesys.h"
 #include "lib/kernel/bitmap.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
 
 /* DO NOT MODIFY BELOW LINE */
 static struct disk *swap_disk;
@@ -18,22 +27,85 @@ static const struct page_operations anon_ops = {
 	.type = VM_ANON,
 };
 
+/* Swap disks, given by the -swap option as a comma-separated list of
+ * disk names, such as hd1:1 or the RAM disk rd0, hd1:1 by default.
+ * The "hd" may be left out.  Each disk is divided into
+ * page-sized slots, which are handed out round-robin across the
+ * disks: consecutive swap-outs, usually by different threads, go to
+ * different disks and, if those sit on different channels, proceed
+ * at the same time. */
+const char *swap_disk_spec;
+
+/* Most swap disks. */
+#define SWAP_DISK_MAX 4
+
+/* Sectors per swap slot. */
+#define SLOT_SECTORS (PGSIZE / DISK_SECTOR_SIZE)
+
+struct swap_disk {
+	struct disk *disk;
+	struct bitmap *slots;   /* One bit per slot, true if in use. */
+};
+
 struct swap_table {
-	struct lock lock;		// 동기화를 위한 lock
-	struct bitmap *bitmap;	// 스왑슬롯의 가용여부를 나타내기위한 bitmap
+	struct lock lock;       /* Protects the slot bitmaps and NEXT. */
+	struct swap_disk disks[SWAP_DISK_MAX];
+	size_t disk_cnt;
+	size_t next;            /* Disk to try first for the next slot. */
 };
 
 struct swap_table swap_table;
 
+/* Adds disk D as a swap disk. */
+static void
+add_swap_disk (struct disk *d) {
+	struct swap_disk *sd;
+	size_t i;
+
+	if (d == filesys_disk)
+		PANIC ("%s is the file system disk", disk_name (d));
+	for (i = 0; i < swap_table.disk_cnt; i++)
+		if (swap_table.disks[i].disk == d)
+			PANIC ("%s given twice as swap disk", disk_name (d));
+	if (swap_table.disk_cnt >= SWAP_DISK_MAX)
+		PANIC ("more than %d swap disks", SWAP_DISK_MAX);
+
+	sd = &swap_table.disks[swap_table.disk_cnt++];
+	sd->disk = d;
+	sd->slots = bitmap_create (disk_size (d) / SLOT_SECTORS);
+	if (sd->slots == NULL)
+		PANIC ("swap disk %s: out of memory", disk_name (d));
+}
+
 /* Initialize the data for anonymous pages */
 void
 vm_anon_init (void) {
-	/* TODO: Set up the swap_disk. */
-	swap_disk = disk_get (1, 1); 
-	if (swap_disk == NULL) return;
 	lock_init (&swap_table.lock);
-	swap_table.bitmap = bitmap_create (disk_size (swap_disk)/8);	// page align
-	// printf ("swap disk size: %d\n", disk_size(swap_disk)/8);
+	zswap_init ();
+	if (swap_disk_spec == NULL) {
+		swap_disk = disk_get (1, 1);
+		if (swap_disk == NULL)
+			return;
+		add_swap_disk (swap_disk);
+	} else {
+		char *spec = (char *) swap_disk_spec;
+		char *name, *save_ptr;
+
+		for (name = strtok_r (spec, ",", &save_ptr); name != NULL;
+				name = strtok_r (NULL, ",", &save_ptr)) {
+			char full[16];
+			struct disk *d;
+
+			snprintf (full, sizeof full, "%s%s",
+					isdigit (name[0]) ? "hd" : "", name);
+			d = disk_find (full);
+			if (d == NULL)
+				PANIC ("swap disk %s not found", full);
+			add_swap_disk (d);
+		}
+		if (swap_table.disk_cnt > 0)
+			swap_disk = swap_table.disks[0].disk;
+	}
 }
 
 /* Initialize the file mapping */
@@ -49,70 +121,250 @@ anon_initializer (struct page *page, enum vm_type type, void *kva) {
 		anon_page->is_stack = 0;
 	// printf("anon_initializer FINISH \n");
 	anon_page->sec_no_idx = NULL;
+	anon_page->swap = ANON_RESIDENT;
+	anon_page->zswap = NULL;
+	anon_page->ksm = NULL;
+	anon_page->ksm_checksum = 0;
 
 	return true;
 	
 }
 
-/* Swap in the page by read contents from the swap disk. */
+/* Takes a free swap slot, trying the disks round-robin, and returns
+ * its number, or BITMAP_ERROR if all disks are full.  Slot numbers
+ * encode the disk as SLOT * SWAP_DISK_MAX + disk index. */
+static uint64_t
+slot_alloc (void) {
+	uint64_t slot = BITMAP_ERROR;
+	size_t i;
+
+	lock_acquire (&swap_table.lock);
+	for (i = 0; i < swap_table.disk_cnt; i++) {
+		size_t idx = (swap_table.next + i) % swap_table.disk_cnt;
+		size_t n = bitmap_scan_and_flip (swap_table.disks[idx].slots, 0, 1,
+				false);
+
+		if (n != BITMAP_ERROR) {
+			swap_table.next = (idx + 1) % swap_table.disk_cnt;
+			slot = (uint64_t) n * SWAP_DISK_MAX + idx;
+			break;
+		}
+	}
+	lock_release (&swap_table.lock);
+	return slot;
+}
+
+/* Releases swap slot SLOT. */
+static void
+slot_free (uint64_t slot) {
+	struct swap_disk *sd = &swap_table.disks[slot % SWAP_DISK_MAX];
+
+	lock_acquire (&swap_table.lock);
+	ASSERT (bitmap_test (sd->slots, slot / SWAP_DISK_MAX));
+	bitmap_reset (sd->slots, slot / SWAP_DISK_MAX);
+	lock_release (&swap_table.lock);
+}
+
+/* Reads or writes the page at KVA from or to swap slot SLOT.  The
+ * sectors of the page are transferred with one command. */
+static void
+slot_io (uint64_t slot, void *kva, bool write) {
+	struct swap_disk *sd = &swap_table.disks[slot % SWAP_DISK_MAX];
+	disk_sector_t sector = slot / SWAP_DISK_MAX * SLOT_SECTORS;
+	enum disk_origin origin = disk_set_origin (DISK_IO_SWAP);
+
+	if (write)
+		disk_write_multi (sd->disk, sector, kva, SLOT_SECTORS);
+	else
+		disk_read_multi (sd->disk, sector, kva, SLOT_SECTORS);
+	disk_set_origin (origin);
+}
+
+/* Swap in the page by read contents from zswap or the swap disk. */
 static bool
 anon_swap_in (struct page *page, void *kva) {
-	// printf ("im in anon swap in!\n");
 	struct anon_page *anon_page = &page->anon;
-	int cnt = 0;
-	uint64_t temp_sec_idx = anon_page->sec_no_idx;
-	void *temp_kva = kva;
-	while (cnt < 8) {
-		disk_read (swap_disk, temp_sec_idx * 8 + cnt, temp_kva);
-		cnt += 1;
-		temp_kva += 512;
+
+	if (anon_page->swap == ANON_IN_ZSWAP)
+		zswap_load (anon_page->zswap, kva);
+	else {
+		slot_io (anon_page->sec_no_idx, kva, false);
+		slot_free (anon_page->sec_no_idx);
+		zswap_count_disk_load ();
 	}
-	// disk_read (swap_disk, anon_page->sec_no_idx, kva);
-	bitmap_set_multiple (swap_table.bitmap, anon_page->sec_no_idx, 1, false);
+	anon_page->swap = ANON_RESIDENT;
+	anon_page->zswap = NULL;
+	return true;
 }
 
-/* Swap out the page by writing contents to the swap disk. */
+/* Swap out the page by compressing it into zswap or, if zswap
+ * refuses it, writing contents to the swap disk. */
 static bool
 anon_swap_out (struct page *page) {
-	// printf ("im in anon swap out!\n");
 	struct anon_page *anon_page = &page->anon;
-	lock_acquire (&swap_table.lock);
-	uint64_t sec_no_idx = bitmap_scan_and_flip (swap_table.bitmap, 0, 1, false);
-	// printf("sec_no_idx: %d\n", sec_no_idx);
-	lock_release (&swap_table.lock);
 
-	if (sec_no_idx != BITMAP_ERROR) {
-		int cnt = 0;
-		void *temp_kva = page->frame->kva;
-		while (cnt < 8) {
-			disk_write (swap_disk, sec_no_idx * 8 + cnt, temp_kva);
-			cnt += 1;
-			temp_kva += 512;
-		}
-		// disk_write (swap_disk, sec_no_idx, page->frame->kva);
-		struct thread *cur = thread_current ();
-		pml4_clear_page (cur->pml4, page->va);
-		anon_page->sec_no_idx = sec_no_idx;
-		// printf("swap out finish ++++++++\n");
-		return true;
+	if (zswap_store (page->frame->kva, &anon_page->zswap))
+		anon_page->swap = ANON_IN_ZSWAP;
+	else {
+		uint64_t slot = slot_alloc ();
+
+		if (slot == BITMAP_ERROR)
+			PANIC ("swap out error!\n");
+		slot_io (slot, page->frame->kva, true);
+		anon_page->sec_no_idx = slot;
+		anon_page->swap = ANON_ON_DISK;
 	}
-	else
-		PANIC ("swap out error!\n");
+	/* The evicting thread need not be the one the page belongs to. */
+	pml4_clear_page (page->owner->pml4, page->va);
+	return true;
 }
 
 /* Destroy the anonymous page. PAGE will be freed by the caller. */
 static void
 anon_destroy (struct page *page) {
 	struct anon_page *anon_page = &page->anon;
-	if(page->frame){
+	/* A merged page's frame is shared; ksm_release() lets go of it. */
+	if (!ksm_release (page) && page->frame) {
 		lock_acquire(&frame_table.lock);
 		list_remove(&page->frame->frame_elem);
 		lock_release(&frame_table.lock);
 		free(page->frame);
 	}
+	if (anon_page->swap == ANON_IN_ZSWAP)
+		zswap_free (anon_page->zswap);
+	else if (anon_page->swap == ANON_ON_DISK)
+		slot_free (anon_page->sec_no_idx);
 	
 	// palloc_free_page(page->frame->kva); //-> pml4에서 pte로 받아서 없애는데 여기서 없애버리면 오류난다!
 	// if (page->frame) free(page->frame);
 	// if (page->uninit.aux != NULL) free (page->uninit.aux);
 	return;
 }
+
+/* swapbench: measures the throughput of the swap disks, alone and
+ * together, for page-sized transfers to scattered slots.  Swapping
+ * while files are read, through the file system and the page cache,
+ * is exercised by the vm/swap-read test. */
+
+/* Pages transferred per disk in each run. */
+#define BENCH_PAGES 256
+
+/* The page-sized transfers of one disk in a benchmark run. */
+struct bench_stream {
+	struct disk *disk;
+	disk_sector_t sectors[BENCH_PAGES];   /* First sector of each page. */
+	size_t cnt;
+	bool write;
+};
+
+/* Submits the transfers of the CNT streams in STREAMS, interleaved,
+ * waits for all of them and prints the throughput under NAME. */
+static void
+bench_run (const char *name, struct bench_stream *streams[], size_t cnt,
+		void *buffer) {
+	struct disk_request *reqs;
+	size_t i, j, n = 0, total = 0;
+	int64_t start, ticks;
+
+	for (i = 0; i < cnt; i++)
+		total += streams[i]->cnt;
+	if (total == 0)
+		return;
+	reqs = malloc (total * sizeof *reqs);
+	if (reqs == NULL) {
+		printf ("swapbench: out of memory\n");
+		return;
+	}
+
+	start = timer_ticks ();
+	for (j = 0; n < total; j++)
+		for (i = 0; i < cnt; i++)
+			if (j < streams[i]->cnt) {
+				disk_request_init (&reqs[n], streams[i]->disk,
+						streams[i]->sectors[j], buffer, SLOT_SECTORS,
+						streams[i]->write, NULL, NULL);
+				disk_submit (&reqs[n++]);
+			}
+	for (n = 0; n < total; n++)
+		disk_wait (&reqs[n]);
+	ticks = timer_elapsed (start);
+	if (ticks == 0)
+		ticks = 1;
+	free (reqs);
+
+	printf ("swapbench: %-28s %6zu kB in %4"PRId64" ticks, %6"PRId64" kB/s\n",
+			name, total * PGSIZE / 1024, ticks,
+			(int64_t) (total * PGSIZE / 1024) * TIMER_FREQ / ticks);
+}
+
+/* Runs the benchmark on the free slots of the swap disks. */
+void
+swap_bench (char **argv UNUSED) {
+	struct bench_stream *swaps[SWAP_DISK_MAX];
+	char name[32];
+	void *buffer;
+	size_t i, j;
+
+	if (swap_table.disk_cnt == 0) {
+		printf ("swapbench: no swap disk\n");
+		return;
+	}
+	buffer = palloc_get_page (PAL_ZERO);
+	if (buffer == NULL) {
+		printf ("swapbench: out of memory\n");
+		return;
+	}
+
+	/* Reserve up to BENCH_PAGES free slots on every swap disk, no two
+	 * of them adjacent: evicted pages land on scattered slots, while
+	 * consecutive slots would be merged into one disk command. */
+	lock_acquire (&swap_table.lock);
+	for (i = 0; i < swap_table.disk_cnt; i++) {
+		struct swap_disk *sd = &swap_table.disks[i];
+		size_t start = 0;
+
+		swaps[i] = calloc (1, sizeof *swaps[i]);
+		if (swaps[i] == NULL)
+			PANIC ("swapbench: out of memory");
+		swaps[i]->disk = sd->disk;
+		while (swaps[i]->cnt < BENCH_PAGES
+				&& start < bitmap_size (sd->slots)) {
+			size_t n = bitmap_scan_and_flip (sd->slots, start, 1, false);
+			if (n == BITMAP_ERROR)
+				break;
+			swaps[i]->sectors[swaps[i]->cnt++] = n * SLOT_SECTORS;
+			start = n + 2;
+		}
+	}
+	lock_release (&swap_table.lock);
+
+	/* Each disk alone, then all together. */
+	for (i = 0; i < swap_table.disk_cnt; i++) {
+		const char *disk = disk_name (swap_table.disks[i].disk);
+
+		swaps[i]->write = true;
+		snprintf (name, sizeof name, "%s write", disk);
+		bench_run (name, &swaps[i], 1, buffer);
+		swaps[i]->write = false;
+		snprintf (name, sizeof name, "%s read", disk);
+		bench_run (name, &swaps[i], 1, buffer);
+	}
+	if (swap_table.disk_cnt > 1) {
+		for (i = 0; i < swap_table.disk_cnt; i++)
+			swaps[i]->write = true;
+		bench_run ("all swap disks write", swaps, swap_table.disk_cnt, buffer);
+		for (i = 0; i < swap_table.disk_cnt; i++)
+			swaps[i]->write = false;
+		bench_run ("all swap disks read", swaps, swap_table.disk_cnt, buffer);
+	}
+
+	lock_acquire (&swap_table.lock);
+	for (i = 0; i < swap_table.disk_cnt; i++) {
+		for (j = 0; j < swaps[i]->cnt; j++)
+			bitmap_reset (swap_table.disks[i].slots,
+					swaps[i]->sectors[j] / SLOT_SECTORS);
+		free (swaps[i]);
+	}
+	lock_release (&swap_table.lock);
+	palloc_free_page (buffer);
+}
@@ -46,10 +46,7 @@ file_backed_initializer (struct page *page, enum vm_type type, void *kva) {
 static bool
 file_backed_swap_in (struct page *page, void *kva) {
 	struct file_page *file_page UNUSED = &page->file;
-	// ? lock 이거 ?
-	lock_acquire(&filesys_lock);
 	file_read_at (file_page->file, kva, file_page->read_bytes, file_page->ofs);
-	lock_release(&filesys_lock);
 	return true;
 }
 
@@ -57,12 +54,12 @@ file_backed_swap_in (struct page *page, void *kva) {
 static bool
 file_backed_swap_out (struct page *page) {
 	struct file_page *file_page UNUSED = &page->file;
-	struct thread *cur = thread_current ();
-	if (pml4_is_dirty (cur->pml4, page->va)) {
+	uint64_t *pml4 = page->owner->pml4;
+	if (pml4_is_dirty (pml4, page->va)) {
 		file_write_at (file_page->file, page->frame->kva, file_page->read_bytes, file_page->ofs);	// 쓰인 부분 다시 써줘야함
-		pml4_set_dirty (cur->pml4, page->va, false);
+		pml4_set_dirty (pml4, page->va, false);
 	}
-	pml4_clear_page(cur->pml4, page->va);
+	pml4_clear_page(pml4, page->va);
 	return true;
 }
 
@@ -0,0 +1,403 @@
+/* ksm.c: Merging of identical anonymous pages.
+ *
+ * When enabled with -ksm, the ksmd thread walks the frame table in
+ * the background, KSM_BATCH frames at a time.  It computes a checksum
+ * of each resident anonymous page and ignores pages whose checksum
+ * changed since the last visit, as they are being written.  A stable
+ * page is compared with the shared frame of the same checksum, if
+ * there is one, and merged into it when identical: the page is mapped
+ * read-only to the shared frame, and its own frame is freed.  If there
+ * is no shared frame yet but another page had the same checksum
+ * during the current pass, the page's own frame becomes the shared
+ * frame for the others to merge into.
+ *
+ * A write to a merged page raises a write-protect fault, and
+ * ksm_split() gives the page a private copy again; the last page of a
+ * shared frame simply takes the frame back.  CR0.WP is set, so writes
+ * by the kernel fault as well.  System calls that write into a user
+ * buffer still call ksm_unshare() first, so that the copy is not
+ * made in the middle of a file system operation.
+ *
+ * ksmd runs at PRI_DEFAULT, so that pages get merged while user
+ * processes compute; its cost is bounded by KSM_BATCH frames every
+ * KSM_INTERVAL ticks.
+ *
+ * Shared frames are not in the frame table, so they are never
+ * evicted.  KSM_LOCK serializes ksmd's work on a page with faults and
+ * destruction of the same page: a page being examined is write
+ * protected and its frame taken out of the frame table, so neither
+ * its owner nor the eviction clock can change it meanwhile. */
+
+#include "vm/ksm.h"
+#include <debug.h>
+#include <hash.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "vm/vm.h"
+
+/* -ksm: Run ksmd? */
+bool ksm_enabled;
+
+/* Frames examined per wakeup of ksmd, and ticks between wakeups. */
+#define KSM_BATCH 64
+#define KSM_INTERVAL (TIMER_FREQ / 10)
+
+/* A frame shared by identical pages. */
+struct ksm_node {
+	void *kva;                  /* The frame's page. */
+	uint64_t checksum;          /* Checksum of its contents. */
+	size_t ref_cnt;             /* Number of pages mapping it. */
+	struct hash_elem elem;      /* Element in stable. */
+};
+
+/* A checksum seen during the current pass. */
+struct ksm_seen {
+	uint64_t checksum;
+	struct hash_elem elem;      /* Element in unstable. */
+};
+
+static struct lock ksm_lock;    /* Protects everything below. */
+static struct hash stable;      /* Shared frames, by checksum. */
+static struct hash unstable;    /* Checksums seen in this pass. */
+
+/* Statistics. */
+static long long pass_cnt;      /* Complete passes over the frames. */
+static long long scan_cnt;      /* Pages examined. */
+static long long merge_cnt;     /* Pages merged. */
+static long long split_cnt;     /* Pages given back a private frame. */
+static long long scan_cycles;   /* CPU cycles spent examining pages. */
+static size_t shared_cnt;       /* Shared frames now. */
+static size_t sharing_cnt;      /* Pages mapping a shared frame now. */
+
+static void ksmd (void *aux);
+
+/* Reads the CPU's time stamp counter. */
+static inline uint64_t
+rdtsc (void) {
+	uint32_t lo, hi;
+
+	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+	return (uint64_t) hi << 32 | lo;
+}
+
+static uint64_t
+node_hash (const struct hash_elem *e, void *aux UNUSED) {
+	return hash_entry (e, struct ksm_node, elem)->checksum;
+}
+
+static bool
+node_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct ksm_node, elem)->checksum
+		< hash_entry (b, struct ksm_node, elem)->checksum;
+}
+
+static uint64_t
+seen_hash (const struct hash_elem *e, void *aux UNUSED) {
+	return hash_entry (e, struct ksm_seen, elem)->checksum;
+}
+
+static bool
+seen_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct ksm_seen, elem)->checksum
+		< hash_entry (b, struct ksm_seen, elem)->checksum;
+}
+
+static void
+seen_destroy (struct hash_elem *e, void *aux UNUSED) {
+	free (hash_entry (e, struct ksm_seen, elem));
+}
+
+/* Initializes same-page merging and starts ksmd if enabled. */
+void
+ksm_init (void) {
+	lock_init (&ksm_lock);
+	hash_init (&stable, node_hash, node_less, NULL);
+	hash_init (&unstable, seen_hash, seen_less, NULL);
+	if (ksm_enabled)
+		thread_create ("ksmd", PRI_DEFAULT, ksmd, NULL);
+}
+
+/* Returns the shared frame with CHECKSUM, or a null pointer. */
+static struct ksm_node *
+find_node (uint64_t checksum) {
+	struct ksm_node key;
+	struct hash_elem *e;
+
+	key.checksum = checksum;
+	e = hash_find (&stable, &key.elem);
+	return e != NULL ? hash_entry (e, struct ksm_node, elem) : NULL;
+}
+
+/* Records CHECKSUM as seen in this pass and returns true if it had
+ * been seen already. */
+static bool
+seen_before (uint64_t checksum) {
+	struct ksm_seen *seen = malloc (sizeof *seen);
+
+	if (seen == NULL)
+		return false;
+	seen->checksum = checksum;
+	if (hash_insert (&unstable, &seen->elem) != NULL) {
+		free (seen);
+		return true;
+	}
+	return false;
+}
+
+/* Takes the frame at the front of the frame table out of it, rotating
+ * past frames that are not resident anonymous user pages, and returns
+ * it, or a null pointer if none of the first CNT frames qualifies.
+ * *VISITED is increased by the number of frames looked at. */
+static struct frame *
+isolate_next (size_t cnt, size_t *visited) {
+	struct frame *f = NULL;
+
+	lock_acquire (&frame_table.lock);
+	while (cnt-- > 0 && !list_empty (&frame_table.frame_table)) {
+		struct list_elem *e = list_front (&frame_table.frame_table);
+
+		if (frame_table.clock_start_elem == e)
+			frame_table.clock_start_elem = list_prev (e);
+		list_remove (e);
+		(*visited)++;
+		f = list_entry (e, struct frame, frame_elem);
+		if (f->page != NULL && !f->pinned
+				&& VM_TYPE (f->page->operations->type) == VM_ANON
+				&& f->page->owner != NULL && f->page->owner->pml4 != NULL
+				&& pml4_get_page (f->page->owner->pml4, f->page->va) == f->kva)
+			break;
+		list_push_back (&frame_table.frame_table, e);
+		f = NULL;
+	}
+	lock_release (&frame_table.lock);
+	return f;
+}
+
+/* Puts frame F back into the frame table. */
+static void
+put_back (struct frame *f) {
+	lock_acquire (&frame_table.lock);
+	list_push_back (&frame_table.frame_table, &f->frame_elem);
+	lock_release (&frame_table.lock);
+}
+
+/* Maps PAGE to KVA in its owner's page table, writable if WRITABLE
+ * is true. */
+static void
+remap (struct page *page, void *kva, bool writable) {
+	uint64_t *pml4 = page->owner->pml4;
+
+	pml4_clear_page (pml4, page->va);
+	if (!pml4_set_page (pml4, page->va, kva, writable))
+		PANIC ("ksm: cannot remap page");
+}
+
+/* Examines isolated frame F.  Returns true if it was merged or became
+ * a shared frame, false if it should go back into the frame table.
+ * KSM_LOCK must be held. */
+static bool
+examine (struct frame *f) {
+	struct page *page = f->page;
+	struct anon_page *anon = &page->anon;
+	uint64_t *pml4 = page->owner->pml4;
+	struct ksm_node *node;
+	uint64_t checksum;
+
+	ASSERT (anon->ksm == NULL);
+
+	/* From here on, a write by the owner faults and waits for
+	 * KSM_LOCK. */
+	pml4_set_writable (pml4, page->va, false);
+	checksum = hash_bytes (f->kva, PGSIZE);
+	scan_cnt++;
+	if (checksum != anon->ksm_checksum) {
+		anon->ksm_checksum = checksum;
+		goto keep;
+	}
+
+	node = find_node (checksum);
+	if (node != NULL) {
+		if (memcmp (node->kva, f->kva, PGSIZE))
+			goto keep;
+		remap (page, node->kva, false);
+		palloc_free_page (f->kva);
+		f->kva = node->kva;
+		node->ref_cnt++;
+		sharing_cnt++;
+		merge_cnt++;
+	} else if (seen_before (checksum)) {
+		node = malloc (sizeof *node);
+		if (node == NULL)
+			goto keep;
+		node->kva = f->kva;
+		node->checksum = checksum;
+		node->ref_cnt = 1;
+		hash_insert (&stable, &node->elem);
+		shared_cnt++;
+		sharing_cnt++;
+	} else
+		goto keep;
+	anon->ksm = node;
+	return true;
+
+ keep:
+	pml4_set_writable (pml4, page->va, page->writable);
+	return false;
+}
+
+/* Background thread that merges identical pages. */
+static void
+ksmd (void *aux UNUSED) {
+	size_t pass_left = 0;
+
+	for (;;) {
+		size_t done = 0;
+
+		timer_sleep (KSM_INTERVAL);
+		while (done < KSM_BATCH) {
+			struct frame *f;
+			uint64_t start;
+			size_t visited = 0;
+
+			if (pass_left == 0) {
+				/* A new pass forgets the checksums of the last. */
+				lock_acquire (&ksm_lock);
+				hash_clear (&unstable, seen_destroy);
+				pass_cnt++;
+				lock_release (&ksm_lock);
+				lock_acquire (&frame_table.lock);
+				pass_left = list_size (&frame_table.frame_table);
+				lock_release (&frame_table.lock);
+				if (pass_left == 0)
+					break;
+			}
+
+			lock_acquire (&ksm_lock);
+			start = rdtsc ();
+			f = isolate_next (pass_left, &visited);
+			done += visited;
+			pass_left -= visited;
+			if (f != NULL && !examine (f))
+				put_back (f);
+			scan_cycles += rdtsc () - start;
+			lock_release (&ksm_lock);
+			if (f == NULL)
+				break;
+		}
+	}
+}
+
+/* Drops a reference to shared frame NODE.  With the last one, NODE
+ * is freed, and its frame too if FREE_FRAME is true; otherwise the
+ * caller keeps the frame.  KSM_LOCK must be held. */
+static void
+node_put (struct ksm_node *node, bool free_frame) {
+	ASSERT (node->ref_cnt > 0);
+
+	sharing_cnt--;
+	if (--node->ref_cnt == 0) {
+		hash_delete (&stable, &node->elem);
+		shared_cnt--;
+		if (free_frame)
+			palloc_free_page (node->kva);
+		free (node);
+	}
+}
+
+/* Handles a write-protect fault on anonymous PAGE.  Returns true if
+ * PAGE is now writable, so that the write may be retried. */
+bool
+ksm_split (struct page *page) {
+	struct frame *frame = NULL;
+	struct ksm_node *node;
+	bool success = true;
+
+	/* A new frame, if one will be needed, is obtained before taking
+	 * KSM_LOCK, as it may mean evicting a page.  A page merged after
+	 * this check simply faults again. */
+	if (page->anon.ksm != NULL && page->anon.ksm->ref_cnt > 1)
+		frame = vm_get_frame ();
+
+	lock_acquire (&ksm_lock);
+	node = page->anon.ksm;
+	if (node == NULL) {
+		/* ksmd let go of the page while we waited for KSM_LOCK. */
+		uint64_t *pte = pml4e_walk (page->owner->pml4, (uint64_t) page->va, 0);
+		success = pte != NULL && is_writable (pte);
+	} else if (node->ref_cnt == 1) {
+		/* The last page of a shared frame takes it back. */
+		node_put (node, false);
+		page->anon.ksm = NULL;
+		remap (page, page->frame->kva, true);
+		put_back (page->frame);
+		split_cnt++;
+	} else if (frame != NULL) {
+		memcpy (frame->kva, node->kva, PGSIZE);
+		node_put (node, true);
+		page->anon.ksm = NULL;
+		free (page->frame);
+		page->frame = frame;
+		frame->page = page;
+		remap (page, frame->kva, true);
+		frame->pinned = false;
+		frame = NULL;
+		split_cnt++;
+	}
+	lock_release (&ksm_lock);
+
+	if (frame != NULL)
+		vm_free_frame (frame);
+	return success;
+}
+
+/* Gives PAGE a private frame if it is merged, before the kernel
+ * writes to it on behalf of its owner. */
+void
+ksm_unshare (struct page *page) {
+	if (VM_TYPE (page->operations->type) == VM_ANON && page->anon.ksm != NULL)
+		ksm_split (page);
+}
+
+/* Called when anonymous PAGE is destroyed.  Returns true if PAGE was
+ * merged, in which case its frame has been released; otherwise the
+ * caller releases it.  In both cases ksmd is done with the page and
+ * will not pick it again. */
+bool
+ksm_release (struct page *page) {
+	struct ksm_node *node;
+
+	lock_acquire (&ksm_lock);
+	node = page->anon.ksm;
+	if (node != NULL) {
+		/* The page table must not free the shared frame. */
+		pml4_clear_page (page->owner->pml4, page->va);
+		node_put (node, true);
+		page->anon.ksm = NULL;
+		free (page->frame);
+		page->frame = NULL;
+	}
+	page->owner = NULL;
+	lock_release (&ksm_lock);
+	return node != NULL;
+}
+
+/* Prints same-page merging statistics, if ksmd ran. */
+void
+ksm_print_stats (void) {
+	if (!ksm_enabled)
+		return;
+	printf ("ksm: %lld passes, %lld pages examined in %lld kcycles"
+			" (%lld cycles per page)\n", pass_cnt, scan_cnt,
+			scan_cycles / 1000, scan_cnt > 0 ? scan_cycles / scan_cnt : 0);
+	printf ("ksm: %lld merges, %lld splits; %zu pages share %zu frames,"
+			" saving %zu frames\n", merge_cnt, split_cnt, sharing_cnt,
+			shared_cnt, sharing_cnt - shared_cnt);
+}
@@ -5,7 +5,11 @@
 #include "vm/inspect.h"
 #include "vm/anon.h"
 #include "vm/file.h"
+#include "vm/ksm.h"
 #include "userprog/process.h"
+#ifdef EFILESYS
+#include "filesys/buffer_cache.h"
+#endif
 
 unsigned page_hash (const struct hash_elem *p_, void *aux);
 bool page_less (const struct hash_elem *a_, const struct hash_elem *b_, void *aux);
@@ -27,7 +31,12 @@ vm_init (void) {
 	lock_init (&frame_table.lock);
 	list_init (&frame_table.frame_table);
 	frame_table.clock_start_elem = list_head(&frame_table.frame_table);
-
+	ksm_init ();
+#ifdef EFILESYS
+	/* The frame table is ready, so file system sectors can live in
+	 * page cache pages from now on. */
+	buffer_cache_enable_page_cache ();
+#endif
 }
 
 /* Returns a hash value for page p. */
@@ -105,6 +114,7 @@ vm_alloc_page_with_initializer (enum vm_type type, void *upage, bool writable,
 
 		uninit_new(page, upage, init, type, aux, initializer);
 		page->writable = writable;
+		page->owner = thread_current ();
 		// printf("in initializer >> p->writable : %d\n",page->writable);
 		bool succ = spt_insert_page(spt, page);
 		if (succ) return true;
@@ -153,18 +163,42 @@ spt_remove_page (struct supplemental_page_table *spt, struct page *page) {
 	return true;
 }
 
+/* Returns whether the page held by frame F was referenced since the
+ * last call, and clears that state.  Page cache pages are not mapped
+ * in any page table and track references themselves. */
+static bool
+frame_test_and_clear_accessed (struct frame *f) {
+	uint64_t *pml4;
+	bool accessed;
+
+#ifdef EFILESYS
+	if (VM_TYPE (f->page->operations->type) == VM_PAGE_CACHE) {
+		accessed = f->page->page_cache.accessed;
+		f->page->page_cache.accessed = false;
+		return accessed;
+	}
+#endif
+	/* The bit lives in the owner's page table, whichever thread runs
+	 * the clock. */
+	pml4 = f->page->owner->pml4;
+	accessed = pml4_is_accessed (pml4, f->page->va);
+	if (accessed)
+		pml4_set_accessed (pml4, f->page->va, false);
+	return accessed;
+}
+
 /* Get the struct frame, that will be evicted. */
 static struct frame *
 vm_get_victim (void) {
 	struct frame *victim = NULL;
 	 /* TODO: The policy for eviction is up to you. */
-	struct thread *cur = thread_current ();
 	lock_acquire (&frame_table.lock);
 	struct list_elem *e = frame_table.clock_start_elem;
 	while ((e = list_next (e)) != list_end (&frame_table.frame_table)) {
 		struct frame *f = list_entry (e, struct frame, frame_elem);
-		if (pml4_is_accessed (cur->pml4, f->page->va)) {
-			pml4_set_accessed(cur->pml4, f->page->va, false);
+		/* Frames still being set up have no page yet, or are pinned
+		 * until their contents are in. */
+		if (f->page == NULL || f->pinned || frame_test_and_clear_accessed (f)) {
 			if( (list_next(e)) == list_end(&frame_table.frame_table)){
 				e = list_head(&frame_table.frame_table);
 			}
@@ -195,6 +229,8 @@ static struct frame *
 vm_evict_frame (void) {
 	struct frame *victim UNUSED = vm_get_victim ();
 	struct thread *cur = thread_current();
+	if (victim == NULL)
+		return NULL;
 	/* TODO: swap out the victim and return the evicted frame. */
 	// printf ("im in vm_evict_frame (%p)\n", victim);
 	// printf ("im in vm_evict_frame page (%p)\n", victim->page);
@@ -207,14 +243,19 @@ vm_evict_frame (void) {
 		// print("swap out finish +++++ \n");
 		return victim;
 	}
+	/* The page refused to leave (it is in use); keep the frame in the
+	 * table so it is considered again later. */
+	lock_acquire (&frame_table.lock);
+	list_push_back (&frame_table.frame_table, &victim->frame_elem);
+	lock_release (&frame_table.lock);
 	return NULL;
 }
 
 /* palloc() and get frame. If there is no available page, evict the page
  * and return it. This always return valid address. That is, if the user pool
  * memory is full, this function evicts the frame to get the available memory
- * space.*/
-static struct frame * // 여기서 얻은 frame을 담을 frame page table을 구현해줘야할 것 같은데?
+ * space.  The frame is pinned until the caller clears PINNED. */
+struct frame * // 여기서 얻은 frame을 담을 frame page table을 구현해줘야할 것 같은데?
 vm_get_frame (void) {
 
 	struct frame *frame = (struct frame *)malloc(sizeof(struct frame));
@@ -224,12 +265,15 @@ vm_get_frame (void) {
 		while (frame->kva == NULL) {
 			struct frame *victim = vm_evict_frame ();
 			if (victim) {
-				victim->page->frame = NULL;
+				/* The page may already own a new frame by now. */
+				if (victim->page->frame == victim)
+					victim->page->frame = NULL;
 				free (victim);
 				frame->kva = palloc_get_page(PAL_USER);
 			}
 		}
 		frame->page = NULL;
+		frame->pinned = true;
 		// printf ("im in vm get frame before push back\n");
 		lock_acquire (&frame_table.lock);
 		list_push_back(&frame_table.frame_table, &frame->frame_elem);
@@ -245,6 +289,19 @@ vm_get_frame (void) {
 	return frame;
 }
 
+/* Frees FRAME, obtained from vm_get_frame() and not used by any
+ * page. */
+void
+vm_free_frame (struct frame *frame) {
+	lock_acquire (&frame_table.lock);
+	if (frame_table.clock_start_elem == &frame->frame_elem)
+		frame_table.clock_start_elem = list_prev (&frame->frame_elem);
+	list_remove (&frame->frame_elem);
+	lock_release (&frame_table.lock);
+	palloc_free_page (frame->kva);
+	free (frame);
+}
+
 /* Growing the stack. */
 // static void
 static void
@@ -257,9 +314,15 @@ vm_stack_growth (void *addr UNUSED) {
 
 }
 
-/* Handle the fault on write_protected page */
+/* Handle the fault on write_protected page.  Returns true if the
+ * access may be retried: PAGE shared a frame with identical pages
+ * and now has a copy of its own. */
 static bool
-vm_handle_wp (struct page *page UNUSED) {
+vm_handle_wp (struct page *page) {
+	if (page == NULL || !page->writable
+			|| VM_TYPE (page->operations->type) != VM_ANON)
+		return false;
+	return ksm_split (page);
 }
 
 /* Return true on success */
@@ -287,6 +350,8 @@ vm_try_handle_fault (struct intr_frame *f UNUSED, void *addr UNUSED,
 	// printf ("im in page fault : %p\n", addr);
 	if(!not_present){
 		// printf ("	!not present\n");
+		if (write && vm_handle_wp (spt_find_page (spt, addr)))
+			return true;
 		exit (-1);
 	}
 
@@ -343,6 +408,22 @@ vm_claim_page (void *va UNUSED) {
 
 	
 
+/* Claims a frame for PAGE, which belongs to the kernel and is not
+ * mapped in any page table, and fills it with swap_in.  Used by the
+ * page cache. */
+bool
+vm_claim_kernel_page (struct page *page) {
+	struct frame *frame = vm_get_frame ();
+
+	bool success;
+
+	frame->page = page;
+	page->frame = frame;
+	success = swap_in (page, frame->kva);
+	frame->pinned = false;
+	return success;
+}
+
 /* Claim the PAGE and set up the mmu. */
 static bool
 vm_do_claim_page (struct page *page) {
@@ -355,12 +436,14 @@ vm_do_claim_page (struct page *page) {
 	frame->page = page;
 	page->frame = frame;
 	// printf("pml4_set_page start \n");
+	bool success = false;
 	if (pml4_get_page(curr->pml4, page->va) == NULL
 		&& pml4_set_page (curr->pml4, page->va, frame->kva, page->writable))
 		// printf("pml4_set_page finish \n");
-		return swap_in (page, frame->kva);
+		success = swap_in (page, frame->kva);
 	/* TODO: Insert page table entry to map page's VA to frame's PA. */
-	return false;
+	frame->pinned = false;
+	return success;
 }
 
 
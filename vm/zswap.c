@@ -0,0 +1,385 @@
+/* zswap.c: Compressed cache in front of the swap disks.
+ *
+ * An anonymous page being swapped out is first offered to zswap.  A
+ * page of zeros is recorded as such, with no data at all.  Any other
+ * page is compressed and, if it shrinks enough and the pool has room,
+ * kept in the pool; swapping it back in then costs a decompression
+ * instead of a disk read.  Only the pages zswap refuses go to disk.
+ *
+ * The pool is made of kernel pages, taken from the kernel pool as it
+ * grows up to zswap_pool_limit pages and given back as soon as they
+ * are empty.  Each pool page is divided into CHUNK_SIZE-byte chunks;
+ * a compressed page takes a run of chunks within one pool page. */
+
+#include "vm/zswap.h"
+#include <debug.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* -zswap: Most pages in the pool; 0 disables zswap. */
+size_t zswap_pool_limit = ZSWAP_POOL_PAGES;
+
+/* Pool pages are allocated in chunks of this many bytes. */
+#define CHUNK_SIZE 64
+#define PAGE_CHUNKS (PGSIZE / CHUNK_SIZE)
+
+/* A page of the pool. */
+struct pool_page {
+	uint8_t *kva;               /* Kernel address of the page. */
+	uint64_t used;              /* Bit I set if chunk I is in use. */
+	struct list_elem elem;      /* Element in pool. */
+};
+
+/* A compressed page. */
+struct zswap_entry {
+	struct pool_page *pp;       /* Pool page holding the data. */
+	size_t chunk;               /* First chunk within PP. */
+	size_t size;                /* Size of the data in bytes. */
+};
+
+static struct list pool;        /* Pool pages. */
+static size_t pool_page_cnt;    /* Number of pool pages. */
+static struct lock zswap_lock;  /* Protects the pool, the compressor's
+								   buffers and the statistics. */
+
+/* Statistics. */
+static long long zero_cnt;      /* Zero pages stored. */
+static long long stored_cnt;    /* Pages stored compressed. */
+static long long reject_cnt;    /* Pages that did not compress. */
+static long long full_cnt;      /* Pages refused for lack of room. */
+static long long hit_cnt;       /* Swap-ins served by zswap. */
+static long long miss_cnt;      /* Swap-ins from disk. */
+static long long compressed_bytes;  /* Compressed size of all pages
+									   stored. */
+static long long stored_bytes;  /* Compressed size of pages in the
+								   pool now. */
+
+static size_t lz_compress (const uint8_t *src, uint8_t *dst, size_t limit);
+static void lz_decompress (const uint8_t *src, size_t size, uint8_t *dst);
+
+/* Initializes zswap. */
+void
+zswap_init (void) {
+	list_init (&pool);
+	lock_init (&zswap_lock);
+}
+
+/* Returns true if every byte of PAGE is zero. */
+static bool
+is_zero_page (const void *page) {
+	const uint64_t *p = page;
+	size_t i;
+
+	for (i = 0; i < PGSIZE / sizeof *p; i++)
+		if (p[i] != 0)
+			return false;
+	return true;
+}
+
+/* Returns a mask of CNT bits starting at bit IDX. */
+static uint64_t
+chunk_mask (size_t idx, size_t cnt) {
+	return (cnt < 64 ? (1ULL << cnt) - 1 : ~0ULL) << idx;
+}
+
+/* Allocates CNT consecutive chunks of a pool page, adding a page to
+ * the pool if none has room, and fills in E.  Returns false if the
+ * pool cannot grow.  ZSWAP_LOCK must be held. */
+static bool
+pool_alloc (size_t cnt, struct zswap_entry *e) {
+	struct pool_page *pp;
+	struct list_elem *el;
+	size_t i;
+
+	for (el = list_begin (&pool); el != list_end (&pool); el = list_next (el)) {
+		pp = list_entry (el, struct pool_page, elem);
+		for (i = 0; i + cnt <= PAGE_CHUNKS; i++)
+			if ((pp->used & chunk_mask (i, cnt)) == 0) {
+				pp->used |= chunk_mask (i, cnt);
+				e->pp = pp;
+				e->chunk = i;
+				return true;
+			}
+	}
+
+	if (pool_page_cnt >= zswap_pool_limit)
+		return false;
+	pp = malloc (sizeof *pp);
+	if (pp == NULL)
+		return false;
+	pp->kva = palloc_get_page (0);
+	if (pp->kva == NULL) {
+		free (pp);
+		return false;
+	}
+	pp->used = chunk_mask (0, cnt);
+	list_push_back (&pool, &pp->elem);
+	pool_page_cnt++;
+	e->pp = pp;
+	e->chunk = 0;
+	return true;
+}
+
+/* Releases the chunks of E, and their pool page if it becomes
+ * empty.  ZSWAP_LOCK must be held. */
+static void
+pool_free (struct zswap_entry *e) {
+	struct pool_page *pp = e->pp;
+
+	pp->used &= ~chunk_mask (e->chunk, DIV_ROUND_UP (e->size, CHUNK_SIZE));
+	if (pp->used == 0) {
+		list_remove (&pp->elem);
+		pool_page_cnt--;
+		palloc_free_page (pp->kva);
+		free (pp);
+	}
+}
+
+/* Offers PAGE, which is being swapped out, to zswap.  Returns true if
+ * zswap keeps it, storing in *ENTRYP the handle to pass to
+ * zswap_load() or zswap_free(): a null pointer for a page of zeros.
+ * Returns false if the page must go to disk. */
+bool
+zswap_store (const void *page, struct zswap_entry **entryp) {
+	static uint8_t buffer[ZSWAP_MAX_STORED];
+	struct zswap_entry *e;
+	size_t size;
+
+	if (zswap_pool_limit == 0)
+		return false;
+	if (is_zero_page (page)) {
+		lock_acquire (&zswap_lock);
+		zero_cnt++;
+		lock_release (&zswap_lock);
+		*entryp = NULL;
+		return true;
+	}
+
+	e = malloc (sizeof *e);
+	if (e == NULL)
+		return false;
+	lock_acquire (&zswap_lock);
+	size = lz_compress (page, buffer, sizeof buffer);
+	if (size == 0) {
+		reject_cnt++;
+		goto refuse;
+	}
+	if (!pool_alloc (DIV_ROUND_UP (size, CHUNK_SIZE), e)) {
+		full_cnt++;
+		goto refuse;
+	}
+	e->size = size;
+	memcpy (e->pp->kva + e->chunk * CHUNK_SIZE, buffer, size);
+	stored_cnt++;
+	compressed_bytes += size;
+	stored_bytes += size;
+	lock_release (&zswap_lock);
+	*entryp = e;
+	return true;
+
+ refuse:
+	lock_release (&zswap_lock);
+	free (e);
+	return false;
+}
+
+/* Fills PAGE with the contents stored as ENTRY, which was returned
+ * by zswap_store(), and releases ENTRY. */
+void
+zswap_load (struct zswap_entry *e, void *page) {
+	if (e == NULL)
+		memset (page, 0, PGSIZE);
+	else
+		lz_decompress (e->pp->kva + e->chunk * CHUNK_SIZE, e->size, page);
+
+	lock_acquire (&zswap_lock);
+	hit_cnt++;
+	if (e != NULL) {
+		stored_bytes -= e->size;
+		pool_free (e);
+	}
+	lock_release (&zswap_lock);
+	free (e);
+}
+
+/* Releases ENTRY, which was returned by zswap_store(), without
+ * loading it. */
+void
+zswap_free (struct zswap_entry *e) {
+	if (e == NULL)
+		return;
+	lock_acquire (&zswap_lock);
+	stored_bytes -= e->size;
+	pool_free (e);
+	lock_release (&zswap_lock);
+	free (e);
+}
+
+/* Counts a swap-in that zswap could not serve. */
+void
+zswap_count_disk_load (void) {
+	lock_acquire (&zswap_lock);
+	miss_cnt++;
+	lock_release (&zswap_lock);
+}
+
+/* Prints zswap statistics, if anything was swapped out. */
+void
+zswap_print_stats (void) {
+	long long loads = hit_cnt + miss_cnt;
+
+	if (zero_cnt + stored_cnt + reject_cnt + full_cnt == 0)
+		return;
+	printf ("zswap: %lld zero pages, %lld compressed, %lld incompressible,"
+			" %lld refused with pool full\n",
+			zero_cnt, stored_cnt, reject_cnt, full_cnt);
+	printf ("zswap: %lld of %lld swap-ins served from memory (%lld%%)\n",
+			hit_cnt, loads, loads > 0 ? hit_cnt * 100 / loads : 0);
+	if (compressed_bytes > 0)
+		printf ("zswap: compression ratio %lld.%02lld\n",
+				stored_cnt * PGSIZE / compressed_bytes,
+				stored_cnt * PGSIZE * 100 / compressed_bytes % 100);
+	printf ("zswap: %lld bytes in %zu pool pages\n",
+			stored_bytes, pool_page_cnt);
+}
+
+/* Compression.
+
+   A page is compressed with a small LZ77 variant in the style of
+   LZRW1.  The output is a sequence of items, each either a literal
+   byte or a match, a copy of earlier output.  Items come in groups of
+   up to 8, preceded by a flag byte whose bit I is set if item I of
+   the group is a match.  A match takes two bytes, the 12-bit distance
+   back to the copy's source and a 4-bit length code: codes 0 to 14
+   stand for lengths 3 to 17, while code 15 is followed by a byte
+   giving the length minus 18.  Matches are found through a table,
+   indexed by a hash of 3 bytes, of the last position at which each
+   hash was seen. */
+
+#define MIN_MATCH 3
+#define MAX_MATCH (18 + 255)
+#define MAX_DISTANCE (PGSIZE - 1)
+
+#define HASH_BITS 12
+static uint16_t lz_table[1 << HASH_BITS];   /* Protected by ZSWAP_LOCK. */
+
+/* Returns the hash of the 3 bytes at P. */
+static size_t
+lz_hash (const uint8_t *p) {
+	uint32_t v = p[0] | p[1] << 8 | p[2] << 16;
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Compresses the page at SRC into DST, which has room for LIMIT
+   bytes, and returns the size of the result, or 0 if it would not
+   fit.  ZSWAP_LOCK must be held, for LZ_TABLE.  The table is not
+   cleared between pages: a stale entry is caught by checking that
+   the bytes match. */
+static size_t
+lz_compress (const uint8_t *src, uint8_t *dst, size_t limit) {
+	size_t pos = 0, out = 0, flags = 0;
+	int item = 8;
+
+	while (pos < PGSIZE) {
+		size_t len = 0, cand = 0, need;
+
+		if (pos + MIN_MATCH <= PGSIZE) {
+			size_t h = lz_hash (src + pos);
+
+			cand = lz_table[h];
+			lz_table[h] = pos;
+			if (cand < pos && pos - cand <= MAX_DISTANCE
+					&& !memcmp (src + cand, src + pos, MIN_MATCH)) {
+				len = MIN_MATCH;
+				while (pos + len < PGSIZE && len < MAX_MATCH
+						&& src[cand + len] == src[pos + len])
+					len++;
+			}
+		}
+
+		/* Room for the item, and for the flag byte of a new group. */
+		need = len == 0 ? 1 : len - MIN_MATCH < 15 ? 2 : 3;
+		if (item == 8)
+			need++;
+		if (out + need > limit)
+			return 0;
+		if (item == 8) {
+			flags = out++;
+			dst[flags] = 0;
+			item = 0;
+		}
+
+		if (len != 0) {
+			size_t distance = pos - cand;
+			size_t code = len - MIN_MATCH < 15 ? len - MIN_MATCH : 15;
+
+			dst[flags] |= 1 << item;
+			dst[out++] = distance & 0xff;
+			dst[out++] = (distance >> 8) << 4 | code;
+			if (code == 15)
+				dst[out++] = len - 18;
+			pos += len;
+		} else
+			dst[out++] = src[pos++];
+		item++;
+	}
+	return out;
+}
+
+/* Decompresses the SIZE bytes at SRC, produced by lz_compress(),
+   into the page at DST. */
+static void
+lz_decompress (const uint8_t *src, size_t size, uint8_t *dst) {
+	size_t in = 0, pos = 0;
+	uint8_t flags = 0;
+	int item = 8;
+
+	while (pos < PGSIZE) {
+		if (item == 8) {
+			flags = src[in++];
+			item = 0;
+		}
+		if (flags & (1 << item)) {
+			size_t distance = src[in] | (src[in + 1] >> 4) << 8;
+			size_t len = (src[in + 1] & 0xf) + MIN_MATCH;
+
+			in += 2;
+			if (len == 15 + MIN_MATCH)
+				len = 18 + src[in++];
+			ASSERT (distance > 0 && distance <= pos);
+			ASSERT (pos + len <= PGSIZE);
+			for (; len > 0; len--, pos++)
+				dst[pos] = dst[pos - distance];
+		} else
+			dst[pos++] = src[in++];
+		item++;
+	}
+	ASSERT (in == size);
+}
+
+/* Compresses PAGE into DST, which has room for LIMIT bytes, and
+   returns the size of the result, or 0 if it would not fit.  Nothing
+   is written past LIMIT bytes. */
+size_t
+zswap_compress (const void *page, void *dst, size_t limit) {
+	size_t size;
+
+	lock_acquire (&zswap_lock);
+	size = lz_compress (page, dst, limit);
+	lock_release (&zswap_lock);
+	return size;
+}
+
+/* Decompresses the SIZE bytes at SRC, produced by zswap_compress(),
+   into PAGE. */
+void
+zswap_decompress (const void *src, size_t size, void *page) {
+	lz_decompress (src, size, page);
+}